@@ -5,6 +5,16 @@
 .global _start
 .type _start, function
 _start:
+	// memset_zva_len = dczid_el0.DZP ? 0 : 4 << dczid_el0.BS
+	mrs x1, dczid_el0
+	and x2, x1, #15
+	mov x3, #4
+	lsl x3, x3, x2
+	tst x1, #16
+	csel x3, xzr, x3, ne
+	adrp x2, memset_zva_len
+	str x3, [x2, #:lo12:memset_zva_len]
+
 	mov x29, #0
 	mov x30, #0
 	mov x0, sp
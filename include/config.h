@@ -4,10 +4,74 @@
 /* Length of each cache line on this platform */
 #define LIBC_CACHE_LINE_LEN 64
 
-/* Maximum number of concurrent threads in this program */
-#define LIBC_MAX_THREAD_NUM 1
+/* Size of the stack of each thread created by thread_create */
+#define LIBC_THREAD_STACK_SIZE (1ull << 20)
 
-/* Minimum number of chunks to keep always available for each allocator */
-#define LIBC_KEEP_CHUNK_NUM 1
+/* Number of times mutex_lock polls a held mutex before sleeping in the kernel */
+#define LIBC_MUTEX_SPIN 100
+
+/* Number of tasks each worker of a thread pool can hold in its deque (a power of two) */
+#define LIBC_THREAD_POOL_DEQUE_SIZE 1024
+
+/* Number of objects in each batch retired by epoch-based reclamation;
+   each thread tries to reclaim objects every that many retirements
+ */
+#define LIBC_EBR_BATCH 64
+
+/* Time (in milliseconds) that freed pages of the buddy allocator stay resident before they are purged */
+#define LIBC_BUDDY_DECAY_MS 1000
+
+/* Huge page mode of the memory allocator:
+   0: disabled;
+   1: buddy chunks and large mmap allocations are backed by transparent huge pages (MADV_HUGEPAGE);
+   2: buddy chunks and large mmap allocations use explicit huge pages (MAP_HUGETLB), which must be reserved beforehand.
+ */
+#define LIBC_HUGEPAGE_MODE 0
+
+/* Size of each huge page */
+#define LIBC_HUGEPAGE_SIZE (2ull << 20)
+
+/* madvise advice used to purge freed pages: MADV_DONTNEED or MADV_FREE */
+#define LIBC_PURGE_ADVICE MADV_DONTNEED
+
+/* Maximum number of freed slots cached for each small class in each arena (unused with LIBC_MALLOC_PERCPU_CACHE) */
+#define LIBC_SMALL_CACHE_NUM 32
+
+/* Whether freed small slots are cached per CPU, shared by all threads, using restartable sequences (see small_class.c) */
+#define LIBC_MALLOC_PERCPU_CACHE 0
+
+/* Maximum number of freed slots cached for each small class on each CPU */
+#define LIBC_PERCPU_CACHE_NUM 32
+
+/* Number of CPUs with per-CPU caches; threads running on CPUs with larger IDs only use the caches of their arenas */
+#define LIBC_PERCPU_CACHE_CPUS 256
+
+/* Maximum number (at least 1) and total size of freed mmap regions cached for reuse in each arena */
+#define LIBC_MMAP_CACHE_NUM 8
+#define LIBC_MMAP_CACHE_BYTES (32ull << 20)
+
+/* Number of buckets for buffering frees of memory allocated by other threads, in each arena */
+#define LIBC_REMOTE_FREE_BUCKETS 8
+
+/* Number of regions buffered in a bucket before they are handed to their owner */
+#define LIBC_REMOTE_FREE_BATCH 64
+
+/* Whether the memory allocator maintains statistics (see malloc_stats_with_arena) */
+#define LIBC_MALLOC_STATS 0
+
+/* Whether malloc samples allocations for heap profiling (see malloc_profile_dump_with_arena).
+   Backtraces are found by walking frame records, so the library and the program
+   must be built without -fomit-frame-pointer when this is set (the Makefile drops it for the library).
+ */
+#define LIBC_MALLOC_PROFILE 0
+
+/* Mean number of bytes allocated between two samples */
+#define LIBC_MALLOC_PROFILE_INTERVAL (512ull << 10)
+
+/* Number of sampled allocations remembered by each arena; the oldest record is overwritten when full */
+#define LIBC_MALLOC_PROFILE_RECORDS 128
+
+/* Number of return addresses in the backtrace of each sampled allocation */
+#define LIBC_MALLOC_PROFILE_DEPTH 6
 
 #endif
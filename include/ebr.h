@@ -0,0 +1,52 @@
+#ifndef EBR_H
+#define EBR_H
+
+#include <stdint.h>
+#include <config.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Epoch-based reclamation (see ebr.c).
+
+   Threads reading a shared lock-free structure do so between ebr_enter() and ebr_exit().
+   A thread that unlinks an object allocated with malloc() passes it to ebr_retire() instead of free(),
+   and the object is freed once no thread can still be reading it.
+   Critical sections may be nested, but must not span thread_unregister().
+ */
+
+struct ebr_batch;
+
+/* Objects retired by a thread during one epoch */
+struct ebr_limbo {
+  uint64_t epoch;
+  struct ebr_batch * batches;
+};
+
+/* Per-thread state, kept in the tls_struct */
+struct ebr_thread_t {
+  /* 0 outside critical sections, (epoch << 1) | 1 inside */
+  uint64_t state;
+  uint32_t nesting;
+  uint32_t retired_since_scan;
+  struct ebr_limbo limbo[3];
+};
+
+void ebr_enter (void);
+
+void ebr_exit (void);
+
+/* Free ptr once every critical section running now has ended.
+   Returns 0 if no memory is available to record ptr, in which case it is left to the caller.
+ */
+uint32_t ebr_retire (void * ptr);
+
+/* Try to advance the global epoch, and free the objects retired by the calling thread that are now safe to free */
+void ebr_reclaim (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -2,7 +2,11 @@
 #define MEMORY_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include <io_types.h>
+#include <queue.h>
+#include <sync.h>
+#include <config.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -18,12 +22,27 @@ extern "C" {
 #define MAP_SHARED_VALIDATE 0x03
 #define MAP_FIXED 0x10
 #define MAP_ANONYMOUS 0x20
+#define MAP_HUGETLB 0x40000
 #define MAP_FIXED_NOREPLACE 0x100000
+#define MREMAP_MAYMOVE 1
+#define MREMAP_FIXED 2
+#define MREMAP_DONTUNMAP 4
+#define MADV_NORMAL 0
+#define MADV_DONTNEED 4
+#define MADV_FREE 8
+#define MADV_HUGEPAGE 14
+#define MADV_NOHUGEPAGE 15
 
 void * mmap (void * addr, size_t len, int prot, int flags, fd_t fd, ssize_t offset);
 
 int munmap (void * addr, size_t len);
 
+void * mremap (void * old_addr, size_t old_len, size_t new_len, int flags, void * new_addr);
+
+int madvise (void * addr, size_t len, int advice);
+
+int mprotect (void * addr, size_t len, int prot);
+
 /* We implement three layers of memory allocator: mmap-alloc, buddy-alloc, and small-class-alloc.
    Each layer implements two functions:
    void * X_alloc (size_t len, void ** ctx_ptr, void * arena);
@@ -36,7 +55,7 @@ int munmap (void * addr, size_t len);
    For each layer, the len argument must belong to a predetermined set.
    For mmap-alloc it is any multiple of 4096 smaller than 1 << 48.
    For buddy-alloc it is 4096, 8192, ..., 262144.
-   For small-class-alloc it is 32, 64, 96, ..., 512, 1024, 2048.
+   For small-class-alloc it is 32, 64, 96, ..., 512, 640, 768, 896, 1024, 1280, 1536, 1792, 2048.
    It returns a pointer to the beginning of the allocated region, as well as a context pointer.
 
    Since the buddy allocator only provides 7 sizes, we provide buddy_alloc_0, ..., buddy_alloc_7 as specialized versions of buddy_alloc.
@@ -49,14 +68,62 @@ int munmap (void * addr, size_t len);
    arena must be the state pointer used to call alloc.
    ptr can be any address that is within the allocated region.
    For mmap_alloc, the context pointer and returned pointer are identical.
+
+   Buddy chunks are aligned to their size (128 pages), hence each block returned by buddy_alloc_N is aligned to its own size.
+   In particular, blocks of small-class-alloc are aligned to 65536 bytes.
+
+   mmap-alloc and buddy-alloc can also resize an allocation in place:
+   mmap_realloc moves the region with mremap if necessary,
+   buddy_grow_pages extends a run of pages by taking the available pages after it,
+   and buddy_shrink_pages returns the pages at the end of a run.
  */
 
 /* Interfaces of mmap-alloc */
 
 void * mmap_alloc (size_t len, void ** ctx_ptr);
 
+void * mmap_alloc_aligned (size_t len, size_t alignment, void ** ctx_ptr);
+
+void * mmap_realloc (void * ctx, size_t old_len, size_t new_len, void ** ctx_ptr);
+
 void mmap_free (__attribute__((unused)) void * ptr, void * ctx, size_t len);
 
+/* The mmap-alloc arena structure, caching recently freed regions */
+
+struct mmap_cache_entry {
+  void *region;
+  size_t len;
+};
+
+struct mmap_arena_t {
+  struct mmap_cache_entry entries[LIBC_MMAP_CACHE_NUM];
+  uint32_t num;
+  size_t bytes;
+#if LIBC_MALLOC_STATS
+  int64_t stat_live_bytes;
+#endif
+};
+
+/* Same as mmap_alloc and mmap_free, but regions are cached in arena for reuse.
+   mmap_cache_alloc outputs whether the region is known to be filled with zeroes, i.e. it is not reused from the cache.
+ */
+void * mmap_cache_alloc (size_t len, void ** ctx_ptr, void * arena, uint32_t * clean_ptr);
+
+/* The live bytes (see mmap_stats) are accounted against owner, the arena that allocated the region,
+   even when the region is freed into the cache of another arena.
+ */
+void mmap_cache_free (void * ptr, void * ctx, size_t len, void * arena, void * owner);
+
+/* Same as mmap_realloc, but the change in length is accounted against arena, the arena that allocated the region. */
+void * mmap_cache_realloc (void * ctx, size_t old_len, size_t new_len, void ** ctx_ptr, void * arena);
+
+/* Unmap all regions cached in arena. Returns the number of bytes unmapped. */
+size_t mmap_cache_flush (void * arena);
+
+struct malloc_stats;
+
+void mmap_stats (void * arena, struct malloc_stats * stats);
+
 /* The buddy-alloc arena structure */
 
 struct buddy_chunk_state;
@@ -73,6 +140,10 @@ struct buddy_arena_t {
   struct buddy_chunk_state *avail1_list_head;
   struct buddy_chunk_state *avail0_list_head;
   uint32_t chunk_num;
+  /* Chunks with freed pages that have not been purged (see buddy_decay_sweep) */
+  struct buddy_chunk_state *unpurged_list_head;
+  uint64_t decay_ticks; // Length of the decay period in ticks of the generic timer, 0 until the first tick
+  uint64_t last_sweep_tick;
 };
 
 /* Interfaces of buddy-alloc */
@@ -105,39 +176,306 @@ void buddy_free_1 (void * ptr, void * ctx, void * arena);
 
 void buddy_free_0 (void * ptr, void * ctx, void * arena);
 
+/* Runs of 1 <= n <= 64 contiguous pages.
+   A run of n pages is aligned to (1 << ceil(log2(n))) pages.
+   ptr must be the start of the run.
+ */
+void * buddy_alloc_pages (size_t n, void ** ctx_ptr, void * arena);
+
+/* Same as buddy_alloc_pages, but the run is also aligned to (1 << align_order) pages, where align_order <= 6 */
+void * buddy_alloc_pages_aligned (size_t n, uint32_t align_order, void ** ctx_ptr, void * arena);
+
+void buddy_free_pages (void * ptr, void * ctx, size_t n, void * arena);
+
+/* Unmap empty chunks beyond keep_bytes, purge all available pages, and unmap unused groups of chunk records.
+   Returns the number of bytes returned to the OS.
+ */
+size_t buddy_trim (void * arena, size_t keep_bytes);
+
+/* Purge the pages that have stayed free for a whole decay period (LIBC_BUDDY_DECAY_MS), if a period has passed since the last sweep.
+   Cheap enough to be called on every allocation and free. Pages are only purged from these calls, or by buddy_trim.
+ */
+void buddy_decay_tick (void * arena);
+
+void buddy_stats (void * arena, struct malloc_stats * stats);
+
+/* Returns the context pointer of the chunk containing ptr, or NULL if ptr is not within any chunk of any arena */
+void * buddy_lookup_chunk (void * ptr);
+
+/* Native runs of pages carry no header: their length and arena are recorded in the state of their chunk.
+   buddy_mark_native marks a run returned by buddy_alloc_pages(_aligned) as native.
+   buddy_lookup_native returns the context pointer if ptr is the start of a native run, and outputs its length and arena;
+   otherwise it returns NULL. It may be called by any thread.
+   buddy_free_native frees a native run.
+ */
+void buddy_mark_native (void * ptr, void * ctx, size_t n);
+
+void * buddy_lookup_native (void * ptr, size_t * n_ptr, void ** arena_ptr);
+
+void buddy_free_native (void * ptr, void * ctx, size_t n, void * arena);
+
+/* Returns 1 if the run starting from ptr is extended from old_n to new_n pages, 0 otherwise */
+uint32_t buddy_grow_pages (void * ptr, void * ctx, size_t old_n, size_t new_n, void * arena);
+
+void buddy_shrink_pages (void * ptr, void * ctx, size_t old_n, size_t new_n, void * arena);
+
+/* Returns 1 if the len bytes starting from the page containing ptr are known to be filled with zeroes.
+   This is the case if none of these pages has been freed since the chunk was mapped.
+ */
+uint32_t buddy_is_clean (void * ptr, void * ctx, size_t len);
+
 /* The small-class-alloc arena structure */
 
 struct small_class_block;
 
 struct small_class_arena_t {
   struct buddy_arena_t *buddy_arena;
-  struct small_class_block *small_class_avail_lists[16];
-  struct small_class_block *class1024_avail_list;
-  struct small_class_block *class2048_avail_list;
+  struct small_class_block *small_class_avail_lists[24];
+  /* LIFO cache of recently freed slots for each class */
+  void *cache_lists[24];
+  uint32_t cache_num[24];
+#if LIBC_MALLOC_STATS
+  uint64_t stat_live_slots[24];
+  uint64_t stat_blocks[24];
+#endif
 };
 
 void * small_alloc (size_t len, void ** ctx_ptr, void * arena);
 
+/* Same as small_alloc, but the returned slot is filled with zeroes */
+void * small_calloc (size_t len, void ** ctx_ptr, void * arena);
+
 void small_free (void * ptr, void * ctx, size_t len, void * arena);
 
+/* Batched versions of small_alloc and small_free.
+   small_alloc_bulk returns the number of slots allocated.
+   All slots passed to small_free_bulk must have been allocated by this arena.
+ */
+size_t small_alloc_bulk (size_t len, size_t n, void ** out_ptrs, void * arena);
+
+void small_free_bulk (void ** ptrs, size_t n, void * arena);
+
+/* Return all cached slots to their blocks, and release all empty blocks to buddy-alloc.
+   Returns the number of blocks released.
+ */
+size_t small_trim (void * arena);
+
+void small_stats (void * arena, struct malloc_stats * stats);
+
+/* Given any address within a small-class slot, find the context pointer and length of the slot.
+   Returns the small-class arena that made the allocation.
+ */
+void * small_lookup (void * ptr, void ** ctx_ptr, size_t * len_ptr);
+
+/* Given any address within a small-class slot, returns the address just past the end of the slot */
+void * small_slot_end (void * ptr, void * ctx, size_t len);
+
+/* Per-CPU caches of freed slots, in front of the caches of the arenas (when LIBC_MALLOC_PERCPU_CACHE is set).
+   small_percpu_alloc returns a slot of size class len cached on the current CPU, or NULL.
+   small_percpu_free caches a slot of any arena on the current CPU, and returns 0 if it cannot.
+ */
+void * small_percpu_alloc (size_t len);
+
+uint32_t small_percpu_free (void * ptr);
+
+/* Object pools on top of small-class-alloc (see pool_create_with_arena).
+   Each pool hands out objects of a single stride from its own list of blocks,
+   and must only be used by the thread whose small-class arena it was initialized with, except for freeing objects.
+ */
+
+struct malloc_arena_t;
+
+struct pool_t {
+  struct malloc_arena_t * arena;
+  struct small_class_block * avail_list;
+  struct small_class_block * full_list;
+  uint64_t stride;
+  uint32_t slot_offset;
+  uint32_t slot_num;
+};
+
+/* Compute the layout of a pool of objects of obj_size bytes aligned to align.
+   Returns 0 if align is not a power of two, or the size or alignment is too large.
+ */
+uint32_t small_pool_init (struct pool_t * pool, size_t obj_size, size_t align);
+
+void * small_pool_alloc (struct pool_t * pool, void * arena);
+
+/* ptr can be any address within the object */
+void small_pool_free (void * ptr, struct pool_t * pool, void * arena);
+
+/* Given any address within an object of a pool, find the pool */
+struct pool_t * small_pool_lookup (void * ptr);
+
+/* Release all blocks of a pool, including those whose objects have not all been freed */
+void small_pool_destroy (struct pool_t * pool, void * arena);
+
 /* Per-thread malloc data structure */
 
+/* Regions freed on behalf of another arena, linked through their first 8 bytes */
+struct malloc_remote_bucket {
+  struct malloc_arena_t * owner;
+  void * first;
+  void * last;
+  uint32_t num;
+};
+
+/* A sampled allocation, recorded by the heap profiler.
+   ret_addr is the return address of the call to malloc, and frames holds the return addresses of the callers above it,
+   innermost first, followed by zeroes.
+ */
+struct malloc_profile_record {
+  void * ptr;
+  uint64_t size;
+  uint64_t class_size;
+  void * ret_addr;
+  void * frames[LIBC_MALLOC_PROFILE_DEPTH];
+};
+
+struct malloc_profile_t {
+  /* Only used by the thread of the arena */
+  int64_t bytes_until_sample;
+  uint64_t rng_state;
+  /* Protects the records below, which are also dropped by the threads freeing sampled allocations */
+  struct mutex_t lock;
+  uint32_t next_record;
+  uint32_t live_records;
+  /* Number of live records in each bucket, selected by a hash of the address, so that free() rarely needs to search */
+  uint8_t filter[256];
+  struct malloc_profile_record records[LIBC_MALLOC_PROFILE_RECORDS];
+};
+
 struct malloc_arena_t {
   struct buddy_arena_t buddy_arena;
   struct small_class_arena_t small_class_arena;
-  void * free_set_head;
-  void * free_set_tail;
-  void * free_set_placeholder;
+  struct mmap_arena_t mmap_arena;
+  struct mpsc_queue_t free_set;
+  struct malloc_remote_bucket remote_buckets[LIBC_REMOTE_FREE_BUCKETS];
+#if LIBC_MALLOC_STATS
+  uint64_t stat_requested_bytes;
+  uint64_t stat_reserved_bytes;
+#endif
+#if LIBC_MALLOC_PROFILE
+  struct malloc_profile_t profile;
+#endif
+};
+
+/* Statistics of an arena, filled by malloc_stats_with_arena.
+   Fields marked (*) are only maintained if LIBC_MALLOC_STATS is set in config.h, and are zero otherwise.
+   The other fields are computed by walking the data structures of the arena.
+ */
+struct malloc_stats {
+  /* Small-class-alloc, for each size class */
+  uint64_t small_class_size[24];
+  uint64_t small_live_slots[24]; /* (*) Slots handed out to the user */
+  uint64_t small_cached_slots[24]; /* Freed slots held in the cache */
+  uint64_t small_blocks[24]; /* (*) Blocks of 64KiB held */
+  /* Buddy-alloc */
+  uint64_t buddy_chunks;
+  uint64_t buddy_empty_chunks;
+  uint64_t buddy_full_chunks;
+  uint64_t buddy_avail_blocks[7]; /* Available blocks of each order, over all chunks */
+  uint64_t buddy_used_pages;
+  uint64_t buddy_unpurged_pages; /* Available pages whose physical memory has not been purged */
+  uint64_t buddy_chunk_groups;
+  /* mmap-alloc */
+  int64_t mmap_live_bytes; /* (*) Bytes of the live regions allocated by this arena, wherever they are freed */
+  uint64_t mmap_cached_bytes;
+  /* malloc */
+  uint64_t requested_bytes; /* (*) Total bytes requested by all allocations so far */
+  uint64_t reserved_bytes; /* (*) Total bytes reserved for these allocations, including headers and rounding */
+  uint64_t pending_remote_frees; /* Regions freed by other threads, waiting in the free set of this arena */
+  uint64_t buffered_remote_frees; /* Regions freed by this arena on behalf of other arenas, not handed over yet */
 };
 
 void * malloc_with_arena (size_t size, struct malloc_arena_t * arena);
 
 void * aligned_alloc_with_arena (size_t alignment, size_t size, struct malloc_arena_t * arena);
 
+void * calloc_with_arena (size_t nmemb, size_t size, struct malloc_arena_t * arena);
+
+void * realloc_with_arena (void * ptr, size_t size, struct malloc_arena_t * arena);
+
 void free_with_arena (void * ptr, struct malloc_arena_t * arena);
 
 void clear_free_set_of_arena (struct malloc_arena_t * arena);
 
+/* Hand all regions freed on behalf of other arenas to their owners */
+void flush_remote_frees_of_arena (struct malloc_arena_t * arena);
+
+/* Return as much free memory of arena to the OS as possible, keeping at most keep_bytes of empty buddy chunks mapped.
+   Returns the number of bytes returned to the OS.
+ */
+size_t malloc_trim_with_arena (size_t keep_bytes, struct malloc_arena_t * arena);
+
+/* Fill in the statistics of arena. Must be called by the thread owning arena. */
+void malloc_stats_with_arena (struct malloc_arena_t * arena, struct malloc_stats * stats);
+
+/* Allocate n regions of the same size, and store them into out_ptrs.
+   Returns the number of regions allocated, which is less than n only upon failure.
+ */
+size_t malloc_bulk_with_arena (size_t size, size_t n, void ** out_ptrs, struct malloc_arena_t * arena);
+
+void free_bulk_with_arena (void ** ptrs, size_t n, struct malloc_arena_t * arena);
+
+/* Create a pool of objects of exactly obj_size bytes (at least 32), aligned to align (at least 8).
+   obj_size may be at most 8192, and align at most 4096.
+   Objects are allocated with pool_alloc by the thread owning arena, and may be freed by any thread with pool_free.
+   An object freed by another thread is handed to the free set of the owner right away, without batching (see free_with_arena).
+   Returns NULL upon failure.
+ */
+struct pool_t * pool_create_with_arena (size_t obj_size, size_t align, struct malloc_arena_t * arena);
+
+void pool_free_with_arena (struct pool_t * pool, void * obj, struct malloc_arena_t * arena);
+
+/* Destroy a pool, releasing all of its memory, including objects that have not been freed.
+   Must be called by the thread owning the pool, after every pool_free call on the pool has returned.
+ */
+void pool_destroy (struct pool_t * pool);
+
+/* Region allocator (see region.c).
+   Memory is handed out by bumping a pointer, and is only released by resetting the region to a mark, or destroying it.
+   A region must only be used by the thread owning its arena.
+ */
+
+struct region_chunk;
+
+struct region_t {
+  struct malloc_arena_t * arena;
+  struct region_chunk * chunk;
+  uintptr_t cursor;
+  uintptr_t limit;
+};
+
+struct region_mark {
+  struct region_chunk * chunk;
+  uintptr_t cursor;
+};
+
+void region_init_with_arena (struct region_t * region, struct malloc_arena_t * arena);
+
+/* Allocate size bytes aligned to alignment, which must be a power of two of at most 4096.
+   Returns NULL upon failure.
+ */
+void * region_alloc (struct region_t * region, size_t size, size_t alignment);
+
+/* Record the current state of region */
+struct region_mark region_mark (struct region_t * region);
+
+/* Release everything allocated from region since mark was taken */
+void region_reset_to_mark (struct region_t * region, struct region_mark mark);
+
+/* Release everything allocated from region */
+void region_destroy (struct region_t * region);
+
+/* Write the records of all sampled allocations that are still live, and whose memory belongs to arena, to fd,
+   as an array of struct malloc_profile_record.
+   These include allocations made by other threads from the per-CPU cache.
+   Returns the number of records written. Always returns 0 if LIBC_MALLOC_PROFILE is not set.
+   Must be called by the thread owning arena.
+ */
+size_t malloc_profile_dump_with_arena (fd_t fd, struct malloc_arena_t * arena);
+
 /* Must be called by each thread upon initialization */
 void malloc_init (void);
 
@@ -145,10 +483,37 @@ void * malloc (size_t len);
 
 void * aligned_alloc (size_t alignment, size_t size);
 
+void * calloc (size_t nmemb, size_t size);
+
+void * realloc (void * ptr, size_t size);
+
 void free (void * ptr);
 
+size_t malloc_bulk (size_t size, size_t n, void ** out_ptrs);
+
+void free_bulk (void ** ptrs, size_t n);
+
+/* Complete the frees pending in the free set of the calling thread,
+   and hand the regions it freed on behalf of other threads to their owners.
+ */
 void clear_free_set (void);
 
+/* Freed pages are only purged after a decay period, from later calls into the allocator (see buddy_decay_tick).
+   A thread about to go idle can call malloc_trim to return them, and its empty chunks, to the OS right away.
+ */
+size_t malloc_trim (size_t keep_bytes);
+
+size_t malloc_profile_dump (fd_t fd);
+
+struct pool_t * pool_create (size_t obj_size, size_t align);
+
+/* Must be called by the thread that created pool */
+void * pool_alloc (struct pool_t * pool);
+
+void pool_free (struct pool_t * pool, void * obj);
+
+void region_init (struct region_t * region);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,165 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <config.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Concurrent queues for passing pointers between threads.
+
+   struct mpsc_queue_t is an unbounded intrusive queue with any number of producers and a single consumer,
+   following the "non-linearizable queue" of snmalloc (https://dl.acm.org/doi/pdf/10.1145/3315573.3329980).
+   It is the queue behind the free set of each malloc arena.
+   Elements are linked through a struct mpsc_node, which the caller embeds in them (or overlays on their first 8 bytes).
+   A producer swaps the tail with its element, then links the previous tail to it.
+   Until that link is written, the consumer cannot see the new element, nor any element pushed after it:
+   mpsc_queue_pop may return NULL while a push is still in progress, so the queue is not linearizable.
+   The last element cannot be taken out while a producer may be linking an element after it,
+   so the consumer pushes the placeholder node of the queue behind it first.
+   The placeholder must not be pushed again while it is still in the queue,
+   since that would link it to itself; the consumer then waits for the link to the element after the head instead.
+
+   struct spsc_ring_t is a bounded ring with a single producer and a single consumer,
+   and struct mpmc_ring_t a bounded ring with any number of producers and consumers,
+   following Dmitry Vyukov's bounded MPMC queue: each cell carries a sequence number telling whether it is ready to be written or read,
+   so producers and consumers only contend on their own index.
+   Both rings use storage provided by the caller, whose capacity must be a power of two,
+   and keep the indices written by producers and consumers on different cache lines.
+ */
+
+struct mpsc_node {
+  struct mpsc_node * next;
+};
+
+struct mpsc_queue_t {
+  /* Only accessed by the consumer */
+  struct mpsc_node * head;
+  struct mpsc_node placeholder;
+  uint64_t placeholder_queued;
+  char consumer_pad[LIBC_CACHE_LINE_LEN - 3 * sizeof (uint64_t)];
+  /* Swapped by producers */
+  struct mpsc_node * tail;
+};
+
+static inline void mpsc_queue_init (struct mpsc_queue_t * queue) {
+  queue->placeholder.next = NULL;
+  queue->placeholder_queued = 1;
+  queue->head = &queue->placeholder;
+  queue->tail = &queue->placeholder;
+}
+
+/* mpsc_queue_push_list
+   Append a pre-linked list of elements, from first to last, with a single swap of the tail.
+   The next pointer of last need not be initialized.
+ */
+static inline void mpsc_queue_push_list (struct mpsc_queue_t * queue, struct mpsc_node * first, struct mpsc_node * last) {
+  struct mpsc_node * curr_tail;
+  uint32_t fail;
+
+  __atomic_store_n (&last->next, NULL, __ATOMIC_SEQ_CST);
+
+  /* Swap tail with last, and store original tail into curr_tail */
+  __asm__ volatile (
+    "1:\n\t"
+    "ldxr %[load_reg], [%[tail_ptr_reg]]\n\t"
+    "stxr %w[fail_reg], %[new_val_reg], [%[tail_ptr_reg]]\n\t"
+    "cbnz %w[fail_reg], 1b\n\t"
+    "dmb ish"
+  : [load_reg] "=&r" (curr_tail), [fail_reg] "=&r" (fail)
+  : [tail_ptr_reg] "r" (&queue->tail), [new_val_reg] "r" (last)
+  : "memory"
+  );
+
+  __atomic_store_n (&curr_tail->next, first, __ATOMIC_SEQ_CST);
+}
+
+static inline void mpsc_queue_push (struct mpsc_queue_t * queue, struct mpsc_node * node) {
+  mpsc_queue_push_list (queue, node, node);
+}
+
+/* mpsc_queue_pop
+   Take the element at the head of the queue. Must only be called by the consumer.
+   Returns NULL if the queue is empty, or if the next element is still being pushed.
+ */
+static inline struct mpsc_node * mpsc_queue_pop (struct mpsc_queue_t * queue) {
+  struct mpsc_node * head = queue->head;
+
+  while (true) {
+    struct mpsc_node * next = __atomic_load_n (&head->next, __ATOMIC_SEQ_CST);
+    if (head == &queue->placeholder) {
+      /* If the placeholder is the last element, we have reached the end */
+      if (next == NULL) break;
+      /* Otherwise, take the placeholder out of the queue */
+      head = next;
+      queue->placeholder_queued = 0;
+    } else if (next != NULL) {
+      /* If the current head is not the last element, take it out */
+      queue->head = next;
+      return head;
+    } else if (!queue->placeholder_queued) {
+      /* The last element cannot be taken out, we insert the placeholder after it */
+      queue->placeholder_queued = 1;
+      mpsc_queue_push (queue, &queue->placeholder);
+    } else {
+      /* A push after the head has swapped the tail, but not linked its element yet */
+      break;
+    }
+  }
+
+  queue->head = head;
+  return NULL;
+}
+
+struct spsc_ring_t {
+  /* Written by the producer */
+  uint64_t tail;
+  uint64_t head_cache;
+  char producer_pad[LIBC_CACHE_LINE_LEN - 2 * sizeof (uint64_t)];
+  /* Written by the consumer */
+  uint64_t head;
+  uint64_t tail_cache;
+  char consumer_pad[LIBC_CACHE_LINE_LEN - 2 * sizeof (uint64_t)];
+  void ** slots;
+  uint64_t mask;
+};
+
+struct mpmc_cell {
+  uint64_t seq;
+  void * data;
+};
+
+struct mpmc_ring_t {
+  uint64_t enqueue_pos;
+  char enqueue_pad[LIBC_CACHE_LINE_LEN - sizeof (uint64_t)];
+  uint64_t dequeue_pos;
+  char dequeue_pad[LIBC_CACHE_LINE_LEN - sizeof (uint64_t)];
+  struct mpmc_cell * cells;
+  uint64_t mask;
+};
+
+/* Initialize a ring holding at most capacity elements in the given storage.
+   Returns 0 if capacity is not a power of two.
+ */
+uint32_t spsc_ring_init (struct spsc_ring_t * ring, void ** slots, uint64_t capacity);
+
+uint32_t mpmc_ring_init (struct mpmc_ring_t * ring, struct mpmc_cell * cells, uint64_t capacity);
+
+/* Push returns 0 if the ring is full; pop returns 0 if the ring is empty, and stores the element into out otherwise */
+uint32_t spsc_ring_push (struct spsc_ring_t * ring, void * data);
+
+uint32_t spsc_ring_pop (struct spsc_ring_t * ring, void ** out);
+
+uint32_t mpmc_ring_push (struct mpmc_ring_t * ring, void * data);
+
+uint32_t mpmc_ring_pop (struct mpmc_ring_t * ring, void ** out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -43,6 +43,13 @@ struct vgetrandom_opaque_params {
 /* This function should be called after interpret_vdso_from_auxv() */
 void setup_vdso_getrandom (void);
 
+/* Allocate an opaque state for the vDSO getrandom, to be stored in the tls_struct of a thread.
+   Returns NULL if vDSO getrandom is not available, in which case the thread uses the shared page indexed by its thread ID,
+   or the syscall if its ID does not fit in that page.
+   This function should be called after setup_vdso_getrandom()
+ */
+void * getrandom_alloc_state (void);
+
 #ifdef __cplusplus
 }
 #endif
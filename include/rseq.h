@@ -0,0 +1,54 @@
+/* rseq.h
+   Adapted from Linux kernel include/uapi/linux/rseq.h
+ */
+
+#ifndef RSEQ_H
+#define RSEQ_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RSEQ_CPU_ID_UNINITIALIZED 0xffffffffu
+#define RSEQ_FLAG_UNREGISTER 1
+
+/* The word preceding every abort handler, which the kernel checks before jumping to it.
+   On AArch64 it is the encoding of brk #0x45e0, so it traps if ever executed.
+ */
+#define RSEQ_SIG 0xd428bc00
+
+/* The area shared with the kernel by a thread that has registered restartable sequences.
+   The kernel stores the ID of the CPU running the thread into cpu_id_start and cpu_id whenever the thread returns to user space.
+
+   A restartable sequence is described by a 32-byte aligned struct rseq_cs:
+   uint32_t version, flags; uint64_t start_ip, post_commit_offset, abort_ip.
+   Before entering it, the thread stores the address of its descriptor into rseq_cs.
+   If the thread is preempted, migrated, or interrupted by a signal while its instruction pointer is
+   within [start_ip, start_ip + post_commit_offset), the kernel moves it to abort_ip.
+   The last instruction of the sequence should therefore be the single store that commits it.
+ */
+struct rseq {
+  uint32_t cpu_id_start;
+  uint32_t cpu_id;
+  uint64_t rseq_cs;
+  uint32_t flags;
+  uint32_t reserved[3];
+} __attribute__((aligned (32)));
+
+_Static_assert (sizeof (struct rseq) == 32, "struct rseq is not 32 bytes");
+
+/* Register area for the calling thread. Returns 1 upon success.
+   Upon failure (e.g. the kernel does not support rseq), cpu_id is left as RSEQ_CPU_ID_UNINITIALIZED.
+ */
+uint32_t rseq_register (struct rseq * area);
+
+/* Unregister area, if it was registered by the calling thread */
+void rseq_unregister (struct rseq * area);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef STRING_INTERNAL_H
 #define STRING_INTERNAL_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 /* If ptr is 8-byte-aligned, we shall assume that read_u64(ptr) always returns
@@ -21,6 +22,10 @@
    We could achieve the same effect with volatile, but that still does not
    work around the theoretical UB. The only way to avoid UB is to use inline
    assembly to read the address.
+
+   The memory operand is never accessed by the compiler. It only tells it which
+   bytes the load reads, so that a store to these bytes is not moved before it.
+   memmove relies on this when the source and destination overlap.
  */
 
 static inline __attribute__((always_inline)) uint64_t read_u64 (const void * ptr) {
@@ -28,14 +33,139 @@ static inline __attribute__((always_inline)) uint64_t read_u64 (const void * ptr
   __asm__ volatile (
     "ldr %[ret], [%[ptr]]"
   : [ret] "=r" (ret)
-  : [ptr] "r" (ptr)
+  : [ptr] "r" (ptr), "m" (*(const char (*)[8]) ptr)
   :
   );
   return ret;
 }
 
-/* Writing to 8 bytes in memory simply requires may_alias attribute. */
+static inline __attribute__((always_inline)) uint32_t read_u32 (const void * ptr) {
+  uint32_t ret;
+  __asm__ volatile (
+    "ldr %w[ret], [%[ptr]]"
+  : [ret] "=r" (ret)
+  : [ptr] "r" (ptr), "m" (*(const char (*)[4]) ptr)
+  :
+  );
+  return ret;
+}
+
+/* Writing to 8 aligned bytes in memory simply requires may_alias attribute. */
 
 typedef uint64_t __attribute__((may_alias)) uint64_alias_t;
 
+/* An unaligned store through uint64_alias_t is still UB, since the type keeps its natural alignment.
+   write_u64 and write_u32 store to any address, with inline assembly like write_q.
+ */
+
+static inline __attribute__((always_inline)) void write_u64 (void * ptr, uint64_t val) {
+  __asm__ volatile (
+    "str %[val], [%[ptr]]"
+  : "=m" (*(char (*)[8]) ptr)
+  : [ptr] "r" (ptr), [val] "r" (val)
+  :
+  );
+}
+
+static inline __attribute__((always_inline)) void write_u32 (void * ptr, uint32_t val) {
+  __asm__ volatile (
+    "str %w[val], [%[ptr]]"
+  : "=m" (*(char (*)[4]) ptr)
+  : [ptr] "r" (ptr), [val] "r" (val)
+  :
+  );
+}
+
+/* 16 bytes held in a NEON register.
+   read_q and read_q_pair load 16 and 32 bytes, with the same reasoning as read_u64,
+   and write_q and write_q_pair store them.
+   Neither requires ptr to be aligned.
+ */
+
+typedef uint8_t __attribute__((vector_size (16))) vec128_t;
+
+static inline __attribute__((always_inline)) vec128_t read_q (const void * ptr) {
+  vec128_t ret;
+  __asm__ volatile (
+    "ldr %q[ret], [%[ptr]]"
+  : [ret] "=w" (ret)
+  : [ptr] "r" (ptr), "m" (*(const char (*)[16]) ptr)
+  :
+  );
+  return ret;
+}
+
+static inline __attribute__((always_inline)) void read_q_pair (const void * ptr, vec128_t * lo, vec128_t * hi) {
+  __asm__ volatile (
+    "ldp %q[lo], %q[hi], [%[ptr]]"
+  : [lo] "=w" (*lo), [hi] "=w" (*hi)
+  : [ptr] "r" (ptr), "m" (*(const char (*)[32]) ptr)
+  :
+  );
+}
+
+static inline __attribute__((always_inline)) void write_q (void * ptr, vec128_t val) {
+  __asm__ volatile (
+    "str %q[val], [%[ptr]]"
+  : "=m" (*(char (*)[16]) ptr)
+  : [ptr] "r" (ptr), [val] "w" (val)
+  :
+  );
+}
+
+static inline __attribute__((always_inline)) void write_q_pair (void * ptr, vec128_t lo, vec128_t hi) {
+  __asm__ volatile (
+    "stp %q[lo], %q[hi], [%[ptr]]"
+  : "=m" (*(char (*)[32]) ptr)
+  : [ptr] "r" (ptr), [lo] "w" (lo), [hi] "w" (hi)
+  :
+  );
+}
+
+/* copy_small
+   Copy n <= 128 bytes from s to d.
+   Every byte is loaded before the first store, so s and d may overlap.
+   Each size range is covered by two loads of equal width, one from each end of the buffer,
+   which overlap in the middle when n is not a power of two. Hence there is no loop, and a single branch per range.
+ */
+
+static inline __attribute__((always_inline)) void copy_small (unsigned char * d, const unsigned char * s, size_t n) {
+  vec128_t a, b, c, e, f, g, h, k;
+
+  if (n <= 16) {
+    if (n >= 8) {
+      uint64_t x = read_u64 (s), y = read_u64 (s + n - 8);
+      write_u64 (d, x);
+      write_u64 (d + n - 8, y);
+    } else if (n >= 4) {
+      uint32_t x = read_u32 (s), y = read_u32 (s + n - 4);
+      write_u32 (d, x);
+      write_u32 (d + n - 4, y);
+    } else if (n) {
+      /* 1 to 3 bytes: the first, middle and last bytes cover all of them */
+      unsigned char x = s[0], y = s[n >> 1], z = s[n - 1];
+      d[0] = x; d[n >> 1] = y; d[n - 1] = z;
+    }
+  } else if (n <= 32) {
+    a = read_q (s);
+    b = read_q (s + n - 16);
+    write_q (d, a);
+    write_q (d + n - 16, b);
+  } else if (n <= 64) {
+    read_q_pair (s, &a, &b);
+    read_q_pair (s + n - 32, &c, &e);
+    write_q_pair (d, a, b);
+    write_q_pair (d + n - 32, c, e);
+  } else {
+    read_q_pair (s, &a, &b);
+    read_q_pair (s + 32, &c, &e);
+    read_q_pair (s + n - 64, &f, &g);
+    read_q_pair (s + n - 32, &h, &k);
+    write_q_pair (d, a, b);
+    write_q_pair (d + 32, c, e);
+    write_q_pair (d + n - 64, f, g);
+    write_q_pair (d + n - 32, h, k);
+  }
+}
+
 #endif
@@ -0,0 +1,73 @@
+#ifndef SYNC_H
+#define SYNC_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Synchronization primitives built on futexes (see sync.c).
+   Each of them is made of 32-bit words, and is initialized by filling it with zeroes.
+   They may only be shared by threads of the same process.
+
+   The futex2 system calls (futex_wait, futex_wake, futex_requeue) are used on Linux 6.7 and later.
+   On older kernels, the first call fails with ENOSYS, and the private operations of the futex system call are used from then on.
+ */
+
+/* Sleep until woken up, if *addr is still val. The thread may also wake up spuriously. */
+void futex_wait (uint32_t * addr, uint32_t val);
+
+/* Wake up at most n threads sleeping on addr */
+void futex_wake (uint32_t * addr, int n);
+
+struct mutex_t {
+  uint32_t state;
+};
+
+struct cond_t {
+  uint32_t seq;
+};
+
+struct rwlock_t {
+  uint32_t state;
+  uint32_t writer_seq;
+};
+
+#define MUTEX_INIT { 0 }
+#define COND_INIT { 0 }
+#define RWLOCK_INIT { 0, 0 }
+
+void mutex_lock (struct mutex_t * mutex);
+
+/* Returns 1 if the mutex is acquired, 0 if it is held by some thread */
+uint32_t mutex_trylock (struct mutex_t * mutex);
+
+void mutex_unlock (struct mutex_t * mutex);
+
+/* Atomically release mutex and wait for cond to be signaled, then acquire mutex again.
+   As with all condition variables, the thread may wake up spuriously.
+ */
+void cond_wait (struct cond_t * cond, struct mutex_t * mutex);
+
+void cond_signal (struct cond_t * cond);
+
+/* Wake up all threads waiting on cond. mutex must be the mutex these threads passed to cond_wait. */
+void cond_broadcast (struct cond_t * cond, struct mutex_t * mutex);
+
+/* A writer-preferring reader-writer lock: once a writer waits, new readers wait as well until a writer has taken the lock.
+   At most 32767 threads may hold it for reading, and at most 32767 writers may wait for it, at the same time.
+ */
+void rwlock_read_lock (struct rwlock_t * rwlock);
+
+void rwlock_read_unlock (struct rwlock_t * rwlock);
+
+void rwlock_write_lock (struct rwlock_t * rwlock);
+
+void rwlock_write_unlock (struct rwlock_t * rwlock);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
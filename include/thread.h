@@ -0,0 +1,59 @@
+#ifndef THREAD_H
+#define THREAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <tls.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The thread registry hands out thread IDs, together with a tls_struct and a malloc arena, at runtime.
+
+   thread_register() must be called by each thread (including the main thread) before anything else.
+   It sets the thread pointer of the calling thread, and returns its tls_struct, or NULL upon failure.
+   It also registers the rseq area of the tls_struct with the kernel, if rseq is supported.
+
+   thread_unregister() must be the last call of a thread into the library.
+   It hands the regions freed on behalf of other threads to their owners,
+   and leaves the arena of the thread as an orphan, along with all allocations still live in it.
+   These may still be freed by other threads, which put them into the free set of the orphan arena.
+
+   An orphan, including its thread ID, is adopted by the next thread calling thread_register().
+   Until then, thread_drain_orphans() completes the frees pending in the free sets of all orphans,
+   and returns the number of orphans it has drained.
+ */
+
+struct thread_t;
+
+struct tls_struct * thread_register (void);
+
+void thread_unregister (void);
+
+size_t thread_drain_orphans (void);
+
+/* Walk the tls_struct of every thread that ever registered, including orphans, starting from thread_iterate (NULL).
+   Returns NULL after the last one. Threads registering during the walk may be missed.
+ */
+struct tls_struct * thread_iterate (struct tls_struct * tls);
+
+/* Create a thread running func (arg), on a stack of LIBC_THREAD_STACK_SIZE bytes, below which lies an inaccessible guard page.
+   The new thread registers itself, and unregisters itself when func returns.
+   Returns NULL upon failure.
+ */
+struct thread_t * thread_create (void * (* func) (void *), void * arg);
+
+/* Wait for a thread to exit, release its resources, and return the value returned by its function.
+   Each thread must be joined exactly once, by any thread.
+ */
+void * thread_join (struct thread_t * thread);
+
+/* Returns the number of CPUs the calling thread may run on */
+uint32_t thread_cpu_count (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A fixed-size pool of worker threads with work stealing (see thread_pool.c).
+   Each worker is a registered thread with its own tls_struct and malloc arena.
+ */
+
+struct thread_pool_t;
+struct thread_pool_task;
+
+/* Start worker_num workers (or one per available CPU if worker_num is 0).
+   Returns NULL upon failure.
+ */
+struct thread_pool_t * thread_pool_create (uint32_t worker_num);
+
+/* Run func (arg) on some worker of pool. Tasks submitted by a worker go to its own deque.
+   Returns a handle that the submitting thread must pass to thread_pool_join exactly once, or NULL upon failure.
+ */
+struct thread_pool_task * thread_pool_submit (struct thread_pool_t * pool, void (* func) (void *), void * arg);
+
+/* Wait for a task to complete, and release its handle.
+   A worker of the pool runs other tasks while waiting.
+ */
+void thread_pool_join (struct thread_pool_t * pool, struct thread_pool_task * task);
+
+/* Call func (ctx, i, j) over disjoint ranges [i, j) covering [begin, end), each of at most grain iterations,
+   in parallel on the workers of pool, and wait for all of them to complete.
+   Ranges for which no task can be allocated are run by the calling thread.
+ */
+void thread_pool_parallel_for (struct thread_pool_t * pool, uint64_t begin, uint64_t end, uint64_t grain, void (* func) (void *, uint64_t, uint64_t), void * ctx);
+
+/* Wait for all submitted tasks to complete, stop the workers, and release the pool.
+   Must not be called by a worker of pool.
+   Handles of tasks that have not been joined yet stay valid, and must still be passed to thread_pool_join.
+ */
+void thread_pool_destroy (struct thread_pool_t * pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -2,6 +2,8 @@
 #define TLS_H
 
 #include <stdint.h>
+#include <rseq.h>
+#include <ebr.h>
 
 static inline __attribute__((always_inline)) void * get_thread_pointer (void) {
   void * addr;
@@ -14,6 +16,7 @@ static inline __attribute__((always_inline)) void set_thread_pointer (void * ptr
 }
 
 struct malloc_arena_t;
+struct thread_pool_worker;
 
 struct tls_struct {
   uint16_t thread_id;
@@ -23,6 +26,15 @@ struct tls_struct {
 
   /* Random number generator data structure */
   void * gerandom_opaque_state;
+
+  /* Worker of a thread pool run by this thread, or NULL */
+  struct thread_pool_worker * thread_pool_worker;
+
+  /* Restartable sequences area, registered by thread_register */
+  struct rseq rseq;
+
+  /* Epoch-based reclamation state */
+  struct ebr_thread_t ebr;
 };
 
 static inline __attribute__((always_inline)) uint16_t get_thread_id (void) {
@@ -0,0 +1,129 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <memory.h>
+#include <tls.h>
+#include <thread.h>
+#include <ebr.h>
+#include <config.h>
+
+/* Epoch-based reclamation (see Keir Fraser, "Practical lock-freedom", 2004)
+
+   There is a global epoch. A thread entering a critical section announces the epoch it observed,
+   and the global epoch may only advance from e to e + 1 once every thread inside a critical section has announced e.
+   Hence while the global epoch is e, threads inside critical sections have announced e or e - 1.
+
+   An object retired while the global epoch is e was unlinked before that epoch was read,
+   so only threads that announced e or earlier may still hold a reference to it.
+   Once the global epoch reaches e + 2, all of them have left their critical sections, and the object can be freed.
+
+   Each thread keeps the objects it retires in three limbo lists, one for each of the last three epochs, indexed by epoch % 3.
+   Retired objects may still be read, so they are recorded in separate batches of LIBC_EBR_BATCH pointers
+   rather than linked through their own memory.
+   Every LIBC_EBR_BATCH retirements, the thread tries to advance the global epoch, and frees the limbo lists that became safe.
+   A whole batch is freed with free_bulk, which groups the objects by owning arena,
+   so the objects of each other arena are handed to its free set with a single swap.
+
+   Objects retired by a thread that has exited stay in the limbo lists of its slot, until the slot is adopted by another thread.
+ */
+
+struct ebr_batch {
+  struct ebr_batch * next;
+  uint64_t num;
+  void * ptrs[LIBC_EBR_BATCH];
+};
+
+static uint64_t ebr_global_epoch = 0;
+
+static inline struct ebr_thread_t * get_thread_ebr (void) {
+  return &((struct tls_struct *) get_thread_pointer ()) -> ebr;
+}
+
+void ebr_enter (void) {
+  struct ebr_thread_t * ebr = get_thread_ebr ();
+  if (ebr->nesting++ != 0) return;
+
+  uint64_t epoch = __atomic_load_n (&ebr_global_epoch, __ATOMIC_SEQ_CST);
+  __atomic_store_n (&ebr->state, (epoch << 1) | 1, __ATOMIC_SEQ_CST);
+  /* The announcement must be visible before any shared pointer is read */
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+}
+
+void ebr_exit (void) {
+  struct ebr_thread_t * ebr = get_thread_ebr ();
+  if (--ebr->nesting != 0) return;
+  __atomic_store_n (&ebr->state, 0, __ATOMIC_RELEASE);
+}
+
+/* try_advance
+   Advance the global epoch, unless some thread inside a critical section has not announced it yet.
+ */
+static void try_advance (void) {
+  uint64_t epoch = __atomic_load_n (&ebr_global_epoch, __ATOMIC_SEQ_CST);
+
+  for (struct tls_struct * tls = thread_iterate (NULL); tls != NULL; tls = thread_iterate (tls)) {
+    uint64_t state = __atomic_load_n (&tls->ebr.state, __ATOMIC_SEQ_CST);
+    if ((state & 1) && (state >> 1) != epoch) return;
+  }
+
+  __atomic_compare_exchange_n (&ebr_global_epoch, &epoch, epoch + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+/* free_limbo
+   Free all objects of a limbo list, and the batches recording them.
+ */
+static void free_limbo (struct ebr_limbo * limbo) {
+  struct ebr_batch * batch = limbo->batches;
+  if (batch == NULL) return;
+
+  while (batch != NULL) {
+    struct ebr_batch * next = batch->next;
+    free_bulk (batch->ptrs, batch->num);
+    free (batch);
+    batch = next;
+  }
+  limbo->batches = NULL;
+
+  /* Hand the objects of other arenas to their owners right away */
+  clear_free_set ();
+}
+
+void ebr_reclaim (void) {
+  struct ebr_thread_t * ebr = get_thread_ebr ();
+  try_advance ();
+
+  uint64_t epoch = __atomic_load_n (&ebr_global_epoch, __ATOMIC_SEQ_CST);
+  for (uint32_t i = 0; i < 3; ++i) {
+    if (ebr->limbo[i].epoch + 2 <= epoch) free_limbo (&ebr->limbo[i]);
+  }
+}
+
+uint32_t ebr_retire (void * ptr) {
+  if (ptr == NULL) return 1;
+
+  struct ebr_thread_t * ebr = get_thread_ebr ();
+  uint64_t epoch = __atomic_load_n (&ebr_global_epoch, __ATOMIC_SEQ_CST);
+  struct ebr_limbo * limbo = &ebr->limbo[epoch % 3];
+
+  /* The list was filled at least three epochs ago */
+  if (limbo->epoch != epoch) {
+    free_limbo (limbo);
+    limbo->epoch = epoch;
+  }
+
+  struct ebr_batch * batch = limbo->batches;
+  if (batch == NULL || batch->num == LIBC_EBR_BATCH) {
+    batch = malloc (sizeof (struct ebr_batch));
+    if (batch == NULL) return 0;
+    batch->next = limbo->batches;
+    batch->num = 0;
+    limbo->batches = batch;
+  }
+  batch->ptrs[batch->num++] = ptr;
+
+  if (++ebr->retired_since_scan >= LIBC_EBR_BATCH) {
+    ebr->retired_since_scan = 0;
+    ebr_reclaim ();
+  }
+
+  return 1;
+}
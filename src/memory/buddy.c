@@ -5,6 +5,7 @@
 
 /* The buddy allocator manages memory chunks of size 512KiB (128 pages).
    It allocates memory blocks of sizes 1, 2, 4, ..., 64 pages.
+   It can also allocate runs of any number of contiguous pages up to 64 (see buddy_alloc_pages).
 
    Initially, each chunk is considered as a single block of 128 pages.
    Blocks of 128 pages can be divided into two blocks of 64 pages.
@@ -14,8 +15,19 @@
    The length of the block is (1 << order) pages, and the index of the first page of the block is (length * idx).
    Hence 0 <= idx < 128.
 
-   If all blocks within a chunk are freed, the chunk is returned to the OS.
-   We also keep a small number of chunks always available, to avoid frequent syscalls.
+   Each chunk is aligned to 512KiB, hence each block is aligned to its own size.
+
+   Freed pages are not returned to the OS right away.
+   Every LIBC_BUDDY_DECAY_MS milliseconds, the next call to buddy_decay_tick (made by malloc on every allocation and free)
+   sweeps the chunks with freed pages that have not been purged (see buddy_decay_sweep):
+   pages that have stayed available since the previous sweep are purged with madvise (LIBC_PURGE_ADVICE),
+   which releases their physical memory but keeps the virtual range mapped.
+   Empty chunks stay mapped, and are only returned to the OS by buddy_trim.
+   Hence bursts of allocations and frees do not cause mmap/munmap churn.
+   Since sweeps are only triggered by calls into the allocator, a thread that goes idle keeps
+   the pages it freed last resident; malloc_trim purges them right away.
+
+   In huge page mode (LIBC_HUGEPAGE_MODE), chunks are carved out of huge-page-aligned regions (see buddy_map_chunks).
 
    The state of each chunk is recorded using a `struct buddy_chunk_state`.
    This struct contains the following fields:
@@ -28,17 +40,27 @@
    uint32_t bitmap2;
    uint64_t bitmap1;
    uint64_t bitmap0[2];
+   uint64_t dirty[2]; // Bitmap of pages that have been handed out and freed since the chunk was mapped
+   uint64_t unpurged[2]; // Bitmap of pages that have been freed and not yet purged
+   uint64_t recent[2]; // Bitmap of pages that have been freed since the last sweep
+   uint64_t native_start[2]; // Bitmap of first pages of native runs (see buddy_mark_native)
+   uint64_t native_end[2]; // Bitmap of last pages of native runs
+   struct buddy_arena_t *arena; // The arena managing this chunk
    struct buddy_chunk_state *next_avail_idx6, *prev_avail_idx6; // Linked list of chunks with available order 6 blocks
    struct buddy_chunk_state *next_avail_idx5, *prev_avail_idx5; // Linked list of chunks with available order 5 blocks
    ...
    struct buddy_chunk_state *next_avail_idx0, *prev_avail_idx0; // Linked list of chunks with available order 0 blocks
    struct buddy_chunk_state *next_empty_state, *prev_empty_state; // Linked list of not-in-use buddy_chunk_state records
+   struct buddy_chunk_state *next_unpurged, *prev_unpurged; // Linked list of chunks with unpurged pages
    void *chunk; // Pointer to the chunk being managed
 
-   The size of each buddy_chunk_state record is 176 bytes.
-   buddy_chunk_state records are allocated in groups of 372 as a single struct buddy_chunk_state_group.
+   The size of each buddy_chunk_state record is 280 bytes.
+   buddy_chunk_state records are allocated in groups of 234 as a single struct buddy_chunk_state_group.
+
+   Every chunk is also registered in a global map from chunk addresses to buddy_chunk_state records,
+   so that any thread can find the record (and the arena) of a chunk from an address within it (see buddy_lookup_chunk).
    Each buddy_chunk_state_group is allocated by mmap'ing 16 pages.
-   We don't automatically garbage-collect buddy_chunk_state_group, but can do so upon request.
+   We don't automatically garbage-collect buddy_chunk_state_group, but can do so upon request (see buddy_trim).
  */
 
 #define BUDDY_RECORDS_PER_GROUP ((65536 - 16) / sizeof (struct buddy_chunk_state))
@@ -55,6 +77,12 @@ struct buddy_chunk_state {
   uint32_t bitmap2;
   uint64_t bitmap1;
   uint64_t bitmap0[2];
+  uint64_t dirty[2];
+  uint64_t unpurged[2];
+  uint64_t recent[2];
+  uint64_t native_start[2];
+  uint64_t native_end[2];
+  struct buddy_arena_t *arena;
   struct buddy_chunk_state *next_avail_idx6, *prev_avail_idx6;
   struct buddy_chunk_state *next_avail_idx5, *prev_avail_idx5;
   struct buddy_chunk_state *next_avail_idx4, *prev_avail_idx4;
@@ -63,6 +91,7 @@ struct buddy_chunk_state {
   struct buddy_chunk_state *next_avail_idx1, *prev_avail_idx1;
   struct buddy_chunk_state *next_avail_idx0, *prev_avail_idx0;
   struct buddy_chunk_state *next_empty_state, *prev_empty_state;
+  struct buddy_chunk_state *next_unpurged, *prev_unpurged;
   void *chunk;
 };
 
@@ -72,6 +101,50 @@ struct buddy_chunk_state_group {
   struct buddy_chunk_state state_records[BUDDY_RECORDS_PER_GROUP];
 };
 
+/* The chunk map is a two-level table indexed by (address >> 19), covering 48-bit addresses.
+   The second-level tables are allocated on demand, and never freed.
+   Only the owner of a chunk registers or unregisters it, but any thread may look it up.
+ */
+
+#define BUDDY_MAP_L2_BITS 15
+#define BUDDY_MAP_L1_BITS (48 - 19 - BUDDY_MAP_L2_BITS)
+
+static struct buddy_chunk_state ** buddy_chunk_map[1 << BUDDY_MAP_L1_BITS];
+
+/* buddy_map_set
+   Set the entry of the chunk map for chunk to st.
+   Returns 1 upon success, 0 if a second-level table cannot be allocated.
+ */
+
+static uint32_t buddy_map_set (void * chunk, struct buddy_chunk_state * st) {
+  uintptr_t key = ((uintptr_t) chunk) >> 19;
+  struct buddy_chunk_state *** l1 = &buddy_chunk_map[key >> BUDDY_MAP_L2_BITS];
+  struct buddy_chunk_state ** l2 = (struct buddy_chunk_state **) __atomic_load_8 ((uintptr_t *) l1, __ATOMIC_SEQ_CST);
+
+  if (l2 == NULL) {
+    void * mmap_ctx_ptr;
+    struct buddy_chunk_state ** new_l2 = mmap_alloc (sizeof (void *) << BUDDY_MAP_L2_BITS, &mmap_ctx_ptr);
+    if (new_l2 == NULL) return 0;
+    /* Another thread may have installed a table in the meantime */
+    if (__atomic_compare_exchange_n (l1, &l2, new_l2, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+      l2 = new_l2;
+    } else {
+      mmap_free (new_l2, new_l2, sizeof (void *) << BUDDY_MAP_L2_BITS);
+    }
+  }
+
+  __atomic_store_8 ((uintptr_t *) &l2[key & ((1 << BUDDY_MAP_L2_BITS) - 1)], (uintptr_t) st, __ATOMIC_SEQ_CST);
+  return 1;
+}
+
+void * buddy_lookup_chunk (void * ptr) {
+  uintptr_t key = ((uintptr_t) ptr) >> 19;
+  if (key >> (BUDDY_MAP_L1_BITS + BUDDY_MAP_L2_BITS)) return NULL;
+  struct buddy_chunk_state ** l2 = (struct buddy_chunk_state **) __atomic_load_8 ((uintptr_t *) &buddy_chunk_map[key >> BUDDY_MAP_L2_BITS], __ATOMIC_SEQ_CST);
+  if (l2 == NULL) return NULL;
+  return (void *) __atomic_load_8 ((uintptr_t *) &l2[key & ((1 << BUDDY_MAP_L2_BITS) - 1)], __ATOMIC_SEQ_CST);
+}
+
 /* allocate_buddy_chunk_state_group
    Allocate new struct buddy_chunk_state_group.
    Add newly allocated buddy_chunk_state records to the empty record list.
@@ -129,32 +202,106 @@ static void free_buddy_chunk_state (struct buddy_chunk_state * ptr, struct buddy
   arena->empty_list_head = ptr;
 }
 
-/* allocate_chunk_and_block6
-   Allocate a new chunk, and a new block of order 6 from the chunk.
-   Returns ptr to buddy_chunk_state of new chunk.
-   The new block has index 0 within the new chunk.
-   Returns NULL upon failure.
+/* The chunks with unpurged pages are kept in a list, so that buddy_decay_sweep does not visit the other chunks.
+   A chunk is in the list if and only if its unpurged bitmap is not zero.
+   Explicit huge pages cannot be purged, hence in mode 2 the list stays empty.
  */
 
-static struct buddy_chunk_state * allocate_chunk_and_block6 (struct buddy_arena_t * arena) {
+static inline void buddy_unpurged_unlink (struct buddy_chunk_state * st, struct buddy_arena_t * arena) {
+  if (st->prev_unpurged == NULL && arena->unpurged_list_head != st) return;
+  if (st->prev_unpurged != NULL) st->prev_unpurged->next_unpurged = st->next_unpurged;
+  if (st->next_unpurged != NULL) st->next_unpurged->prev_unpurged = st->prev_unpurged;
+  if (arena->unpurged_list_head == st) arena->unpurged_list_head = st->next_unpurged;
+  st->prev_unpurged = NULL;
+  st->next_unpurged = NULL;
+}
+
+/* buddy_add_chunk
+   Set up a record for a newly mapped chunk, register it in the chunk map,
+   and make the whole chunk available as two blocks of order 6.
+   Returns 0 upon failure, in which case the chunk is left mapped.
+ */
+
+static uint32_t buddy_add_chunk (struct buddy_arena_t * arena, void * chunk) {
   struct buddy_chunk_state * new_state = allocate_buddy_chunk_state (arena);
-  if (new_state == NULL) return NULL;
+  if (new_state == NULL) return 0;
 
-  void * mmap_ctx_ptr;
-  new_state->chunk = mmap_alloc (128 << 12, &mmap_ctx_ptr); /* 128 pages */
-  if (new_state->chunk == NULL) {
+  new_state->chunk = chunk;
+  new_state->arena = arena;
+  if (!buddy_map_set (chunk, new_state)) {
     free_buddy_chunk_state (new_state, arena);
-    return NULL;
+    return 0;
   }
 
-  new_state->bitmap6 = 2;
-  new_state->avail_num[6] = 1;
+  new_state->bitmap6 = 3;
+  new_state->avail_num[6] = 2;
   new_state->next_avail_idx6 = arena->avail6_list_head;
   if (arena->avail6_list_head != NULL) arena->avail6_list_head->prev_avail_idx6 = new_state;
   arena->avail6_list_head = new_state;
   arena->chunk_num++;
 
-  return new_state;
+  return 1;
+}
+
+/* buddy_release_chunk
+   Forget an empty chunk: unregister it, and free its record.
+   Both blocks of order 6 must be available, in which case no smaller blocks are available.
+   The caller is responsible for unmapping the chunk.
+ */
+
+static void buddy_release_chunk (struct buddy_chunk_state * st, struct buddy_arena_t * arena) {
+  if (st->prev_avail_idx6 != NULL) st->prev_avail_idx6->next_avail_idx6 = st->next_avail_idx6;
+  if (st->next_avail_idx6 != NULL) st->next_avail_idx6->prev_avail_idx6 = st->prev_avail_idx6;
+  if (arena->avail6_list_head == st) arena->avail6_list_head = st->next_avail_idx6;
+  buddy_unpurged_unlink (st, arena);
+  buddy_map_set (st->chunk, NULL);
+  free_buddy_chunk_state (st, arena);
+  arena->chunk_num--;
+}
+
+/* buddy_map_chunks
+   Map new chunks, and make them available.
+   Chunks are aligned to their size, so that every block is aligned to its own size.
+
+   In huge page mode (LIBC_HUGEPAGE_MODE), a whole region of LIBC_HUGEPAGE_SIZE bytes is mapped at once,
+   aligned to its size so that it can be backed by huge pages (see mmap_alloc), and divided into chunks.
+   Unmapping a single chunk would split the huge page (or fail, with explicit huge pages),
+   hence the region is only unmapped once all of its chunks are empty (see buddy_trim_region).
+   Returns 0 upon failure.
+ */
+
+#if LIBC_HUGEPAGE_MODE
+#define BUDDY_REGION_CHUNK_NUM (LIBC_HUGEPAGE_SIZE / (128 << 12))
+#define BUDDY_REGION_CHUNK(region, i) ((void *) (((uintptr_t) (region)) + (((uintptr_t) (i)) << 19)))
+
+_Static_assert (LIBC_HUGEPAGE_SIZE % (128 << 12) == 0, "LIBC_HUGEPAGE_SIZE is not a multiple of the chunk size");
+#endif
+
+static uint32_t buddy_map_chunks (struct buddy_arena_t * arena) {
+  void * mmap_ctx_ptr;
+
+#if LIBC_HUGEPAGE_MODE == 0
+  void * chunk = mmap_alloc_aligned (128 << 12, 128 << 12, &mmap_ctx_ptr); /* 128 pages */
+  if (chunk == NULL) return 0;
+
+  if (!buddy_add_chunk (arena, chunk)) {
+    mmap_free (chunk, chunk, 128 << 12);
+    return 0;
+  }
+#else
+  void * region = mmap_alloc (LIBC_HUGEPAGE_SIZE, &mmap_ctx_ptr);
+  if (region == NULL) return 0;
+
+  for (uint32_t i = 0; i < BUDDY_REGION_CHUNK_NUM; ++i) {
+    if (!buddy_add_chunk (arena, BUDDY_REGION_CHUNK (region, i))) {
+      while (i > 0) buddy_release_chunk (buddy_lookup_chunk (BUDDY_REGION_CHUNK (region, --i)), arena);
+      mmap_free (region, region, LIBC_HUGEPAGE_SIZE);
+      return 0;
+    }
+  }
+#endif
+
+  return 1;
 }
 
 /* buddy_alloc_6
@@ -168,34 +315,24 @@ void * buddy_alloc_6 (void ** ctx_ptr, void * arena_vp) {
   struct buddy_arena_t * arena = (struct buddy_arena_t *) arena_vp;
   struct buddy_chunk_state * st;
 
-  if (arena->avail6_list_head != NULL) {
-
-    st = arena->avail6_list_head;
-    uint32_t idx = __builtin_ctz (st->bitmap6);
-    st->bitmap6 &= ~ (1ull << idx);
-    st->avail_num[6]--;
-
-    if (st->avail_num[6] == 0) {
-      if (st->next_avail_idx6 != NULL) st->next_avail_idx6->prev_avail_idx6 = NULL;
-      st->next_avail_idx6 = NULL;
-      arena->avail6_list_head = st->next_avail_idx6;
-    }
-
-    *out_buddy_chunk_state = st;
-    return BUDDY_IDX_BLOCK (st, idx, 6);
-
-  } else {
+  if (arena->avail6_list_head == NULL && !buddy_map_chunks (arena)) {
+    *out_buddy_chunk_state = NULL;
+    return NULL;
+  }
 
-    st = allocate_chunk_and_block6 (arena);
-    if (st != NULL) {
-      *out_buddy_chunk_state = st;
-      return st->chunk;
-    } else {
-      *out_buddy_chunk_state = NULL;
-      return NULL;
-    }
+  st = arena->avail6_list_head;
+  uint32_t idx = __builtin_ctz (st->bitmap6);
+  st->bitmap6 &= ~ (1ull << idx);
+  st->avail_num[6]--;
 
+  if (st->avail_num[6] == 0) {
+    if (st->next_avail_idx6 != NULL) st->next_avail_idx6->prev_avail_idx6 = NULL;
+    arena->avail6_list_head = st->next_avail_idx6;
+    st->next_avail_idx6 = NULL;
   }
+
+  *out_buddy_chunk_state = st;
+  return BUDDY_IDX_BLOCK (st, idx, 6);
 }
 
 void * buddy_alloc_5 (void ** ctx_ptr, void * arena_vp) {
@@ -212,8 +349,8 @@ void * buddy_alloc_5 (void ** ctx_ptr, void * arena_vp) {
 
     if (st->avail_num[5] == 0) {
       if (st->next_avail_idx5 != NULL) st->next_avail_idx5->prev_avail_idx5 = NULL;
-      st->next_avail_idx5 = NULL;
       arena->avail5_list_head = st->next_avail_idx5;
+      st->next_avail_idx5 = NULL;
     }
 
     *out_buddy_chunk_state = st;
@@ -255,8 +392,8 @@ void * buddy_alloc_4 (void ** ctx_ptr, void * arena_vp) {
 
     if (st->avail_num[4] == 0) {
       if (st->next_avail_idx4 != NULL) st->next_avail_idx4->prev_avail_idx4 = NULL;
-      st->next_avail_idx4 = NULL;
       arena->avail4_list_head = st->next_avail_idx4;
+      st->next_avail_idx4 = NULL;
     }
 
     *out_buddy_chunk_state = st;
@@ -265,8 +402,8 @@ void * buddy_alloc_4 (void ** ctx_ptr, void * arena_vp) {
   } else {
 
     void * block = buddy_alloc_5 ((void **) &st, arena);
-    uint32_t idx = BUDDY_BLOCK_IDX (st, block, 5);
     if (st != NULL) {
+      uint32_t idx = BUDDY_BLOCK_IDX (st, block, 5);
       st->avail_num[4]++;
       st->bitmap4 |= (1ull << (2 * idx + 1));
       if (st->avail_num[4] == 1) {
@@ -298,8 +435,8 @@ void * buddy_alloc_3 (void ** ctx_ptr, void * arena_vp) {
 
     if (st->avail_num[3] == 0) {
       if (st->next_avail_idx3 != NULL) st->next_avail_idx3->prev_avail_idx3 = NULL;
-      st->next_avail_idx3 = NULL;
       arena->avail3_list_head = st->next_avail_idx3;
+      st->next_avail_idx3 = NULL;
     }
 
     *out_buddy_chunk_state = st;
@@ -341,8 +478,8 @@ void * buddy_alloc_2 (void ** ctx_ptr, void * arena_vp) {
 
     if (st->avail_num[2] == 0) {
       if (st->next_avail_idx2 != NULL) st->next_avail_idx2->prev_avail_idx2 = NULL;
-      st->next_avail_idx2 = NULL;
       arena->avail2_list_head = st->next_avail_idx2;
+      st->next_avail_idx2 = NULL;
     }
 
     *out_buddy_chunk_state = st;
@@ -384,8 +521,8 @@ void * buddy_alloc_1 (void ** ctx_ptr, void * arena_vp) {
 
     if (st->avail_num[1] == 0) {
       if (st->next_avail_idx1 != NULL) st->next_avail_idx1->prev_avail_idx1 = NULL;
-      st->next_avail_idx1 = NULL;
       arena->avail1_list_head = st->next_avail_idx1;
+      st->next_avail_idx1 = NULL;
     }
 
     *out_buddy_chunk_state = st;
@@ -435,8 +572,8 @@ void * buddy_alloc_0 (void ** ctx_ptr, void * arena_vp) {
 
     if (st->avail_num[0] == 0) {
       if (st->next_avail_idx0 != NULL) st->next_avail_idx0->prev_avail_idx0 = NULL;
-      st->next_avail_idx0 = NULL;
       arena->avail0_list_head = st->next_avail_idx0;
+      st->next_avail_idx0 = NULL;
     }
 
     *out_buddy_chunk_state = st;
@@ -468,32 +605,22 @@ void * buddy_alloc_0 (void ** ctx_ptr, void * arena_vp) {
   }
 }
 
-void buddy_free_6 (void * ptr, void * ctx, void * arena_vp) {
+static void buddy_merge_6 (void * ptr, void * ctx, void * arena_vp) {
   struct buddy_arena_t * arena = (struct buddy_arena_t *) arena_vp;
   struct buddy_chunk_state * st = (struct buddy_chunk_state *) ctx;
   uint32_t block_idx = BUDDY_BLOCK_IDX (st, ptr, 6);
 
-  uint32_t buddy = block_idx ^ 1;
-  if ((st->bitmap6 & (1ull << buddy)) && arena->chunk_num > LIBC_KEEP_CHUNK_NUM) {
-    /* At this point, no smaller blocks should be available */
-    if (st->prev_avail_idx6 != NULL) st->prev_avail_idx6->next_avail_idx6 = st->next_avail_idx6;
-    if (st->next_avail_idx6 != NULL) st->next_avail_idx6->prev_avail_idx6 = st->prev_avail_idx6;
-    if (arena->avail6_list_head == st) arena->avail6_list_head = st->next_avail_idx6;
-    mmap_free (st->chunk, st->chunk, 128 << 12);
-    free_buddy_chunk_state (st, arena);
-    arena->chunk_num--;
-  } else {
-    st->bitmap6 |= (1ull << block_idx);
-    st->avail_num[6]++;
-    if (st->avail_num[6] == 1) {
-      st->next_avail_idx6 = arena->avail6_list_head;
-      if (arena->avail6_list_head != NULL) arena->avail6_list_head->prev_avail_idx6 = st;
-      arena->avail6_list_head = st;
-    }
+  /* Empty chunks are not returned to the OS here, but by buddy_trim */
+  st->bitmap6 |= (1ull << block_idx);
+  st->avail_num[6]++;
+  if (st->avail_num[6] == 1) {
+    st->next_avail_idx6 = arena->avail6_list_head;
+    if (arena->avail6_list_head != NULL) arena->avail6_list_head->prev_avail_idx6 = st;
+    arena->avail6_list_head = st;
   }
 }
 
-void buddy_free_5 (void * ptr, void * ctx, void * arena_vp) {
+static void buddy_merge_5 (void * ptr, void * ctx, void * arena_vp) {
   struct buddy_arena_t * arena = (struct buddy_arena_t *) arena_vp;
   struct buddy_chunk_state * st = (struct buddy_chunk_state *) ctx;
   uint32_t block_idx = BUDDY_BLOCK_IDX (st, ptr, 5);
@@ -509,7 +636,7 @@ void buddy_free_5 (void * ptr, void * ctx, void * arena_vp) {
       st->prev_avail_idx5 = NULL;
       st->next_avail_idx5 = NULL;
     }
-    buddy_free_6 (BUDDY_IDX_BLOCK (st, block_idx >> 1, 6), st, arena);
+    buddy_merge_6 (BUDDY_IDX_BLOCK (st, block_idx >> 1, 6), st, arena);
   } else {
     st->bitmap5 |= (1ull << block_idx);
     st->avail_num[5]++;
@@ -521,7 +648,7 @@ void buddy_free_5 (void * ptr, void * ctx, void * arena_vp) {
   }
 }
 
-void buddy_free_4 (void * ptr, void * ctx, void * arena_vp) {
+static void buddy_merge_4 (void * ptr, void * ctx, void * arena_vp) {
   struct buddy_arena_t * arena = (struct buddy_arena_t *) arena_vp;
   struct buddy_chunk_state * st = (struct buddy_chunk_state *) ctx;
   uint32_t block_idx = BUDDY_BLOCK_IDX (st, ptr, 4);
@@ -537,7 +664,7 @@ void buddy_free_4 (void * ptr, void * ctx, void * arena_vp) {
       st->prev_avail_idx4 = NULL;
       st->next_avail_idx4 = NULL;
     }
-    buddy_free_5 (BUDDY_IDX_BLOCK (st, block_idx >> 1, 5), st, arena);
+    buddy_merge_5 (BUDDY_IDX_BLOCK (st, block_idx >> 1, 5), st, arena);
   } else {
     st->bitmap4 |= (1ull << block_idx);
     st->avail_num[4]++;
@@ -549,7 +676,7 @@ void buddy_free_4 (void * ptr, void * ctx, void * arena_vp) {
   }
 }
 
-void buddy_free_3 (void * ptr, void * ctx, void * arena_vp) {
+static void buddy_merge_3 (void * ptr, void * ctx, void * arena_vp) {
   struct buddy_arena_t * arena = (struct buddy_arena_t *) arena_vp;
   struct buddy_chunk_state * st = (struct buddy_chunk_state *) ctx;
   uint32_t block_idx = BUDDY_BLOCK_IDX (st, ptr, 3);
@@ -565,7 +692,7 @@ void buddy_free_3 (void * ptr, void * ctx, void * arena_vp) {
       st->prev_avail_idx3 = NULL;
       st->next_avail_idx3 = NULL;
     }
-    buddy_free_4 (BUDDY_IDX_BLOCK (st, block_idx >> 1, 4), st, arena);
+    buddy_merge_4 (BUDDY_IDX_BLOCK (st, block_idx >> 1, 4), st, arena);
   } else {
     st->bitmap3 |= (1ull << block_idx);
     st->avail_num[3]++;
@@ -577,7 +704,7 @@ void buddy_free_3 (void * ptr, void * ctx, void * arena_vp) {
   }
 }
 
-void buddy_free_2 (void * ptr, void * ctx, void * arena_vp) {
+static void buddy_merge_2 (void * ptr, void * ctx, void * arena_vp) {
   struct buddy_arena_t * arena = (struct buddy_arena_t *) arena_vp;
   struct buddy_chunk_state * st = (struct buddy_chunk_state *) ctx;
   uint32_t block_idx = BUDDY_BLOCK_IDX (st, ptr, 2);
@@ -593,7 +720,7 @@ void buddy_free_2 (void * ptr, void * ctx, void * arena_vp) {
       st->prev_avail_idx2 = NULL;
       st->next_avail_idx2 = NULL;
     }
-    buddy_free_3 (BUDDY_IDX_BLOCK (st, block_idx >> 1, 3), st, arena);
+    buddy_merge_3 (BUDDY_IDX_BLOCK (st, block_idx >> 1, 3), st, arena);
   } else {
     st->bitmap2 |= (1ull << block_idx);
     st->avail_num[2]++;
@@ -605,7 +732,7 @@ void buddy_free_2 (void * ptr, void * ctx, void * arena_vp) {
   }
 }
 
-void buddy_free_1 (void * ptr, void * ctx, void * arena_vp) {
+static void buddy_merge_1 (void * ptr, void * ctx, void * arena_vp) {
   struct buddy_arena_t * arena = (struct buddy_arena_t *) arena_vp;
   struct buddy_chunk_state * st = (struct buddy_chunk_state *) ctx;
   uint32_t block_idx = BUDDY_BLOCK_IDX (st, ptr, 1);
@@ -621,7 +748,7 @@ void buddy_free_1 (void * ptr, void * ctx, void * arena_vp) {
       st->prev_avail_idx1 = NULL;
       st->next_avail_idx1 = NULL;
     }
-    buddy_free_2 (BUDDY_IDX_BLOCK (st, block_idx >> 1, 2), st, arena);
+    buddy_merge_2 (BUDDY_IDX_BLOCK (st, block_idx >> 1, 2), st, arena);
   } else {
     st->bitmap1 |= (1ull << block_idx);
     st->avail_num[1]++;
@@ -633,7 +760,7 @@ void buddy_free_1 (void * ptr, void * ctx, void * arena_vp) {
   }
 }
 
-void buddy_free_0 (void * ptr, void * ctx, void * arena_vp) {
+static void buddy_merge_0 (void * ptr, void * ctx, void * arena_vp) {
   struct buddy_arena_t * arena = (struct buddy_arena_t *) arena_vp;
   struct buddy_chunk_state * st = (struct buddy_chunk_state *) ctx;
   uint32_t block_idx = BUDDY_BLOCK_IDX (st, ptr, 0);
@@ -651,7 +778,7 @@ void buddy_free_0 (void * ptr, void * ctx, void * arena_vp) {
       st->prev_avail_idx0 = NULL;
       st->next_avail_idx0 = NULL;
     }
-    buddy_free_1 (BUDDY_IDX_BLOCK (st, block_idx >> 1, 1), st, arena);
+    buddy_merge_1 (BUDDY_IDX_BLOCK (st, block_idx >> 1, 1), st, arena);
   } else {
     if (block_idx < 64) st->bitmap0[0] |= (1ull << block_idx); else st->bitmap0[1] |= (1ull << (block_idx - 64));
     st->avail_num[0]++;
@@ -662,3 +789,570 @@ void buddy_free_0 (void * ptr, void * ctx, void * arena_vp) {
     }
   }
 }
+
+/* buddy_free_N
+   Return a block of order N to the buddy allocator, merging it with its buddy whenever possible.
+   The pages of the block are marked dirty first, since the user might have written to them.
+   Only the block being freed is marked, not the buddies it merges with.
+   The pages are also marked as recently freed and not yet purged (see buddy_decay_sweep).
+ */
+
+static inline void buddy_mark_dirty (struct buddy_chunk_state * st, void * ptr, uint32_t order) {
+  uint32_t first = BUDDY_BLOCK_IDX (st, ptr, order) << order;
+  uint64_t mask = (order == 6) ? ~ 0ull : ((1ull << (1 << order)) - 1) << (first % 64);
+  st->dirty[first / 64] |= mask;
+  st->recent[first / 64] |= mask;
+
+#if LIBC_HUGEPAGE_MODE != 2
+  if ((st->unpurged[0] | st->unpurged[1]) == 0) {
+    struct buddy_arena_t * arena = st->arena;
+    st->next_unpurged = arena->unpurged_list_head;
+    if (arena->unpurged_list_head != NULL) arena->unpurged_list_head->prev_unpurged = st;
+    arena->unpurged_list_head = st;
+  }
+  st->unpurged[first / 64] |= mask;
+#endif
+}
+
+static void buddy_decay_sweep (struct buddy_arena_t * arena);
+
+/* buddy_decay_tick
+   Sweep the chunks with unpurged pages once a decay period has passed since the previous sweep.
+   The decay period is converted to ticks of the generic timer once per arena, so that each call
+   only reads cntvct_el0 and compares the raw delta, and nothing is read while no page awaits purging.
+ */
+void buddy_decay_tick (void * arena_vp) {
+  struct buddy_arena_t * arena = (struct buddy_arena_t *) arena_vp;
+  if (arena->unpurged_list_head == NULL) return;
+
+  uint64_t now;
+  __asm__ volatile ("mrs %0, cntvct_el0" : "=r" (now));
+
+  if (arena->decay_ticks == 0) {
+    uint64_t frq;
+    __asm__ volatile ("mrs %0, cntfrq_el0" : "=r" (frq));
+    arena->decay_ticks = (frq * LIBC_BUDDY_DECAY_MS) / 1000;
+    if (arena->decay_ticks == 0) arena->decay_ticks = 1;
+    arena->last_sweep_tick = now;
+    return;
+  }
+
+  if (now - arena->last_sweep_tick >= arena->decay_ticks) {
+    arena->last_sweep_tick = now;
+    buddy_decay_sweep (arena);
+  }
+}
+
+void buddy_free_6 (void * ptr, void * ctx, void * arena_vp) {
+  buddy_mark_dirty ((struct buddy_chunk_state *) ctx, ptr, 6);
+  buddy_merge_6 (ptr, ctx, arena_vp);
+}
+
+void buddy_free_5 (void * ptr, void * ctx, void * arena_vp) {
+  buddy_mark_dirty ((struct buddy_chunk_state *) ctx, ptr, 5);
+  buddy_merge_5 (ptr, ctx, arena_vp);
+}
+
+void buddy_free_4 (void * ptr, void * ctx, void * arena_vp) {
+  buddy_mark_dirty ((struct buddy_chunk_state *) ctx, ptr, 4);
+  buddy_merge_4 (ptr, ctx, arena_vp);
+}
+
+void buddy_free_3 (void * ptr, void * ctx, void * arena_vp) {
+  buddy_mark_dirty ((struct buddy_chunk_state *) ctx, ptr, 3);
+  buddy_merge_3 (ptr, ctx, arena_vp);
+}
+
+void buddy_free_2 (void * ptr, void * ctx, void * arena_vp) {
+  buddy_mark_dirty ((struct buddy_chunk_state *) ctx, ptr, 2);
+  buddy_merge_2 (ptr, ctx, arena_vp);
+}
+
+void buddy_free_1 (void * ptr, void * ctx, void * arena_vp) {
+  buddy_mark_dirty ((struct buddy_chunk_state *) ctx, ptr, 1);
+  buddy_merge_1 (ptr, ctx, arena_vp);
+}
+
+void buddy_free_0 (void * ptr, void * ctx, void * arena_vp) {
+  buddy_mark_dirty ((struct buddy_chunk_state *) ctx, ptr, 0);
+  buddy_merge_0 (ptr, ctx, arena_vp);
+}
+
+/* buddy_is_clean
+   Returns 1 if the len bytes (a multiple of the page size) starting from the page containing ptr
+   have never been handed out since the chunk was mapped, which means they are still filled with zeroes.
+ */
+
+uint32_t buddy_is_clean (void * ptr, void * ctx, size_t len) {
+  struct buddy_chunk_state * st = (struct buddy_chunk_state *) ctx;
+  uint32_t first = BUDDY_BLOCK_IDX (st, ptr, 0);
+  uint32_t last = first + (len >> 12);
+
+  for (uint32_t w = first / 64; w * 64 < last; ++w) {
+    uint32_t lo = (first > w * 64 ? first : w * 64) - w * 64;
+    uint32_t hi = (last < w * 64 + 64 ? last : w * 64 + 64) - w * 64;
+    uint64_t mask = (hi - lo == 64) ? ~ 0ull : ((1ull << (hi - lo)) - 1) << lo;
+    if (st->dirty[w] & mask) return 0;
+  }
+
+  return 1;
+}
+
+/* The following routines operate on blocks of arbitrary order.
+   They access the per-order bitmaps and linked lists through the helpers below.
+ */
+
+static inline uint32_t buddy_test_avail (struct buddy_chunk_state * st, uint32_t order, uint32_t idx) {
+  switch (order) {
+  case 6: return (st->bitmap6 >> idx) & 1;
+  case 5: return (st->bitmap5 >> idx) & 1;
+  case 4: return (st->bitmap4 >> idx) & 1;
+  case 3: return (st->bitmap3 >> idx) & 1;
+  case 2: return (st->bitmap2 >> idx) & 1;
+  case 1: return (st->bitmap1 >> idx) & 1;
+  default: return (st->bitmap0[idx / 64] >> (idx % 64)) & 1;
+  }
+}
+
+/* buddy_take_avail
+   Mark an available block (order, idx) as no longer available.
+   If it was the last available block of this order in the chunk, remove the chunk from the corresponding linked list.
+ */
+
+static void buddy_take_avail (struct buddy_chunk_state * st, uint32_t order, uint32_t idx, struct buddy_arena_t * arena) {
+  struct buddy_chunk_state ** list_head, ** next, ** prev;
+
+  switch (order) {
+  case 6: st->bitmap6 &= ~ (1ull << idx); list_head = &arena->avail6_list_head; next = &st->next_avail_idx6; prev = &st->prev_avail_idx6; break;
+  case 5: st->bitmap5 &= ~ (1ull << idx); list_head = &arena->avail5_list_head; next = &st->next_avail_idx5; prev = &st->prev_avail_idx5; break;
+  case 4: st->bitmap4 &= ~ (1ull << idx); list_head = &arena->avail4_list_head; next = &st->next_avail_idx4; prev = &st->prev_avail_idx4; break;
+  case 3: st->bitmap3 &= ~ (1ull << idx); list_head = &arena->avail3_list_head; next = &st->next_avail_idx3; prev = &st->prev_avail_idx3; break;
+  case 2: st->bitmap2 &= ~ (1ull << idx); list_head = &arena->avail2_list_head; next = &st->next_avail_idx2; prev = &st->prev_avail_idx2; break;
+  case 1: st->bitmap1 &= ~ (1ull << idx); list_head = &arena->avail1_list_head; next = &st->next_avail_idx1; prev = &st->prev_avail_idx1; break;
+  default: st->bitmap0[idx / 64] &= ~ (1ull << (idx % 64)); list_head = &arena->avail0_list_head; next = &st->next_avail_idx0; prev = &st->prev_avail_idx0; break;
+  }
+
+  st->avail_num[order]--;
+  if (st->avail_num[order] == 0) {
+    /* Unlink st from the list. The prev/next fields of the neighbours live at the same offsets as ours. */
+    uintptr_t next_off = ((uintptr_t) next) - ((uintptr_t) st);
+    uintptr_t prev_off = ((uintptr_t) prev) - ((uintptr_t) st);
+    if (*prev != NULL) *(struct buddy_chunk_state **) (((uintptr_t) *prev) + next_off) = *next;
+    if (*next != NULL) *(struct buddy_chunk_state **) (((uintptr_t) *next) + prev_off) = *prev;
+    if (*list_head == st) *list_head = *next;
+    *prev = NULL;
+    *next = NULL;
+  }
+}
+
+static void buddy_free_order (void * ptr, struct buddy_chunk_state * st, uint32_t order, struct buddy_arena_t * arena) {
+  switch (order) {
+  case 6: buddy_free_6 (ptr, st, arena); break;
+  case 5: buddy_free_5 (ptr, st, arena); break;
+  case 4: buddy_free_4 (ptr, st, arena); break;
+  case 3: buddy_free_3 (ptr, st, arena); break;
+  case 2: buddy_free_2 (ptr, st, arena); break;
+  case 1: buddy_free_1 (ptr, st, arena); break;
+  default: buddy_free_0 (ptr, st, arena); break;
+  }
+}
+
+static void * buddy_alloc_order (uint32_t order, void ** ctx_ptr, struct buddy_arena_t * arena) {
+  switch (order) {
+  case 6: return buddy_alloc_6 (ctx_ptr, arena);
+  case 5: return buddy_alloc_5 (ctx_ptr, arena);
+  case 4: return buddy_alloc_4 (ctx_ptr, arena);
+  case 3: return buddy_alloc_3 (ctx_ptr, arena);
+  case 2: return buddy_alloc_2 (ctx_ptr, arena);
+  case 1: return buddy_alloc_1 (ctx_ptr, arena);
+  default: return buddy_alloc_0 (ctx_ptr, arena);
+  }
+}
+
+static void buddy_merge_order (void * ptr, struct buddy_chunk_state * st, uint32_t order, struct buddy_arena_t * arena) {
+  switch (order) {
+  case 6: buddy_merge_6 (ptr, st, arena); break;
+  case 5: buddy_merge_5 (ptr, st, arena); break;
+  case 4: buddy_merge_4 (ptr, st, arena); break;
+  case 3: buddy_merge_3 (ptr, st, arena); break;
+  case 2: buddy_merge_2 (ptr, st, arena); break;
+  case 1: buddy_merge_1 (ptr, st, arena); break;
+  default: buddy_merge_0 (ptr, st, arena); break;
+  }
+}
+
+/* buddy_avail_order_of_page
+   Returns the order of the available block containing the given page of a chunk,
+   or 7 if the page is not available.
+ */
+
+static uint32_t buddy_avail_order_of_page (struct buddy_chunk_state * st, uint32_t page) {
+  for (uint32_t order = 0; order < 7; ++order) {
+    if (buddy_test_avail (st, order, page >> order)) return order;
+  }
+  return 7;
+}
+
+/* buddy_release_pages
+   Return pages [first, last) of a chunk to the buddy allocator, as a sequence of maximal aligned blocks.
+   If dirty is set, the pages are marked dirty, since the user might have written to them.
+   Otherwise, the pages were never handed out, and their dirty bits are left unchanged.
+ */
+
+static void buddy_release_pages (struct buddy_chunk_state * st, uint32_t first, uint32_t last, uint32_t dirty, struct buddy_arena_t * arena) {
+  while (first < last) {
+    uint32_t order = first ? __builtin_ctz (first) : 6;
+    if (order > 6) order = 6;
+    while ((1u << order) > last - first) order--;
+
+    void * block = BUDDY_IDX_BLOCK (st, first >> order, order);
+    first += 1u << order;
+    if (dirty) buddy_free_order (block, st, order, arena);
+    else buddy_merge_order (block, st, order, arena);
+  }
+}
+
+/* buddy_alloc_pages
+   Allocate a run of n contiguous pages, where 1 <= n <= 64.
+   We allocate a block of order ceil(log2(n)), and return the pages after the first n to the buddy allocator.
+   Hence the run is aligned to (1 << ceil(log2(n))) pages.
+   The context pointer is set to NULL upon failure.
+ */
+
+void * buddy_alloc_pages (size_t n, void ** ctx_ptr, void * arena_vp) {
+  return buddy_alloc_pages_aligned (n, 0, ctx_ptr, arena_vp);
+}
+
+/* buddy_alloc_pages_aligned
+   Same as buddy_alloc_pages, but the run is also aligned to (1 << align_order) pages, where align_order <= 6.
+ */
+
+void * buddy_alloc_pages_aligned (size_t n, uint32_t align_order, void ** ctx_ptr, void * arena_vp) {
+  struct buddy_arena_t * arena = (struct buddy_arena_t *) arena_vp;
+  uint32_t order = (n == 1) ? 0 : 64 - __builtin_clzll (n - 1);
+  if (order < align_order) order = align_order;
+
+  void * ptr = buddy_alloc_order (order, ctx_ptr, arena);
+  if (ptr == NULL) return NULL;
+
+  struct buddy_chunk_state * st = (struct buddy_chunk_state *) *ctx_ptr;
+  uint32_t first = BUDDY_BLOCK_IDX (st, ptr, 0);
+  buddy_release_pages (st, first + n, first + (1u << order), 0, arena);
+  return ptr;
+}
+
+/* buddy_free_pages
+   Free a run of n contiguous pages starting from ptr, allocated by buddy_alloc_pages.
+ */
+
+void buddy_free_pages (void * ptr, void * ctx, size_t n, void * arena_vp) {
+  struct buddy_chunk_state * st = (struct buddy_chunk_state *) ctx;
+  uint32_t first = BUDDY_BLOCK_IDX (st, ptr, 0);
+  buddy_release_pages (st, first, first + n, 1, (struct buddy_arena_t *) arena_vp);
+}
+
+/* buddy_grow_pages
+   Try to extend a run of old_n pages starting from ptr to new_n pages, without moving it.
+   This succeeds if the pages following the run are all available,
+   and the run start stays aligned to (1 << ceil(log2(new_n))) pages.
+   Returns 1 upon success, 0 upon failure (in which case nothing is modified).
+ */
+
+uint32_t buddy_grow_pages (void * ptr, void * ctx, size_t old_n, size_t new_n, void * arena_vp) {
+  struct buddy_arena_t * arena = (struct buddy_arena_t *) arena_vp;
+  struct buddy_chunk_state * st = (struct buddy_chunk_state *) ctx;
+  uint32_t first = BUDDY_BLOCK_IDX (st, ptr, 0);
+  uint32_t last = first + new_n;
+  if (new_n > 64) return 0;
+
+  uint32_t new_order = (new_n == 1) ? 0 : 64 - __builtin_clzll (new_n - 1);
+  if (first & ((1u << new_order) - 1)) return 0;
+
+  /* The run is allocated, so each available block after it starts exactly where the previous one ends */
+  uint32_t page = first + old_n;
+  while (page < last) {
+    uint32_t order = buddy_avail_order_of_page (st, page);
+    if (order == 7) return 0;
+    page += 1u << order;
+  }
+
+  page = first + old_n;
+  while (page < last) {
+    uint32_t order = buddy_avail_order_of_page (st, page);
+    buddy_take_avail (st, order, page >> order, arena);
+    page += 1u << order;
+    /* Return the part of the block beyond the new end of the run */
+    if (page > last) buddy_release_pages (st, last, page, 0, arena);
+  }
+
+  return 1;
+}
+
+/* buddy_shrink_pages
+   Shrink a run of old_n pages starting from ptr to new_n pages, without moving it.
+   The remaining pages are returned to the buddy allocator.
+ */
+
+void buddy_shrink_pages (void * ptr, void * ctx, size_t old_n, size_t new_n, void * arena_vp) {
+  struct buddy_chunk_state * st = (struct buddy_chunk_state *) ctx;
+  uint32_t first = BUDDY_BLOCK_IDX (st, ptr, 0);
+  buddy_release_pages (st, first + new_n, first + old_n, 1, (struct buddy_arena_t *) arena_vp);
+}
+
+/* buddy_avail_page_mask
+   Compute the bitmap of available pages of a chunk.
+   Only the available blocks are visited, by walking the set bits of each per-order bitmap.
+ */
+
+static void buddy_avail_page_mask (struct buddy_chunk_state * st, uint64_t mask[2]) {
+  uint64_t bitmaps[8] = { st->bitmap0[0], st->bitmap0[1], st->bitmap1, st->bitmap2, st->bitmap3, st->bitmap4, st->bitmap5, st->bitmap6 };
+  mask[0] = 0;
+  mask[1] = 0;
+
+  for (uint32_t i = 0; i < 8; ++i) {
+    uint32_t order = i < 2 ? 0 : i - 1;
+    uint64_t bits = bitmaps[i];
+    while (bits != 0) {
+      uint32_t idx = __builtin_ctzll (bits) + (i == 1 ? 64 : 0);
+      bits &= bits - 1;
+      uint32_t first = idx << order;
+      mask[first / 64] |= (order == 6) ? ~ 0ull : ((1ull << (1 << order)) - 1) << (first % 64);
+    }
+  }
+}
+
+/* buddy_purge_chunk
+   Purge the pages of a chunk that are available and have not been freed since the last sweep.
+   If force is set, also purge pages that have been freed since the last sweep.
+   Contiguous pages are purged with a single madvise call.
+   Pages that were allocated again lose their unpurged bit, which is set again when they are freed,
+   and the chunk leaves the list of chunks with unpurged pages once no unpurged page is left.
+   Returns the number of pages purged.
+ */
+
+static uint32_t buddy_purge_chunk (struct buddy_chunk_state * st, uint32_t force, struct buddy_arena_t * arena) {
+  uint64_t avail[2];
+  uint32_t purged = 0;
+  buddy_avail_page_mask (st, avail);
+
+  for (uint32_t w = 0; w < 2; ++w) {
+    uint64_t purge = avail[w] & st->unpurged[w] & (force ? ~ 0ull : ~ st->recent[w]);
+#if LIBC_HUGEPAGE_MODE == 2
+    /* Explicit huge pages cannot be partially purged */
+    purge = 0;
+#endif
+    st->unpurged[w] &= avail[w] & ~ purge;
+#if LIBC_PURGE_ADVICE == MADV_DONTNEED
+    /* Purged pages read as zeroes */
+    st->dirty[w] &= ~ purge;
+#endif
+
+    purged += __builtin_popcountll (purge);
+
+    while (purge != 0) {
+      uint32_t first = __builtin_ctzll (purge);
+      uint64_t rest = purge >> first;
+      uint32_t len = (~ rest == 0) ? 64 - first : (uint32_t) __builtin_ctzll (~ rest);
+      madvise ((void *) (((uintptr_t) st->chunk) + ((uintptr_t) (w * 64 + first) << 12)), ((size_t) len) << 12, LIBC_PURGE_ADVICE);
+      purge &= (len + first == 64) ? 0 : ~ ((1ull << (first + len)) - 1);
+    }
+
+    st->recent[w] = 0;
+  }
+
+  if ((st->unpurged[0] | st->unpurged[1]) == 0) buddy_unpurged_unlink (st, arena);
+  return purged;
+}
+
+/* buddy_decay_sweep
+   Purge pages that have stayed available for a whole decay period.
+   Only chunks with unpurged pages are visited, and no chunk is unmapped.
+ */
+
+static void buddy_decay_sweep (struct buddy_arena_t * arena) {
+  struct buddy_chunk_state * st = arena->unpurged_list_head;
+  while (st != NULL) {
+    struct buddy_chunk_state * next = st->next_unpurged;
+    buddy_purge_chunk (st, 0, arena);
+    st = next;
+  }
+}
+
+/* free_buddy_chunk_state_group
+   Return a group of buddy_chunk_state records to the OS.
+   None of its records may be in use, hence all of them are in the empty record list.
+ */
+
+static void free_buddy_chunk_state_group (struct buddy_chunk_state_group * group, struct buddy_arena_t * arena) {
+  for (uint32_t i = 0; i < BUDDY_RECORDS_PER_GROUP; ++i) {
+    struct buddy_chunk_state * st = &(group->state_records[i]);
+    if (st->prev_empty_state != NULL) st->prev_empty_state->next_empty_state = st->next_empty_state;
+    if (st->next_empty_state != NULL) st->next_empty_state->prev_empty_state = st->prev_empty_state;
+    if (arena->empty_list_head == st) arena->empty_list_head = st->next_empty_state;
+  }
+
+  if (group->prev_group != NULL) group->prev_group->next_group = group->next_group;
+  if (group->next_group != NULL) group->next_group->prev_group = group->prev_group;
+  if (arena->group_list_head == group) arena->group_list_head = group->next_group;
+  mmap_free (group, group, 16 << 12);
+}
+
+#if LIBC_HUGEPAGE_MODE
+
+/* buddy_trim_region
+   In huge page mode, unmap the region starting at the chunk of st if all chunks of the region are empty,
+   unless it still fits within keep_bytes, in which case it is counted in *kept_ptr.
+   Each region is only considered from its first chunk.
+   Returns the number of bytes unmapped.
+ */
+
+static size_t buddy_trim_region (struct buddy_chunk_state * st, size_t * kept_ptr, size_t keep_bytes, struct buddy_arena_t * arena) {
+  void * region = st->chunk;
+  if (((uintptr_t) region) & (LIBC_HUGEPAGE_SIZE - 1)) return 0;
+
+  /* The chunks of a region are registered from the time it is mapped until it is unmapped */
+  for (uint32_t i = 0; i < BUDDY_REGION_CHUNK_NUM; ++i) {
+    struct buddy_chunk_state * chunk_st = buddy_lookup_chunk (BUDDY_REGION_CHUNK (region, i));
+    if (chunk_st->bitmap6 != 3) return 0;
+  }
+
+  if (*kept_ptr + LIBC_HUGEPAGE_SIZE <= keep_bytes) {
+    *kept_ptr += LIBC_HUGEPAGE_SIZE;
+    return 0;
+  }
+
+  for (uint32_t i = 0; i < BUDDY_REGION_CHUNK_NUM; ++i) buddy_release_chunk (buddy_lookup_chunk (BUDDY_REGION_CHUNK (region, i)), arena);
+  mmap_free (region, region, LIBC_HUGEPAGE_SIZE);
+  return LIBC_HUGEPAGE_SIZE;
+}
+
+#endif
+
+/* buddy_trim
+   Return as much memory as possible to the OS:
+   empty chunks are unmapped, except for keep_bytes worth of them
+   (in huge page mode, whole regions are unmapped once all of their chunks are empty),
+   the available pages of the remaining chunks (including the empty chunks kept) are purged regardless of when they were freed,
+   and groups of buddy_chunk_state records with no record in use are unmapped.
+   Returns the number of bytes returned to the OS.
+ */
+
+size_t buddy_trim (void * arena_vp, size_t keep_bytes) {
+  struct buddy_arena_t * arena = (struct buddy_arena_t *) arena_vp;
+  size_t released = 0, kept = 0;
+
+  /* 1. Unmap empty chunks */
+  for (struct buddy_chunk_state_group * group = arena->group_list_head; group != NULL; group = group->next_group) {
+    for (uint32_t i = 0; i < BUDDY_RECORDS_PER_GROUP; ++i) {
+      struct buddy_chunk_state * st = &(group->state_records[i]);
+      if (!st->in_use || st->bitmap6 != 3) continue;
+
+#if LIBC_HUGEPAGE_MODE == 0
+      if (kept + (128 << 12) > keep_bytes) {
+	void * chunk = st->chunk;
+	buddy_release_chunk (st, arena);
+	mmap_free (chunk, chunk, 128 << 12);
+	released += 128 << 12;
+      } else {
+	kept += 128 << 12;
+      }
+#else
+      released += buddy_trim_region (st, &kept, keep_bytes, arena);
+#endif
+    }
+  }
+
+  /* 2. Purge the remaining chunks, and unmap groups of records no longer in use */
+  struct buddy_chunk_state_group * group = arena->group_list_head;
+  while (group != NULL) {
+    struct buddy_chunk_state_group * next_group = group->next_group;
+    uint32_t in_use = 0;
+
+    for (uint32_t i = 0; i < BUDDY_RECORDS_PER_GROUP; ++i) {
+      struct buddy_chunk_state * st = &(group->state_records[i]);
+      if (!st->in_use) continue;
+      released += ((size_t) buddy_purge_chunk (st, 1, arena)) << 12;
+      in_use++;
+    }
+
+    if (in_use == 0) {
+      free_buddy_chunk_state_group (group, arena);
+      released += 16 << 12;
+    }
+    group = next_group;
+  }
+
+  return released;
+}
+
+void buddy_stats (void * arena_vp, struct malloc_stats * stats) {
+  struct buddy_arena_t * arena = (struct buddy_arena_t *) arena_vp;
+
+  for (struct buddy_chunk_state_group * group = arena->group_list_head; group != NULL; group = group->next_group) {
+    stats->buddy_chunk_groups++;
+    for (uint32_t i = 0; i < BUDDY_RECORDS_PER_GROUP; ++i) {
+      struct buddy_chunk_state * st = &(group->state_records[i]);
+      if (!st->in_use) continue;
+
+      uint64_t avail[2];
+      buddy_avail_page_mask (st, avail);
+      uint32_t avail_pages = __builtin_popcountll (avail[0]) + __builtin_popcountll (avail[1]);
+
+      stats->buddy_chunks++;
+      if (avail_pages == 128) stats->buddy_empty_chunks++;
+      if (avail_pages == 0) stats->buddy_full_chunks++;
+      stats->buddy_used_pages += 128 - avail_pages;
+      stats->buddy_unpurged_pages += __builtin_popcountll (avail[0] & st->unpurged[0]) + __builtin_popcountll (avail[1] & st->unpurged[1]);
+      for (uint32_t order = 0; order < 7; ++order) stats->buddy_avail_blocks[order] += st->avail_num[order];
+    }
+  }
+}
+
+/* Native runs
+   A run can be marked as native, so that it can later be identified from its first page alone, with no header.
+   The first and last pages of each native run are recorded in the native_start and native_end bitmaps of its chunk.
+   Other threads may look up native runs of this chunk concurrently, hence the bitmap words are accessed atomically.
+ */
+
+static inline void buddy_native_update (uint64_t * word, uint64_t set_mask, uint64_t clear_mask) {
+  uint64_t val = __atomic_load_8 (word, __ATOMIC_SEQ_CST);
+  __atomic_store_8 (word, (val | set_mask) & ~ clear_mask, __ATOMIC_SEQ_CST);
+}
+
+void buddy_mark_native (void * ptr, void * ctx, size_t n) {
+  struct buddy_chunk_state * st = (struct buddy_chunk_state *) ctx;
+  uint32_t first = BUDDY_BLOCK_IDX (st, ptr, 0);
+  uint32_t last = first + n - 1;
+  buddy_native_update (&st->native_end[last / 64], 1ull << (last % 64), 0);
+  buddy_native_update (&st->native_start[first / 64], 1ull << (first % 64), 0);
+}
+
+void * buddy_lookup_native (void * ptr, size_t * n_ptr, void ** arena_ptr) {
+  struct buddy_chunk_state * st = buddy_lookup_chunk (ptr);
+  if (st == NULL) return NULL;
+
+  uint32_t first = BUDDY_BLOCK_IDX (st, ptr, 0);
+  if (!((__atomic_load_8 (&st->native_start[first / 64], __ATOMIC_SEQ_CST) >> (first % 64)) & 1)) return NULL;
+
+  /* The run ends at the first native_end bit at or after its first page */
+  uint32_t last = first;
+  uint64_t ends = __atomic_load_8 (&st->native_end[first / 64], __ATOMIC_SEQ_CST) >> (first % 64);
+  if (ends != 0) {
+    last += __builtin_ctzll (ends);
+  } else {
+    last = 64 + __builtin_ctzll (__atomic_load_8 (&st->native_end[1], __ATOMIC_SEQ_CST));
+  }
+
+  *n_ptr = last - first + 1;
+  *arena_ptr = st->arena;
+  return st;
+}
+
+void buddy_free_native (void * ptr, void * ctx, size_t n, void * arena_vp) {
+  struct buddy_chunk_state * st = (struct buddy_chunk_state *) ctx;
+  uint32_t first = BUDDY_BLOCK_IDX (st, ptr, 0);
+  uint32_t last = first + n - 1;
+  buddy_native_update (&st->native_start[first / 64], 0, 1ull << (first % 64));
+  buddy_native_update (&st->native_end[last / 64], 0, 1ull << (last % 64));
+  buddy_free_pages (ptr, ctx, n, arena_vp);
+}
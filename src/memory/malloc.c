@@ -3,68 +3,273 @@
 #include <string.h>
 #include <memory.h>
 #include <tls.h>
+#include <io.h>
+#include <config.h>
 
 /* get_class
    Returns size class for a given requested allocation size.
  */
 static inline uint64_t get_class (uint64_t size) {
   if (size <= 512) {
-    return size + ((- size) & 32);
-  } else if (size <= 262144) {
-    return 1ull << (64 - __builtin_clzll (size - 1));
+    return size + ((- size) & 31);
+  } else if (size <= 2048) {
+    /* Four classes between consecutive powers of two */
+    uint64_t step = (1ull << (63 - __builtin_clzll (size - 1))) / 4;
+    return size + ((- size) & (step - 1));
   } else {
-    return size + ((- size) & 4096);
+    /* Runs of pages from buddy-alloc, or regions from mmap-alloc */
+    return size + ((- size) & 4095);
   }
 }
 
-/* When a region of memory is allocated through malloc(),
-   the region is prepended with 16 bytes of metadata:
+/* Allocations of at most 2048 bytes are served directly by small-class-alloc, and carry no metadata.
+   The small-class block containing the allocation, its size class and its owning arena
+   are found by masking the address (see small_class.c).
+   The address of every small-class slot is 16 mod 32.
+
+   All other allocations are 32-byte aligned, and are prepended with 32 bytes of metadata (struct malloc_header).
+   The type field is one of MALLOC_TYPE_SMALL, MALLOC_TYPE_BUDDY, and MALLOC_TYPE_MMAP,
+   indicating which allocator made the allocation.
+   The ctx, len, and arena fields are the arguments we need to pass to the corresponding X_free function.
+   For mmap allocations the arena field is only used to find the arena that made the allocation,
+   against which its bytes are accounted (see mmap_cache_free) and which keeps its profile record.
+
+   Hence free() distinguishes the two cases by testing bit 4 of the address.
+   MALLOC_TYPE_SMALL only occurs for aligned allocations, which are placed inside a small-class slot.
+
+   Aligned allocations with alignment at least 4096 and at most 64 pages are served natively by buddy-alloc,
+   as a run of pages aligned to the requested alignment, and carry no header.
+   Their length and arena are recorded in the state of their chunk (see buddy_mark_native).
+   free() looks up every page-aligned address in the chunk map to tell native runs apart from other allocations.
+
+   Objects of pools (see pool_create_with_arena) are never passed to free(),
+   but are handed to their owner through the same free-set as other regions.
+   Such an object is put into the free-set as the address within the object that is 8 mod 16,
+   which no allocation returned by malloc() can be.
+ */
 
-   Let x be the 8-byte value at location -8, and let y be the 8-byte value at location -16.
-   First take the lowest 3 bits of x and y, let s = (x & 0x07) | ((y & 0x07) << 3).
+#define MALLOC_TYPE_SMALL 1
+#define MALLOC_TYPE_BUDDY 2
+#define MALLOC_TYPE_MMAP 3
 
-   If s == 63, then this allocation is made by mmap, and its size is (x & ~0x07).
-   The beginning address of the allocation is (y & ~0x07).
-   To free this allocation we call munmap directly.
+struct malloc_header {
+  void * ctx;
+  uint64_t len;
+  struct malloc_arena_t * arena;
+  uint64_t type;
+};
 
-   Otherwise, the allocation is made through either buddy-alloc or small-class-alloc.
-   In both cases, the arena pointer is stored in (x & ~0x07), and the context pointer is stored in (y & ~0x07).
+_Static_assert (sizeof (struct malloc_header) == 32, "struct malloc_header is not 32 bytes");
 
-   If 1 <= s <= 18 then this is a small-class allocation, corresponding to the 18 size classes of small-class-alloc (ordered from small to large).
-   If 19 <= s <= 25 then this is a buddy-alloc allocation, corresponding to the 7 size classes of buddy-alloc (ordered from small to large).
- */
+#define MALLOC_HEADER(ptr) ((struct malloc_header *) (((uintptr_t) (ptr)) - sizeof (struct malloc_header)))
+#define IS_SMALL_SLOT(ptr) ((((uintptr_t) (ptr)) & 16) != 0)
+#define IS_PAGE_ALIGNED(ptr) ((((uintptr_t) (ptr)) & 4095) == 0)
+#define IS_POOL_ELEMENT(ptr) ((((uintptr_t) (ptr)) & 8) != 0)
+#define POOL_ELEMENT(obj) ((void *) (((uintptr_t) (obj)) | 8))
+
+/* A run of len bytes from buddy-alloc is aligned to the next power of two of len */
+#define BUDDY_RUN_START(ptr, len) ((void *) (((uintptr_t) (ptr)) & ~ ((1ull << (64 - __builtin_clzll ((len) - 1))) - 1)))
 
 /* When a region is allocated and freed by the same thread,
    the underlying allocator is called directly.
    Otherwise, it is put into a "free-set", waiting for the thread
    that originally made the allocation to free it.
 
-   Our "free-set" implementation follows the "non-linearizable queue"
-   used in snmalloc (https://dl.acm.org/doi/pdf/10.1145/3315573.3329980).
-   Each thread has a queue of its own. Each queue is a singly linked list
-   represented by its head and tail. Only the owner may take elements
-   out of this queue, while all other threads add elements (memory regions
-   to be freed) into this queue.
+   Each arena has a free-set of its own, which is a struct mpsc_queue_t (see queue.h):
+   only the owner takes elements out of it, while all other threads add elements (memory regions to be freed) into it.
+   We use the first 8 bytes of the allocated region as the struct mpsc_node of each queue element.
+   When a thread calls free(), no one should be using these bytes anymore.
 
-   We use the first 8 bytes of the allocated region as the 'next' pointer
-   of each queue element. When a thread calls free(), no one should be using
-   these bytes anymore.
+   Each call to malloc() and free() will also call free_set_clear()
+   which clears regions pending to be freed.
 
-   To remove an element from the queue, the owner simply sets the head to head.next,
-   and returns the previous head. To add an element to the queue, swap tail with
-   the new element, and set orig_tail.next to the new element.
+   To avoid an atomic swap for every cross-thread free(), each arena buffers the regions
+   it frees on behalf of other arenas in LIBC_REMOTE_FREE_BUCKETS buckets, selected by the address of the owner.
+   Each bucket holds a pre-linked list of regions with the same owner,
+   and is appended to the free-set of the owner with a single swap once it holds LIBC_REMOTE_FREE_BATCH regions,
+   or when a region with a different owner maps to the same bucket.
+   clear_free_set() flushes all buckets of the calling thread.
+ */
 
-   There is a minor caveat with this concurrent queue. The last element of the
-   queue cannot be taken out, because some other thread might be writing to the
-   'next' field. We resolve this issue by introducing "placeholder" elements, one
-   for each thread. When the owner of the thread wants to take out the last element
-   of the queue, it inserts the placeholder into the queue. After other threads add
-   new elements so that the placeholder is no longer the last element, we take it out.
+/* Given a pointer to a small-class slot, find the arena that made the allocation */
+static inline struct malloc_arena_t * get_small_slot_arena (void * ptr) {
+  void * ctx;
+  size_t len;
+  struct small_class_arena_t * small_arena = small_lookup (ptr, &ctx, &len);
+  return (struct malloc_arena_t *) (((uintptr_t) small_arena) - offsetof (struct malloc_arena_t, small_class_arena));
+}
 
-   Each call to malloc() and free() will also call free_set_clear()
-   which clears regions pending to be freed.
+/* Given a page-aligned pointer, find whether it is a native run of pages (see aligned_alloc_with_arena).
+   Returns the context pointer, and outputs the number of pages and the owning arena; returns NULL otherwise.
+ */
+static inline void * lookup_native (void * ptr, size_t * n_ptr, struct malloc_arena_t ** arena_ptr) {
+  void * buddy_arena;
+  void * ctx = buddy_lookup_native (ptr, n_ptr, &buddy_arena);
+  if (ctx != NULL) *arena_ptr = (struct malloc_arena_t *) (((uintptr_t) buddy_arena) - offsetof (struct malloc_arena_t, buddy_arena));
+  return ctx;
+}
+
+/* Heap profiling (when LIBC_MALLOC_PROFILE is set)
+
+   Allocations made by malloc, calloc, aligned_alloc, realloc and malloc_bulk are sampled, so that on average one sample is taken
+   every LIBC_MALLOC_PROFILE_INTERVAL bytes: the number of bytes between two samples is drawn
+   from an exponential distribution, which makes the chance of sampling an allocation proportional to its size.
+   A realloc that keeps the allocation in place counts as a new allocation of the new size.
+
+   The samples are kept in a ring of records, the oldest being overwritten when it is full.
+   The record of an allocation is kept by the arena that owns its memory (see profile_owner),
+   which is not always the arena that made it (e.g. slots from the per-CPU cache),
+   so that the thread freeing it, whichever it is, can find the record from the address alone.
+   Hence the records are protected by a mutex, while the sampling state is only used by the thread of the arena.
+   A record is dropped before its allocation is freed, so that a record never refers to a reused address.
+
+   The caller of the allocation function is passed down as PROFILE_CALLER, so that internal calls
+   (e.g. realloc falling back to malloc) record the caller of the user-facing function.
+   The backtrace is found by following the chain of frame records (x29 points to the saved x29 and x30 of the caller),
+   which stops at the zero frame pointer set up by _start.
  */
 
+#if LIBC_MALLOC_PROFILE
+
+_Static_assert (LIBC_MALLOC_PROFILE_RECORDS < 256, "LIBC_MALLOC_PROFILE_RECORDS does not fit in the profile filter");
+
+#define PROFILE_HASH(ptr) ((((uintptr_t) (ptr)) * 0x9e3779b97f4a7c15ull) >> 56)
+
+/* profile_next_interval
+   Draw the number of bytes until the next sample.
+   For u uniform in (0, 1), -ln(u) is exponentially distributed with mean 1.
+   We compute -log2(u) in 16.16 fixed point, interpolating linearly between powers of two, and multiply it by ln 2.
+ */
+static uint64_t profile_next_interval (struct malloc_profile_t * prof) {
+  /* xorshift64 */
+  uint64_t x = prof->rng_state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  prof->rng_state = x;
+
+  uint64_t r = x | 1;
+  uint64_t e = 63 - __builtin_clzll (r);
+  uint64_t frac = (e >= 16 ? r >> (e - 16) : r << (16 - e)) & 0xffff;
+  uint64_t neg_log2 = (64ull << 16) - ((e << 16) | frac);
+
+  /* 45426 is ln 2 in 16.16 fixed point */
+  return (((LIBC_MALLOC_PROFILE_INTERVAL * neg_log2) >> 16) * 45426 >> 16) + 1;
+}
+
+/* profile_sample
+   Record an allocation, made by a call to malloc returning to ret_addr.
+   fp is the frame pointer of the function called from ret_addr.
+   Must be called with the mutex of prof held.
+ */
+static void profile_sample (struct malloc_profile_t * prof, void * ptr, uint64_t size, uint64_t class_size, void * ret_addr, void ** fp) {
+  struct malloc_profile_record * rec = &prof->records[prof->next_record];
+  if (rec->ptr != NULL) {
+    __atomic_store_n (&prof->filter[PROFILE_HASH (rec->ptr)], prof->filter[PROFILE_HASH (rec->ptr)] - 1, __ATOMIC_RELAXED);
+    __atomic_store_n (&prof->live_records, prof->live_records - 1, __ATOMIC_RELAXED);
+  }
+
+  rec->ptr = ptr;
+  rec->size = size;
+  rec->class_size = class_size;
+  rec->ret_addr = ret_addr;
+
+  /* Stop at the end of the chain, or at anything that does not look like a frame record further up the stack */
+  uint32_t i = 0;
+  void ** frame = fp;
+  while (i < LIBC_MALLOC_PROFILE_DEPTH && frame != NULL) {
+    void ** next = (void **) frame[0];
+    if (next == NULL || (((uintptr_t) next) & 7) != 0 || next <= frame) break;
+    if (((uintptr_t) next) - ((uintptr_t) frame) > (1ull << 20)) break;
+    frame = next;
+    rec->frames[i++] = frame[1];
+  }
+  while (i < LIBC_MALLOC_PROFILE_DEPTH) rec->frames[i++] = NULL;
+
+  __atomic_store_n (&prof->filter[PROFILE_HASH (ptr)], prof->filter[PROFILE_HASH (ptr)] + 1, __ATOMIC_RELAXED);
+  __atomic_store_n (&prof->live_records, prof->live_records + 1, __ATOMIC_RELAXED);
+  prof->next_record = (prof->next_record + 1) % LIBC_MALLOC_PROFILE_RECORDS;
+}
+
+/* profile_owner
+   Find the arena that owns the memory of an allocation, which keeps its record.
+ */
+static struct malloc_arena_t * profile_owner (void * ptr) {
+  if (IS_SMALL_SLOT (ptr)) return get_small_slot_arena (ptr);
+
+  size_t n;
+  struct malloc_arena_t * owner;
+  if (IS_PAGE_ALIGNED (ptr) && lookup_native (ptr, &n, &owner) != NULL) return owner;
+  return (struct malloc_arena_t *) __atomic_load_8 ((uintptr_t *) &MALLOC_HEADER (ptr)->arena, __ATOMIC_SEQ_CST);
+}
+
+/* profile_alloc
+   Count an allocation of size bytes towards the next sample, and take the sample if it is due.
+ */
+static inline void profile_alloc (struct malloc_profile_t * prof, void * ptr, uint64_t size, uint64_t class_size, void * ret_addr, void ** fp) {
+  prof->bytes_until_sample -= size;
+  if (prof->bytes_until_sample > 0) return;
+
+  struct malloc_profile_t * owner_prof = &profile_owner (ptr)->profile;
+  mutex_lock (&owner_prof->lock);
+  profile_sample (owner_prof, ptr, size, class_size, ret_addr, fp);
+  mutex_unlock (&owner_prof->lock);
+  prof->bytes_until_sample = profile_next_interval (prof);
+}
+
+/* profile_free
+   Drop the record of ptr, if it was sampled.
+   prof must be the profile of the arena that owns the memory of ptr.
+ */
+static inline void profile_free (struct malloc_profile_t * prof, void * ptr) {
+  /* The record of ptr, if any, was added before ptr was handed to this thread, hence these loads see it */
+  if (__atomic_load_n (&prof->live_records, __ATOMIC_RELAXED) == 0) return;
+  uint64_t h = PROFILE_HASH (ptr);
+  if (__atomic_load_n (&prof->filter[h], __ATOMIC_RELAXED) == 0) return;
+
+  mutex_lock (&prof->lock);
+  for (uint32_t i = 0; i < LIBC_MALLOC_PROFILE_RECORDS; ++i) {
+    if (prof->records[i].ptr == ptr) {
+      prof->records[i].ptr = NULL;
+      __atomic_store_n (&prof->filter[h], prof->filter[h] - 1, __ATOMIC_RELAXED);
+      __atomic_store_n (&prof->live_records, prof->live_records - 1, __ATOMIC_RELAXED);
+      break;
+    }
+  }
+  mutex_unlock (&prof->lock);
+}
+
+/* Functions taking the caller of the user-facing allocation function take PROFILE_CALLER_PARAMS last */
+#define PROFILE_CALLER_PARAMS , void * ret_addr, void ** fp
+#define PROFILE_CALLER_ARGS , ret_addr, fp
+/* Must be expanded in the function called by the user, so that the return address is that of the caller */
+#define PROFILE_CALLER , __builtin_return_address (0), (void **) __builtin_frame_address (0)
+
+#define PROFILE_ALLOC(arena, ptr, size, class_size) profile_alloc (&(arena)->profile, ptr, size, class_size, ret_addr, fp)
+#define PROFILE_FREE(owner, ptr) profile_free (&(owner)->profile, ptr)
+
+#else
+
+#define PROFILE_CALLER_PARAMS
+#define PROFILE_CALLER_ARGS
+#define PROFILE_CALLER
+
+#define PROFILE_ALLOC(arena, ptr, size, class_size) ((void) 0)
+#define PROFILE_FREE(owner, ptr) ((void) 0)
+
+#endif
+
+/* Small slots freed by free() go to the cache of the current CPU first (see small_class.c),
+   and small allocations made by malloc() are taken from it first.
+ */
+#if LIBC_MALLOC_PERCPU_CACHE
+#define PERCPU_ALLOC(class_size) small_percpu_alloc (class_size)
+#define PERCPU_FREE(ptr) small_percpu_free (ptr)
+#else
+#define PERCPU_ALLOC(class_size) NULL
+#define PERCPU_FREE(ptr) 0
+#endif
+
 static inline struct malloc_arena_t * get_thread_malloc_arena (void) {
   return ((struct tls_struct *) get_thread_pointer ()) -> malloc_arena;
 }
@@ -73,74 +278,111 @@ void malloc_init (void) {
   struct malloc_arena_t * arena = get_thread_malloc_arena ();
   __builtin_memset (arena, 0, sizeof (struct malloc_arena_t));
   arena->small_class_arena.buddy_arena = &arena->buddy_arena;
-  arena->free_set_head = &arena->free_set_placeholder;
-  arena->free_set_tail = &arena->free_set_placeholder;
+  mpsc_queue_init (&arena->free_set);
+#if LIBC_MALLOC_PROFILE
+  arena->profile.rng_state = (((uintptr_t) arena) * 0x9e3779b97f4a7c15ull) | 1;
+  arena->profile.bytes_until_sample = profile_next_interval (&arena->profile);
+#endif
 }
 
-void * malloc_with_arena (size_t size, struct malloc_arena_t * arena) {
-  if (!size) return NULL;
-  if (size >= 1ull << 37) return NULL;
-
-  /* Clear pending regions to be freed */
-  clear_free_set_of_arena (arena);
-
-  size += 16; // Metadata
-  uint64_t class_size = get_class (size);
-  if (class_size >= 1ull << 37) return NULL;
+/* alloc_by_class
+   Allocate a region of size class_size from the appropriate allocator.
+   Outputs the context pointer; it is set to NULL upon failure.
+   If clean_ptr is not NULL, also outputs whether the region is known to be filled with zeroes.
+ */
+static void * alloc_by_class (uint64_t class_size, void ** ctx_ptr, struct malloc_arena_t * arena, uint32_t * clean_ptr) {
+  void * ptr = NULL;
+  uint32_t clean = 0;
+  *ctx_ptr = NULL;
 
-  void * ptr = NULL, * ctx = NULL;
   if (class_size <= 2048) {
 
-    ptr = small_alloc (class_size, &ctx, &arena->small_class_arena);
+    ptr = small_alloc (class_size, ctx_ptr, &arena->small_class_arena);
 
   } else if (class_size <= 262144) {
 
-    if (class_size == 4096) {
-      ptr = buddy_alloc_0 (&ctx, &arena->buddy_arena);
-    } else if (class_size == 8192) {
-      ptr = buddy_alloc_1 (&ctx, &arena->buddy_arena);
-    } else if (class_size == 16384) {
-      ptr = buddy_alloc_2 (&ctx, &arena->buddy_arena);
-    } else if (class_size == 32768) {
-      ptr = buddy_alloc_3 (&ctx, &arena->buddy_arena);
-    } else if (class_size == 65536) {
-      ptr = buddy_alloc_4 (&ctx, &arena->buddy_arena);
-    } else if (class_size == 131072) {
-      ptr = buddy_alloc_5 (&ctx, &arena->buddy_arena);
-    } else if (class_size == 262144) {
-      ptr = buddy_alloc_6 (&ctx, &arena->buddy_arena);
-    }
+    ptr = buddy_alloc_pages (class_size >> 12, ctx_ptr, &arena->buddy_arena);
+    if (clean_ptr != NULL && ptr != NULL) clean = buddy_is_clean (ptr, *ctx_ptr, class_size);
 
   } else {
 
-    ptr = mmap_alloc (class_size, &ctx);
+    ptr = mmap_cache_alloc (class_size, ctx_ptr, &arena->mmap_arena, &clean);
 
   }
 
-  if (ctx == NULL) return NULL;
+  if (clean_ptr != NULL) *clean_ptr = clean;
+  return ptr;
+}
 
-  /* Encode metadata */
-  uintptr_t x, y;
-  if (class_size > 262144) {
-    x = ((uintptr_t) class_size) | 0x07;
-    y = ((uintptr_t) ctx) | 0x07;
-  } else if (class_size >= 1024) {
-    uint32_t s = __builtin_ctzll (class_size) + 7;
-    x = ((uintptr_t) arena) | (s & 0x07);
-    y = ((uintptr_t) ctx) | ((s >> 3) & 0x07);
-  } else {
-    uint32_t s = class_size / 32;
-    x = ((uintptr_t) arena) | (s & 0x07);
-    y = ((uintptr_t) ctx) | ((s >> 3) & 0x07);
+/* write_header
+   Fill in the metadata of an allocation of size class_size, to be returned to the user at address ptr.
+ */
+static void write_header (void * ptr, void * ctx, uint64_t class_size, struct malloc_arena_t * arena) {
+  struct malloc_header * hdr = MALLOC_HEADER (ptr);
+  uint64_t type;
+  if (class_size > 262144) type = MALLOC_TYPE_MMAP;
+  else if (class_size > 2048) type = MALLOC_TYPE_BUDDY;
+  else type = MALLOC_TYPE_SMALL;
+
+  hdr->ctx = ctx;
+  hdr->len = class_size;
+  __atomic_store_8 ((uintptr_t *) &hdr->arena, (uintptr_t) arena, __ATOMIC_SEQ_CST);
+  __atomic_store_8 (&hdr->type, type, __ATOMIC_SEQ_CST);
+}
+
+/* stat_alloc
+   Record an allocation of `requested` bytes, for which `reserved` bytes were reserved.
+ */
+static inline void stat_alloc (struct malloc_arena_t * arena, uint64_t requested, uint64_t reserved) {
+#if LIBC_MALLOC_STATS
+  arena->stat_requested_bytes += requested;
+  arena->stat_reserved_bytes += reserved;
+#else
+  (void) arena;
+  (void) requested;
+  (void) reserved;
+#endif
+}
+
+static void * malloc_internal (size_t size, struct malloc_arena_t * arena PROFILE_CALLER_PARAMS) {
+  if (!size) return NULL;
+  if (size >= 1ull << 37) return NULL;
+
+  /* Clear pending regions to be freed */
+  clear_free_set_of_arena (arena);
+
+  void * ptr, * ctx;
+
+  if (size <= 2048) {
+    ptr = PERCPU_ALLOC (get_class (size));
+    if (ptr == NULL) {
+      ptr = small_alloc (get_class (size), &ctx, &arena->small_class_arena);
+      if (ctx == NULL) return NULL;
+    }
+    stat_alloc (arena, size, get_class (size));
+    PROFILE_ALLOC (arena, ptr, size, get_class (size));
+    return ptr;
   }
 
-  __atomic_store_8 ((uintptr_t *) ptr, y, __ATOMIC_SEQ_CST);
-  __atomic_store_8 ((uintptr_t *) (((uintptr_t) ptr) + 8), x, __ATOMIC_SEQ_CST);
-  return (void *) (((uintptr_t) ptr) + 16);
+  uint64_t class_size = get_class (size + sizeof (struct malloc_header));
+  if (class_size >= 1ull << 37) return NULL;
+
+  ptr = alloc_by_class (class_size, &ctx, arena, NULL);
+  if (ctx == NULL) return NULL;
+
+  ptr = (void *) (((uintptr_t) ptr) + sizeof (struct malloc_header));
+  write_header (ptr, ctx, class_size, arena);
+  stat_alloc (arena, size, class_size);
+  PROFILE_ALLOC (arena, ptr, size, class_size);
+  return ptr;
 }
 
-void * aligned_alloc_with_arena (size_t alignment, size_t size, struct malloc_arena_t * arena) {
-  if (alignment <= 16) return malloc_with_arena (size, arena);
+void * malloc_with_arena (size_t size, struct malloc_arena_t * arena) {
+  return malloc_internal (size, arena PROFILE_CALLER);
+}
+
+static void * aligned_alloc_internal (size_t alignment, size_t size, struct malloc_arena_t * arena PROFILE_CALLER_PARAMS) {
+  if (alignment <= 16) return malloc_internal (size, arena PROFILE_CALLER_ARGS);
 
   if (!size) return NULL;
   if (size >= 1ull << 37) return NULL;
@@ -150,190 +392,570 @@ void * aligned_alloc_with_arena (size_t alignment, size_t size, struct malloc_ar
   unsigned int alignment_log = __builtin_ctzll (alignment);
   if (alignment_log >= 36) return NULL;
 
-  size += alignment;
-  uint64_t class_size = get_class (size);
+  void * ptr, * ctx;
+
+  /* Serve page-aligned requests as a native run of pages, without over-allocation */
+  uint64_t page_num = (size + 4095) >> 12;
+  if (alignment_log >= 12 && alignment_log <= 18 && page_num <= 64) {
+    ptr = buddy_alloc_pages_aligned (page_num, alignment_log - 12, &ctx, &arena->buddy_arena);
+    if (ptr == NULL) return NULL;
+    buddy_mark_native (ptr, ctx, page_num);
+    stat_alloc (arena, size, page_num << 12);
+    PROFILE_ALLOC (arena, ptr, size, page_num << 12);
+    return ptr;
+  }
+
+  /* The region returned by the underlying allocator is at least 16-byte aligned.
+     We need room for the metadata, as well as the padding needed to reach the desired alignment.
+   */
+  uint64_t class_size = get_class (size + alignment + sizeof (struct malloc_header) - 16);
   if (class_size >= 1ull << 37) return NULL;
 
-  void * ptr = NULL, * ctx = NULL;
-  if (class_size <= 2048) {
+  ptr = alloc_by_class (class_size, &ctx, arena, NULL);
+  if (ctx == NULL) return NULL;
 
-    ptr = small_alloc (class_size, &ctx, &arena->small_class_arena);
+  /* Find the smallest aligned address that leaves room for the metadata */
+  uintptr_t ptr_int = ((uintptr_t) ptr) + sizeof (struct malloc_header);
+  ptr_int = (ptr_int + alignment - 1) & ~ ((uintptr_t) alignment - 1);
+  ptr = (void *) ptr_int;
 
-  } else if (class_size <= 262144) {
+  write_header (ptr, ctx, class_size, arena);
+  stat_alloc (arena, size, class_size);
+  PROFILE_ALLOC (arena, ptr, size, class_size);
+  return ptr;
+}
 
-    if (class_size == 4096) {
-      ptr = buddy_alloc_0 (&ctx, &arena->buddy_arena);
-    } else if (class_size == 8192) {
-      ptr = buddy_alloc_1 (&ctx, &arena->buddy_arena);
-    } else if (class_size == 16384) {
-      ptr = buddy_alloc_2 (&ctx, &arena->buddy_arena);
-    } else if (class_size == 32768) {
-      ptr = buddy_alloc_3 (&ctx, &arena->buddy_arena);
-    } else if (class_size == 65536) {
-      ptr = buddy_alloc_4 (&ctx, &arena->buddy_arena);
-    } else if (class_size == 131072) {
-      ptr = buddy_alloc_5 (&ctx, &arena->buddy_arena);
-    } else if (class_size == 262144) {
-      ptr = buddy_alloc_6 (&ctx, &arena->buddy_arena);
-    }
+void * aligned_alloc_with_arena (size_t alignment, size_t size, struct malloc_arena_t * arena) {
+  return aligned_alloc_internal (alignment, size, arena PROFILE_CALLER);
+}
 
-  } else {
+/* calloc_with_arena
+   Allocate a region filled with zeroes.
+   Fresh pages from the OS are already zero, so we only clear memory that might have been used before:
+   small-class slots below the fresh mark of their block, buddy blocks with dirty pages,
+   and mmap regions reused from the cache.
+ */
+static void * calloc_internal (size_t nmemb, size_t size, struct malloc_arena_t * arena PROFILE_CALLER_PARAMS) {
+  size_t total;
+  if (__builtin_mul_overflow (nmemb, size, &total)) return NULL;
+  if (!total) return NULL;
+  if (total >= 1ull << 37) return NULL;
 
-    ptr = mmap_alloc (class_size, &ctx);
+  clear_free_set_of_arena (arena);
 
+  void * ptr, * ctx;
+
+  if (total <= 2048) {
+    ptr = small_calloc (get_class (total), &ctx, &arena->small_class_arena);
+    if (ctx == NULL) return NULL;
+    stat_alloc (arena, total, get_class (total));
+    PROFILE_ALLOC (arena, ptr, total, get_class (total));
+    return ptr;
   }
 
+  uint64_t class_size = get_class (total + sizeof (struct malloc_header));
+  if (class_size >= 1ull << 37) return NULL;
+
+  uint32_t clean;
+  ptr = alloc_by_class (class_size, &ctx, arena, &clean);
   if (ctx == NULL) return NULL;
 
-  /* Find k such that (ptr + k) mod alignment = -16 */
-  uintptr_t ptr_int = (uintptr_t) ptr;
-  uintptr_t ptr_mod = (ptr_int & ((1 << alignment_log) - 1));
-  /* Since ptr_int is a multiple of 16,
-     we have ptr_mod <= alignment - 16
-   */
-  ptr_int += (alignment - 16 - ptr_mod);
-  ptr = (void *) ptr_int;
+  ptr = (void *) (((uintptr_t) ptr) + sizeof (struct malloc_header));
+  if (!clean) memset (ptr, 0, total);
+  write_header (ptr, ctx, class_size, arena);
+  stat_alloc (arena, total, class_size);
+  PROFILE_ALLOC (arena, ptr, total, class_size);
+  return ptr;
+}
+
+void * calloc_with_arena (size_t nmemb, size_t size, struct malloc_arena_t * arena) {
+  return calloc_internal (nmemb, size, arena PROFILE_CALLER);
+}
+
+/* realloc_in_place
+   Resize an allocation without copying its contents, whenever possible:
+   - A small-class slot is kept if the new size still fits in its size class;
+   - A run of buddy pages is shrunk by returning its last pages, or grown by taking the available pages after it;
+   - An mmap region is resized with mremap, which never copies the contents.
+   Only the arena that made an allocation may modify its buddy blocks,
+   so a buddy block allocated by another thread is only kept if it still fits.
+   Returns the allocation, which mremap may have moved, and outputs its size class; returns NULL otherwise.
+   Always outputs the number of bytes that can be accessed from ptr.
+ */
+static void * realloc_in_place (void * ptr, size_t size, struct malloc_arena_t * arena, uint64_t * old_size_ptr, uint64_t * class_size_ptr) {
+  size_t native_n;
+  struct malloc_arena_t * native_arena;
+
+  if (IS_SMALL_SLOT (ptr)) {
+
+    void * ctx;
+    size_t len;
+    small_lookup (ptr, &ctx, &len);
+    *old_size_ptr = len;
+    *class_size_ptr = len;
+    /* Do not keep a slot that is more than twice as large as needed */
+    if (size <= len && (len == 32 || size > len / 2)) return ptr;
+
+  } else if (IS_PAGE_ALIGNED (ptr) && lookup_native (ptr, &native_n, &native_arena) != NULL) {
+
+    /* Keep a native run if it still fits, so that it stays aligned */
+    *old_size_ptr = native_n << 12;
+    *class_size_ptr = native_n << 12;
+    if (size <= *old_size_ptr) return ptr;
 
-  uintptr_t x, y;
-  if (class_size > 262144) {
-    x = ((uintptr_t) class_size) | 0x07;
-    y = ((uintptr_t) ctx) | 0x07;
-  } else if (class_size >= 1024) {
-    uint32_t s = __builtin_ctzll (class_size) + 7;
-    x = ((uintptr_t) arena) | (s & 0x07);
-    y = ((uintptr_t) ctx) | ((s >> 3) & 0x07);
   } else {
-    uint32_t s = class_size / 32;
-    x = ((uintptr_t) arena) | (s & 0x07);
-    y = ((uintptr_t) ctx) | ((s >> 3) & 0x07);
+
+    struct malloc_header * hdr = MALLOC_HEADER (ptr);
+    uint64_t type = __atomic_load_8 (&hdr->type, __ATOMIC_SEQ_CST);
+    struct malloc_arena_t * alloc_arena = (struct malloc_arena_t *) __atomic_load_8 ((uintptr_t *) &hdr->arena, __ATOMIC_SEQ_CST);
+    void * ctx = hdr->ctx;
+    uint64_t len = hdr->len;
+    *class_size_ptr = len;
+
+    if (type == MALLOC_TYPE_SMALL) {
+
+      *old_size_ptr = ((uintptr_t) small_slot_end (ptr, ctx, len)) - ((uintptr_t) ptr);
+      if (size <= *old_size_ptr) return ptr;
+
+    } else if (type == MALLOC_TYPE_BUDDY) {
+
+      void * start = BUDDY_RUN_START (ptr, len);
+      uint64_t offset = ((uintptr_t) ptr) - ((uintptr_t) start);
+      *old_size_ptr = len - offset;
+      uint64_t class_size = get_class (size + offset);
+
+      if (alloc_arena != arena) {
+	if (size <= *old_size_ptr) return ptr;
+      } else if (class_size > 2048 && class_size <= 262144) {
+	uint64_t old_n = len >> 12;
+	uint64_t new_n = class_size >> 12;
+
+	if (new_n < old_n) {
+	  buddy_shrink_pages (start, ctx, old_n, new_n, &arena->buddy_arena);
+	  hdr->len = class_size;
+	  *class_size_ptr = class_size;
+	  return ptr;
+	}
+
+	if (new_n == old_n || buddy_grow_pages (start, ctx, old_n, new_n, &arena->buddy_arena)) {
+	  hdr->len = class_size;
+	  *class_size_ptr = class_size;
+	  return ptr;
+	}
+      }
+
+    } else {
+
+      uint64_t offset = ((uintptr_t) ptr) - ((uintptr_t) ctx);
+      *old_size_ptr = len - offset;
+      uint64_t class_size = get_class (size + offset);
+
+      if (class_size > 262144) {
+	void * new_ctx;
+	void * new_region = mmap_cache_realloc (ctx, len, class_size, &new_ctx, &alloc_arena->mmap_arena);
+	if (new_region != NULL) {
+	  ptr = (void *) (((uintptr_t) new_region) + offset);
+	  hdr = MALLOC_HEADER (ptr);
+	  hdr->ctx = new_ctx;
+	  hdr->len = class_size;
+	  *class_size_ptr = class_size;
+	  return ptr;
+	}
+      }
+
+    }
+
   }
 
-  __atomic_store_8 ((uintptr_t *) ptr, y, __ATOMIC_SEQ_CST);
-  __atomic_store_8 ((uintptr_t *) (((uintptr_t) ptr) + 8), x, __ATOMIC_SEQ_CST);
-  return (void *) (((uintptr_t) ptr) + 16);
+  return NULL;
 }
 
-static void free_with_arena_internal (void * ptr, uintptr_t x, uintptr_t y, struct malloc_arena_t * arena) {
-  uint32_t s = (x & 0x07) | ((y & 0x07) << 3);
+/* realloc_internal
+   Resize an allocation, in place whenever possible (see realloc_in_place).
+   Otherwise, we fall back to allocating a new region and copying.
+ */
+static void * realloc_internal (void * ptr, size_t size, struct malloc_arena_t * arena PROFILE_CALLER_PARAMS) {
+  if (ptr == NULL) return malloc_internal (size, arena PROFILE_CALLER_ARGS);
+  if (!size) {
+    free_with_arena (ptr, arena);
+    return NULL;
+  }
+  if (size >= 1ull << 37) return NULL;
+
+  clear_free_set_of_arena (arena);
+
+#if LIBC_MALLOC_PROFILE
+  /* Looked up before the resize, since mremap may move the memory and its header */
+  struct malloc_arena_t * owner = profile_owner (ptr);
+#endif
+
+  /* Number of bytes that can be accessed from ptr */
+  uint64_t old_size, class_size;
+  void * new_ptr = realloc_in_place (ptr, size, arena, &old_size, &class_size);
+  if (new_ptr != NULL) {
+    /* The old allocation is only untracked once it has been resized; a failed realloc keeps its record */
+    PROFILE_FREE (owner, ptr);
+    PROFILE_ALLOC (arena, new_ptr, size, class_size);
+    return new_ptr;
+  }
+
+  new_ptr = malloc_internal (size, arena PROFILE_CALLER_ARGS);
+  if (new_ptr == NULL) return NULL;
+  memcpy (new_ptr, ptr, size < old_size ? size : old_size);
+  /* Drops the record of the old allocation */
+  free_with_arena (ptr, arena);
+  return new_ptr;
+}
+
+void * realloc_with_arena (void * ptr, size_t size, struct malloc_arena_t * arena) {
+  return realloc_internal (ptr, size, arena PROFILE_CALLER);
+}
 
-  if (s == 63) {
-    uint64_t size = x & ~0x07;
-    void * ctx = (void *)(y & ~0x07);
-    mmap_free (ptr, ctx, size);
+/* free_with_arena_internal
+   Free an allocation made by `arena`.
+   When this function is called, `arena` should be the same arena that made this allocation,
+   unless it is an mmap allocation.
+ */
+static void free_with_arena_internal (void * ptr, struct malloc_arena_t * arena) {
+  if (IS_POOL_ELEMENT (ptr)) {
+    small_pool_free (ptr, small_pool_lookup (ptr), &arena->small_class_arena);
+    return;
+  }
+
+  if (IS_SMALL_SLOT (ptr)) {
+    PROFILE_FREE (arena, ptr);
+    void * ctx;
+    size_t len;
+    small_lookup (ptr, &ctx, &len);
+    small_free (ptr, ctx, len, &arena->small_class_arena);
     return;
   }
 
-  /* When this internal function is called, `arena` should be the same arena that made this allocation. */
-  void * ctx = (void *)(y & ~0x07);
-
-  if (s <= 16) {
-    small_free (ptr, ctx, s * 32, arena);
-  } else if (s == 17) {
-    small_free (ptr, ctx, 1024, arena);
-  } else if (s == 18) {
-    small_free (ptr, ctx, 2048, arena);
-  } else if (s == 19) {
-    buddy_free_0 (ptr, ctx, arena);
-  } else if (s == 20) {
-    buddy_free_1 (ptr, ctx, arena);
-  } else if (s == 21) {
-    buddy_free_2 (ptr, ctx, arena);
-  } else if (s == 22) {
-    buddy_free_3 (ptr, ctx, arena);
-  } else if (s == 23) {
-    buddy_free_4 (ptr, ctx, arena);
-  } else if (s == 24) {
-    buddy_free_5 (ptr, ctx, arena);
-  } else if (s == 25) {
-    buddy_free_6 (ptr, ctx, arena);
+  if (IS_PAGE_ALIGNED (ptr)) {
+    size_t n;
+    struct malloc_arena_t * alloc_arena;
+    void * ctx = lookup_native (ptr, &n, &alloc_arena);
+    if (ctx != NULL) {
+      PROFILE_FREE (arena, ptr);
+      buddy_free_native (ptr, ctx, n, &arena->buddy_arena);
+      return;
+    }
+  }
+
+  struct malloc_header * hdr = MALLOC_HEADER (ptr);
+  void * ctx = hdr->ctx;
+  uint64_t len = hdr->len;
+
+  if (hdr->type == MALLOC_TYPE_MMAP) {
+    struct malloc_arena_t * alloc_arena = (struct malloc_arena_t *) __atomic_load_8 ((uintptr_t *) &hdr->arena, __ATOMIC_SEQ_CST);
+    PROFILE_FREE (alloc_arena, ptr);
+    mmap_cache_free (ptr, ctx, len, &arena->mmap_arena, &alloc_arena->mmap_arena);
+  } else if (hdr->type == MALLOC_TYPE_SMALL) {
+    PROFILE_FREE (arena, ptr);
+    small_free (ptr, ctx, len, &arena->small_class_arena);
+  } else {
+    PROFILE_FREE (arena, ptr);
+    buddy_free_pages (BUDDY_RUN_START (ptr, len), ctx, len >> 12, &arena->buddy_arena);
   }
 }
 
-static void insert_into_free_set_of_arena (void * elem, struct malloc_arena_t * arena) {
-  void * curr_tail;
-  _Bool fail;
+void clear_free_set_of_arena (struct malloc_arena_t * arena) {
+  struct mpsc_node * node;
+  while ((node = mpsc_queue_pop (&arena->free_set)) != NULL) free_with_arena_internal (node, arena);
 
-  __atomic_store_8 ((void **) elem, (uintptr_t) NULL, __ATOMIC_SEQ_CST);
+  /* Every allocation and free passes here, so freed pages are purged even if the thread stops freeing */
+  buddy_decay_tick (&arena->buddy_arena);
+}
 
-  /* Swap tail with elem, and store original tail into curr_tail */
-  __asm__ volatile (
-    "1:\n\t"
-    "ldxr %[load_reg], [%[tail_ptr_reg]]\n\t"
-    "stxr %w[fail_reg], %[new_val_reg], [%[tail_ptr_reg]]\n\t"
-    "cbnz %w[fail_reg], 1b\n\t"
-    "dmb ish"
-  : [load_reg] "=&r" (curr_tail), [fail_reg] "=&r" (fail)
-  : [tail_ptr_reg] "r" (&arena->free_set_tail), [new_val_reg] "r" (elem)
-  : "memory"
-  );
+/* flush_remote_bucket
+   Hand the regions buffered in a remote-free bucket to their owner, with a single swap on its free set.
+ */
+static void flush_remote_bucket (struct malloc_remote_bucket * bucket) {
+  if (bucket->num == 0) return;
+  mpsc_queue_push_list (&bucket->owner->free_set, bucket->first, bucket->last);
+  bucket->owner = NULL;
+  bucket->first = NULL;
+  bucket->last = NULL;
+  bucket->num = 0;
+}
 
-  __atomic_store_8 ((void **) curr_tail, (uintptr_t) elem, __ATOMIC_SEQ_CST);
+void flush_remote_frees_of_arena (struct malloc_arena_t * arena) {
+  for (uint32_t i = 0; i < LIBC_REMOTE_FREE_BUCKETS; ++i) flush_remote_bucket (&arena->remote_buckets[i]);
 }
 
-void clear_free_set_of_arena (struct malloc_arena_t * arena) {
-  void * curr_head = arena->free_set_head, * next;
-
-  while (true) {
-    next = (void *) __atomic_load_8 ((void **) curr_head, __ATOMIC_SEQ_CST);
-    if (next != NULL && curr_head != (void *) &arena->free_set_placeholder) {
-      /* If the current head is not the placeholder, free it */
-      /* curr_head is an allocation previously made by this thread.
-	 Therefore, the following to loads do not need to be atomic.
-       */
-      uintptr_t x = *(uintptr_t *)(((uintptr_t) curr_head) - 8);
-      uintptr_t y = *(uintptr_t *)(((uintptr_t) curr_head) - 16);
-      free_with_arena_internal (curr_head, x, y, arena);
-      curr_head = next;
-    } else {
-      /* If the last element is the placeholder, we have reached the end */
-      if (curr_head == (void *) &arena->free_set_placeholder) break;
-      /* Otherwise, the placeholder is not in the queue, we insert it to take out the final element */
-      insert_into_free_set_of_arena (&arena->free_set_placeholder, arena);
-    }
+/* remote_free
+   Buffer a region allocated by alloc_arena, to be handed to alloc_arena later.
+ */
+static void remote_free (void * ptr, struct malloc_arena_t * alloc_arena, struct malloc_arena_t * arena) {
+  struct malloc_remote_bucket * bucket = &arena->remote_buckets[(((uintptr_t) alloc_arena) / LIBC_CACHE_LINE_LEN) % LIBC_REMOTE_FREE_BUCKETS];
+
+  if (bucket->owner != alloc_arena) {
+    flush_remote_bucket (bucket);
+    bucket->owner = alloc_arena;
+  }
+
+  /* The regions are not visible to the owner until the bucket is flushed, so plain stores suffice */
+  if (bucket->num == 0) bucket->first = ptr;
+  else *(void **) bucket->last = ptr;
+  bucket->last = ptr;
+  bucket->num++;
+
+  if (bucket->num >= LIBC_REMOTE_FREE_BATCH) flush_remote_bucket (bucket);
+}
+
+/* free_without_clear
+   Free ptr, either directly or by handing it to the owner arena,
+   without draining the free set of `arena`.
+ */
+static void free_without_clear (void * ptr, struct malloc_arena_t * arena) {
+  struct malloc_arena_t * alloc_arena;
+
+  size_t native_n;
+
+  if (IS_SMALL_SLOT (ptr)) {
+    alloc_arena = get_small_slot_arena (ptr);
+  } else if (IS_PAGE_ALIGNED (ptr) && lookup_native (ptr, &native_n, &alloc_arena) != NULL) {
+    /* alloc_arena is found from the chunk map */
+  } else {
+    /* ptr need not be previously allocated by this thread.
+       Therefore, the following two loads need to be atomic.
+     */
+    struct malloc_header * hdr = MALLOC_HEADER (ptr);
+    uint64_t type = __atomic_load_8 (&hdr->type, __ATOMIC_SEQ_CST);
+    alloc_arena = (struct malloc_arena_t *) __atomic_load_8 ((uintptr_t *) &hdr->arena, __ATOMIC_SEQ_CST);
+
+    /* If allocation is made by mmap, free directly, into the cache of this arena */
+    if (type == MALLOC_TYPE_MMAP) alloc_arena = arena;
+  }
+
+  if (alloc_arena == arena) {
+    free_with_arena_internal (ptr, arena);
+  } else {
+    /* Cross-thread deallocation */
+    remote_free (ptr, alloc_arena, arena);
   }
 }
 
 void free_with_arena (void * ptr, struct malloc_arena_t * arena) {
   if (ptr == NULL) return;
+  if (LIBC_MALLOC_PERCPU_CACHE && IS_SMALL_SLOT (ptr)) {
+    /* The slot may be taken from the per-CPU cache by another thread right away, so drop its record first */
+    PROFILE_FREE (get_small_slot_arena (ptr), ptr);
+    if (!PERCPU_FREE (ptr)) free_without_clear (ptr, arena);
+  } else {
+    free_without_clear (ptr, arena);
+  }
+  clear_free_set_of_arena (arena);
+}
 
-  /* ptr need not be previously allocated by this thread.
-     Therefore, the following two loads need to be atomic.
-   */
-  uintptr_t x = __atomic_load_8 ((uintptr_t *)(((uintptr_t) ptr) - 8), __ATOMIC_SEQ_CST);
-  uintptr_t y = __atomic_load_8 ((uintptr_t *)(((uintptr_t) ptr) - 16), __ATOMIC_SEQ_CST);
-  uint32_t s = (x & 0x07) | ((y & 0x07) << 3);
-
-  /* If allocation is made by mmap, free directly */
-  if (s == 63) {
-    free_with_arena_internal (ptr, x, y, arena);
-    clear_free_set_of_arena (arena);
-    return;
+static size_t malloc_bulk_internal (size_t size, size_t n, void ** out_ptrs, struct malloc_arena_t * arena PROFILE_CALLER_PARAMS) {
+  if (!size) return 0;
+  if (size >= 1ull << 37) return 0;
+
+  /* Clear pending regions to be freed, once for the whole batch */
+  clear_free_set_of_arena (arena);
+
+  if (size <= 2048) {
+    size_t num = small_alloc_bulk (get_class (size), n, out_ptrs, &arena->small_class_arena);
+    stat_alloc (arena, size * num, get_class (size) * num);
+    for (size_t i = 0; i < num; ++i) PROFILE_ALLOC (arena, out_ptrs[i], size, get_class (size));
+    return num;
   }
 
-  void * alloc_arena = (void *)(x & ~0x07);
+  uint64_t class_size = get_class (size + sizeof (struct malloc_header));
+  if (class_size >= 1ull << 37) return 0;
 
-  if (alloc_arena == arena) {
-    free_with_arena_internal (ptr, x, y, arena);
+  size_t i;
+  for (i = 0; i < n; ++i) {
+    void * ctx;
+    void * ptr = alloc_by_class (class_size, &ctx, arena, NULL);
+    if (ctx == NULL) break;
+
+    ptr = (void *) (((uintptr_t) ptr) + sizeof (struct malloc_header));
+    write_header (ptr, ctx, class_size, arena);
+    PROFILE_ALLOC (arena, ptr, size, class_size);
+    out_ptrs[i] = ptr;
+  }
+
+  stat_alloc (arena, size * i, class_size * i);
+  return i;
+}
+
+size_t malloc_bulk_with_arena (size_t size, size_t n, void ** out_ptrs, struct malloc_arena_t * arena) {
+  return malloc_bulk_internal (size, n, out_ptrs, arena PROFILE_CALLER);
+}
+
+void free_bulk_with_arena (void ** ptrs, size_t n, struct malloc_arena_t * arena) {
+  size_t i = 0;
+
+  while (i < n) {
+    /* Small-class slots of this arena are freed in runs, so that the block lists are updated once per block */
+    size_t j = i;
+    while (j < n && ptrs[j] != NULL && IS_SMALL_SLOT (ptrs[j]) && get_small_slot_arena (ptrs[j]) == arena) ++j;
+
+    if (j > i) {
+      for (size_t k = i; k < j; ++k) PROFILE_FREE (arena, ptrs[k]);
+      small_free_bulk (ptrs + i, j - i, &arena->small_class_arena);
+      i = j;
+      continue;
+    }
+
+    if (ptrs[i] != NULL) free_without_clear (ptrs[i], arena);
+    ++i;
+  }
+
+  clear_free_set_of_arena (arena);
+}
+
+/* malloc_trim_with_arena
+   Complete pending frees, then release cached small slots, empty small-class blocks,
+   cached mmap regions, empty buddy chunks beyond keep_bytes, and free buddy pages.
+ */
+size_t malloc_trim_with_arena (size_t keep_bytes, struct malloc_arena_t * arena) {
+  flush_remote_frees_of_arena (arena);
+  clear_free_set_of_arena (arena);
+
+  small_trim (&arena->small_class_arena);
+  size_t released = mmap_cache_flush (&arena->mmap_arena);
+  released += buddy_trim (&arena->buddy_arena, keep_bytes);
+  return released;
+}
+
+void malloc_stats_with_arena (struct malloc_arena_t * arena, struct malloc_stats * stats) {
+  memset (stats, 0, sizeof (struct malloc_stats));
+  small_stats (&arena->small_class_arena, stats);
+  buddy_stats (&arena->buddy_arena, stats);
+  mmap_stats (&arena->mmap_arena, stats);
+
+#if LIBC_MALLOC_STATS
+  stats->requested_bytes = arena->stat_requested_bytes;
+  stats->reserved_bytes = arena->stat_reserved_bytes;
+#endif
+
+  /* Only the owner takes elements out of the free set, so we can walk it up to the last element */
+  struct mpsc_node * curr = arena->free_set.head;
+  while (curr != NULL) {
+    if (curr != &arena->free_set.placeholder) stats->pending_remote_frees++;
+    curr = __atomic_load_n (&curr->next, __ATOMIC_SEQ_CST);
+  }
+
+  for (uint32_t i = 0; i < LIBC_REMOTE_FREE_BUCKETS; ++i) stats->buffered_remote_frees += arena->remote_buckets[i].num;
+}
+
+struct pool_t * pool_create_with_arena (size_t obj_size, size_t align, struct malloc_arena_t * arena) {
+  struct pool_t * pool = malloc_with_arena (sizeof (struct pool_t), arena);
+  if (pool == NULL) return NULL;
+
+  if (!small_pool_init (pool, obj_size, align)) {
+    free_with_arena (pool, arena);
+    return NULL;
+  }
+  pool->arena = arena;
+  return pool;
+}
+
+void * pool_alloc (struct pool_t * pool) {
+  clear_free_set_of_arena (pool->arena);
+  return small_pool_alloc (pool, &pool->arena->small_class_arena);
+}
+
+void pool_free_with_arena (struct pool_t * pool, void * obj, struct malloc_arena_t * arena) {
+  if (obj == NULL) return;
+
+  if (pool->arena == arena) {
+    small_pool_free (obj, pool, &arena->small_class_arena);
   } else {
-    /* Cross-thread deallocation */
-    insert_into_free_set_of_arena (ptr, alloc_arena);
+    /* Cross-thread deallocation goes straight to the free set of the owner, rather than through a remote-free bucket,
+       so that once pool_free returns, the owner completes it before destroying the pool
+     */
+    mpsc_queue_push (&pool->arena->free_set, (struct mpsc_node *) POOL_ELEMENT (obj));
   }
 
   clear_free_set_of_arena (arena);
 }
 
+void pool_destroy (struct pool_t * pool) {
+  struct malloc_arena_t * arena = pool->arena;
+  clear_free_set_of_arena (arena);
+  small_pool_destroy (pool, &arena->small_class_arena);
+  free_with_arena (pool, arena);
+}
+
+size_t malloc_profile_dump_with_arena (fd_t fd, struct malloc_arena_t * arena) {
+#if LIBC_MALLOC_PROFILE
+  size_t num = 0;
+  for (uint32_t i = 0; i < LIBC_MALLOC_PROFILE_RECORDS; ++i) {
+    /* Other threads may drop records concurrently, so each record is copied under the mutex */
+    struct malloc_profile_record rec;
+    mutex_lock (&arena->profile.lock);
+    rec = arena->profile.records[i];
+    mutex_unlock (&arena->profile.lock);
+    if (rec.ptr == NULL) continue;
+
+    const char * buf = (const char *) &rec;
+    size_t remaining = sizeof (struct malloc_profile_record);
+    while (remaining > 0) {
+      ssize_t written = write (fd, buf, remaining);
+      if (written <= 0) return num;
+      buf += written;
+      remaining -= written;
+    }
+    num++;
+  }
+  return num;
+#else
+  (void) fd;
+  (void) arena;
+  return 0;
+#endif
+}
+
 void * malloc (size_t len) {
-  return malloc_with_arena (len, get_thread_malloc_arena ());
+  return malloc_internal (len, get_thread_malloc_arena () PROFILE_CALLER);
 }
 
 void * aligned_alloc (size_t alignment, size_t size) {
-  return aligned_alloc_with_arena (alignment, size, get_thread_malloc_arena ());
+  return aligned_alloc_internal (alignment, size, get_thread_malloc_arena () PROFILE_CALLER);
+}
+
+void * calloc (size_t nmemb, size_t size) {
+  return calloc_internal (nmemb, size, get_thread_malloc_arena () PROFILE_CALLER);
+}
+
+void * realloc (void * ptr, size_t size) {
+  return realloc_internal (ptr, size, get_thread_malloc_arena () PROFILE_CALLER);
 }
 
 void free (void * ptr) {
   free_with_arena (ptr, get_thread_malloc_arena ());
 }
 
+size_t malloc_bulk (size_t size, size_t n, void ** out_ptrs) {
+  return malloc_bulk_internal (size, n, out_ptrs, get_thread_malloc_arena () PROFILE_CALLER);
+}
+
+void free_bulk (void ** ptrs, size_t n) {
+  free_bulk_with_arena (ptrs, n, get_thread_malloc_arena ());
+}
+
+size_t malloc_trim (size_t keep_bytes) {
+  return malloc_trim_with_arena (keep_bytes, get_thread_malloc_arena ());
+}
+
+size_t malloc_profile_dump (fd_t fd) {
+  return malloc_profile_dump_with_arena (fd, get_thread_malloc_arena ());
+}
+
+struct pool_t * pool_create (size_t obj_size, size_t align) {
+  return pool_create_with_arena (obj_size, align, get_thread_malloc_arena ());
+}
+
+void pool_free (struct pool_t * pool, void * obj) {
+  pool_free_with_arena (pool, obj, get_thread_malloc_arena ());
+}
+
 void clear_free_set (void) {
-  clear_free_set_of_arena (get_thread_malloc_arena ());
+  struct malloc_arena_t * arena = get_thread_malloc_arena ();
+  flush_remote_frees_of_arena (arena);
+  clear_free_set_of_arena (arena);
 }
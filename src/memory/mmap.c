@@ -1,5 +1,6 @@
 #include <stdint.h>
 #include <memory.h>
+#include <config.h>
 #include <io.h>
 #include <syscall.h>
 #include <syscall_nr.h>
@@ -12,13 +13,258 @@ int munmap (void * addr, size_t len) {
   return syscall2 ((long) addr, len, __NR_munmap);
 }
 
+void * mremap (void * old_addr, size_t old_len, size_t new_len, int flags, void * new_addr) {
+  return (void *) syscall5 ((long) old_addr, old_len, new_len, flags, (long) new_addr, __NR_mremap);
+}
+
+int madvise (void * addr, size_t len, int advice) {
+  return syscall3 ((long) addr, len, advice, __NR_madvise);
+}
+
+int mprotect (void * addr, size_t len, int prot) {
+  return syscall3 ((long) addr, len, prot, __NR_mprotect);
+}
+
+/* In huge page mode (LIBC_HUGEPAGE_MODE), regions of at least LIBC_HUGEPAGE_SIZE bytes are backed by huge pages.
+   With transparent huge pages, they are aligned to the huge page size and marked with MADV_HUGEPAGE.
+   With explicit huge pages, their length is rounded up to a multiple of the huge page size.
+ */
+
+#if LIBC_HUGEPAGE_MODE == 2
+#define MMAP_REGION_LEN(len) ((len) >= LIBC_HUGEPAGE_SIZE ? (((len) + LIBC_HUGEPAGE_SIZE - 1) & ~ (LIBC_HUGEPAGE_SIZE - 1)) : (((((len) - 1) >> 12) + 1) << 12))
+#else
+#define MMAP_REGION_LEN(len) (((((len) - 1) >> 12) + 1) << 12)
+#endif
+
 void * mmap_alloc (size_t len, void ** ctx_ptr) {
-  len = (((len - 1) >> 12) + 1) << 12;
+  len = MMAP_REGION_LEN (len);
+#if LIBC_HUGEPAGE_MODE == 1
+  if (len >= LIBC_HUGEPAGE_SIZE) {
+    void * region = mmap_alloc_aligned (len, LIBC_HUGEPAGE_SIZE, ctx_ptr);
+    if (region != NULL) madvise (region, len, MADV_HUGEPAGE);
+    return region;
+  }
+#elif LIBC_HUGEPAGE_MODE == 2
+  if (len >= LIBC_HUGEPAGE_SIZE) {
+    void * region = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, 0, 0);
+    if (((intptr_t) region) < 0) return NULL; else { *ctx_ptr = region; return region; }
+  }
+#endif
   void * ptr = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
   if (((intptr_t) ptr) < 0) return NULL; else { *ctx_ptr = ptr; return ptr; }
 }
 
 void mmap_free (__attribute__((unused)) void * ptr, void * ctx, size_t len) {
-  len = (((len - 1) >> 12) + 1) << 12;
+  len = MMAP_REGION_LEN (len);
   munmap (ctx, len);
 }
+
+/* mmap_alloc_aligned
+   Same as mmap_alloc, but the returned region is aligned to `alignment`,
+   which must be a power of two and a multiple of 4096.
+   We over-allocate and return the excess on both ends to the OS,
+   so the region can be freed with mmap_free like any other.
+ */
+void * mmap_alloc_aligned (size_t len, size_t alignment, void ** ctx_ptr) {
+  len = MMAP_REGION_LEN (len);
+  if (alignment <= 4096) return mmap_alloc (len, ctx_ptr);
+#if LIBC_HUGEPAGE_MODE == 2
+  /* Regions of explicit huge pages are aligned to the huge page size */
+  if (len >= LIBC_HUGEPAGE_SIZE && alignment <= LIBC_HUGEPAGE_SIZE) return mmap_alloc (len, ctx_ptr);
+#endif
+
+  size_t map_len = len + alignment - 4096;
+  void * ptr = mmap (NULL, map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
+  if (((intptr_t) ptr) < 0) return NULL;
+
+  uintptr_t start = (uintptr_t) ptr;
+  uintptr_t aligned = (start + alignment - 1) & ~ (alignment - 1);
+  if (aligned != start) munmap (ptr, aligned - start);
+  if (aligned + len != start + map_len) munmap ((void *) (aligned + len), start + map_len - aligned - len);
+
+  *ctx_ptr = (void *) aligned;
+  return (void *) aligned;
+}
+
+/* mmap_remap
+   Resize a region of old_len bytes to new_len bytes (both multiples of 4096) with mremap, moving it if necessary.
+   Returns the new region, or NULL upon failure, in which case the region is untouched.
+   With transparent huge pages, a region of at least LIBC_HUGEPAGE_SIZE bytes must stay aligned to the huge page size,
+   while mremap with MREMAP_MAYMOVE may move it anywhere.
+   Hence it is resized in place if it is aligned, and otherwise moved with MREMAP_FIXED
+   over an aligned destination reserved with mmap_alloc_aligned.
+ */
+static void * mmap_remap (void * region, size_t old_len, size_t new_len) {
+#if LIBC_HUGEPAGE_MODE == 1
+  if (new_len >= LIBC_HUGEPAGE_SIZE) {
+    void * ptr;
+    if ((((uintptr_t) region) & (LIBC_HUGEPAGE_SIZE - 1)) == 0) {
+      ptr = mremap (region, old_len, new_len, 0, NULL);
+      if (((intptr_t) ptr) >= 0) {
+	if (old_len < LIBC_HUGEPAGE_SIZE) madvise (ptr, new_len, MADV_HUGEPAGE);
+	return ptr;
+      }
+    }
+
+    void * dest_ctx;
+    void * dest = mmap_alloc_aligned (new_len, LIBC_HUGEPAGE_SIZE, &dest_ctx);
+    if (dest == NULL) return NULL;
+    ptr = mremap (region, old_len, new_len, MREMAP_MAYMOVE | MREMAP_FIXED, dest);
+    if (((intptr_t) ptr) < 0) {
+      munmap (dest, new_len);
+      return NULL;
+    }
+    madvise (ptr, new_len, MADV_HUGEPAGE);
+    return ptr;
+  }
+#endif
+  void * ptr = mremap (region, old_len, new_len, MREMAP_MAYMOVE, NULL);
+  return ((intptr_t) ptr) < 0 ? NULL : ptr;
+}
+
+/* mmap_realloc
+   Resize a region returned by mmap_alloc to new_len bytes, moving it if necessary.
+   The contents of the region are preserved up to the smaller of the two lengths.
+   Returns the new region and outputs the new context pointer; returns NULL upon failure,
+   in which case the original region is untouched.
+ */
+void * mmap_realloc (void * ctx, size_t old_len, size_t new_len, void ** ctx_ptr) {
+#if LIBC_HUGEPAGE_MODE == 2
+  /* Regions of explicit huge pages cannot be resized reliably */
+  if (old_len >= LIBC_HUGEPAGE_SIZE || new_len >= LIBC_HUGEPAGE_SIZE) return NULL;
+#endif
+  old_len = (((old_len - 1) >> 12) + 1) << 12;
+  new_len = (((new_len - 1) >> 12) + 1) << 12;
+  void * ptr = mmap_remap (ctx, old_len, new_len);
+  if (ptr == NULL) return NULL; else { *ctx_ptr = ptr; return ptr; }
+}
+
+/* Cache of recently freed regions.
+   Each arena keeps up to LIBC_MMAP_CACHE_NUM regions freed by mmap_cache_free, totalling at most LIBC_MMAP_CACHE_BYTES bytes,
+   ordered from the least recently freed.
+   mmap_cache_alloc reuses the cached region whose length is closest to the request (within a factor of two),
+   resizing it with mremap if the lengths differ.
+   When the cache is full, the least recently freed regions are unmapped.
+ */
+
+/* Regions may be freed by other threads, hence the live bytes are updated atomically */
+#if LIBC_MALLOC_STATS
+#define MMAP_STAT_ADD(arena, val) ((void) __atomic_fetch_add (&(arena)->stat_live_bytes, (val), __ATOMIC_RELAXED))
+#else
+#define MMAP_STAT_ADD(arena, val) ((void) 0)
+#endif
+
+/* mmap_cache_take
+   Remove entry idx from the cache, and return its region.
+ */
+static void * mmap_cache_take (struct mmap_arena_t * arena, uint32_t idx, size_t * len_ptr) {
+  void * region = arena->entries[idx].region;
+  *len_ptr = arena->entries[idx].len;
+  arena->bytes -= *len_ptr;
+  arena->num--;
+  for (uint32_t i = idx; i < arena->num; ++i) arena->entries[i] = arena->entries[i + 1];
+  return region;
+}
+
+void * mmap_cache_alloc (size_t len, void ** ctx_ptr, void * arena_vp, uint32_t * clean_ptr) {
+  struct mmap_arena_t * arena = (struct mmap_arena_t *) arena_vp;
+  len = MMAP_REGION_LEN (len);
+
+  uint32_t best = arena->num;
+  size_t best_diff = ~ (size_t) 0;
+  for (uint32_t i = 0; i < arena->num; ++i) {
+    size_t entry_len = arena->entries[i].len;
+    if (entry_len < len / 2 || entry_len / 2 > len) continue;
+    size_t diff = entry_len > len ? entry_len - len : len - entry_len;
+#if LIBC_HUGEPAGE_MODE == 2
+    /* Regions of explicit huge pages cannot be resized */
+    if (diff != 0 && (entry_len >= LIBC_HUGEPAGE_SIZE || len >= LIBC_HUGEPAGE_SIZE)) continue;
+#endif
+    if (diff < best_diff) {
+      best = i;
+      best_diff = diff;
+    }
+  }
+
+  if (best < arena->num) {
+    size_t old_len;
+    void * region = mmap_cache_take (arena, best, &old_len);
+    if (old_len != len) {
+      void * new_region = mmap_remap (region, old_len, len);
+      if (new_region == NULL) {
+	munmap (region, old_len);
+	region = NULL;
+      } else {
+	region = new_region;
+      }
+    }
+    if (region != NULL) {
+      MMAP_STAT_ADD (arena, len);
+      *clean_ptr = 0;
+      *ctx_ptr = region;
+      return region;
+    }
+  }
+
+  *clean_ptr = 1;
+  void * region = mmap_alloc (len, ctx_ptr);
+  if (region != NULL) MMAP_STAT_ADD (arena, len);
+  return region;
+}
+
+void mmap_cache_free (void * ptr, void * ctx, size_t len, void * arena_vp, void * owner_vp) {
+  struct mmap_arena_t * arena = (struct mmap_arena_t *) arena_vp;
+  struct mmap_arena_t * owner = (struct mmap_arena_t *) owner_vp;
+  (void) owner;
+  len = MMAP_REGION_LEN (len);
+  MMAP_STAT_ADD (owner, - (int64_t) len);
+
+  if (len > LIBC_MMAP_CACHE_BYTES) {
+    mmap_free (ptr, ctx, len);
+    return;
+  }
+
+  while (arena->num == LIBC_MMAP_CACHE_NUM || arena->bytes + len > LIBC_MMAP_CACHE_BYTES) {
+    size_t old_len;
+    void * region = mmap_cache_take (arena, 0, &old_len);
+    munmap (region, old_len);
+  }
+
+  arena->entries[arena->num].region = ctx;
+  arena->entries[arena->num].len = len;
+  arena->num++;
+  arena->bytes += len;
+}
+
+void * mmap_cache_realloc (void * ctx, size_t old_len, size_t new_len, void ** ctx_ptr, void * arena_vp) {
+  struct mmap_arena_t * arena = (struct mmap_arena_t *) arena_vp;
+  (void) arena;
+  void * region = mmap_realloc (ctx, old_len, new_len, ctx_ptr);
+  if (region != NULL) MMAP_STAT_ADD (arena, (int64_t) MMAP_REGION_LEN (new_len) - (int64_t) MMAP_REGION_LEN (old_len));
+  return region;
+}
+
+/* mmap_cache_flush
+   Unmap all cached regions.
+   Returns the number of bytes unmapped.
+ */
+size_t mmap_cache_flush (void * arena_vp) {
+  struct mmap_arena_t * arena = (struct mmap_arena_t *) arena_vp;
+  size_t released = arena->bytes;
+
+  while (arena->num != 0) {
+    size_t len;
+    void * region = mmap_cache_take (arena, arena->num - 1, &len);
+    munmap (region, len);
+  }
+
+  return released;
+}
+
+void mmap_stats (void * arena_vp, struct malloc_stats * stats) {
+  struct mmap_arena_t * arena = (struct mmap_arena_t *) arena_vp;
+  stats->mmap_cached_bytes = arena->bytes;
+#if LIBC_MALLOC_STATS
+  stats->mmap_live_bytes = arena->stat_live_bytes;
+#endif
+}
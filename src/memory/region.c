@@ -0,0 +1,116 @@
+#include <stdint.h>
+#include <memory.h>
+#include <tls.h>
+#include <config.h>
+
+/* The region allocator hands out memory by bumping a pointer through a list of chunks.
+   Chunks of 64 pages are taken from buddy-alloc of the owning arena;
+   allocations that do not fit in such a chunk get a chunk of their own from mmap-alloc.
+   Each chunk starts with a struct region_chunk, linking it to the chunk allocated before it.
+
+   There is no per-object metadata, and objects are never freed individually.
+   A mark records the current chunk and the bump pointer,
+   and resetting to a mark releases every chunk allocated after it, regardless of the number of objects.
+ */
+
+struct region_chunk {
+  struct region_chunk * prev;
+  void * ctx;
+  size_t len;
+  uint64_t reserved;
+};
+
+_Static_assert (sizeof (struct region_chunk) == 32, "struct region_chunk is not 32 bytes");
+
+#define REGION_CHUNK_SIZE 262144
+
+static inline struct malloc_arena_t * get_thread_malloc_arena (void) {
+  return ((struct tls_struct *) get_thread_pointer ()) -> malloc_arena;
+}
+
+void region_init_with_arena (struct region_t * region, struct malloc_arena_t * arena) {
+  region->arena = arena;
+  region->chunk = NULL;
+  region->cursor = 0;
+  region->limit = 0;
+}
+
+void region_init (struct region_t * region) {
+  region_init_with_arena (region, get_thread_malloc_arena ());
+}
+
+/* region_new_chunk
+   Allocate a chunk with room for size bytes aligned to alignment, and make it the current chunk.
+   Returns 0 upon failure.
+ */
+static uint32_t region_new_chunk (struct region_t * region, size_t size, size_t alignment) {
+  uint64_t need = sizeof (struct region_chunk) + size + alignment - 1;
+  struct region_chunk * chunk;
+  void * ctx;
+
+  if (need <= REGION_CHUNK_SIZE) {
+    chunk = buddy_alloc_6 (&ctx, &region->arena->buddy_arena);
+    if (chunk == NULL) return 0;
+    chunk->len = REGION_CHUNK_SIZE;
+  } else {
+    uint64_t len = (need + 4095) & ~ 4095ull;
+    chunk = mmap_alloc (len, &ctx);
+    if (chunk == NULL) return 0;
+    chunk->len = len;
+  }
+
+  chunk->ctx = ctx;
+  chunk->prev = region->chunk;
+  region->chunk = chunk;
+  region->cursor = ((uintptr_t) chunk) + sizeof (struct region_chunk);
+  region->limit = ((uintptr_t) chunk) + chunk->len;
+  return 1;
+}
+
+/* region_free_chunk
+   Return a chunk to the allocator it was taken from.
+ */
+static void region_free_chunk (struct region_chunk * chunk, struct malloc_arena_t * arena) {
+  if (chunk->len == REGION_CHUNK_SIZE) buddy_free_6 (chunk, chunk->ctx, &arena->buddy_arena);
+  else mmap_free (chunk, chunk->ctx, chunk->len);
+}
+
+void * region_alloc (struct region_t * region, size_t size, size_t alignment) {
+  if (!size) return NULL;
+  if (size >= 1ull << 37) return NULL;
+  if (alignment < 16) alignment = 16;
+  if (alignment & (alignment - 1)) return NULL;
+  if (alignment > 4096) return NULL;
+
+  uintptr_t ptr = (region->cursor + alignment - 1) & ~ ((uintptr_t) alignment - 1);
+  if (region->chunk == NULL || ptr + size > region->limit) {
+    if (!region_new_chunk (region, size, alignment)) return NULL;
+    ptr = (region->cursor + alignment - 1) & ~ ((uintptr_t) alignment - 1);
+  }
+
+  region->cursor = ptr + size;
+  return (void *) ptr;
+}
+
+struct region_mark region_mark (struct region_t * region) {
+  struct region_mark mark;
+  mark.chunk = region->chunk;
+  mark.cursor = region->cursor;
+  return mark;
+}
+
+void region_reset_to_mark (struct region_t * region, struct region_mark mark) {
+  while (region->chunk != mark.chunk) {
+    struct region_chunk * chunk = region->chunk;
+    region->chunk = chunk->prev;
+    region_free_chunk (chunk, region->arena);
+  }
+
+  region->cursor = mark.cursor;
+  region->limit = mark.chunk == NULL ? 0 : ((uintptr_t) mark.chunk) + mark.chunk->len;
+}
+
+void region_destroy (struct region_t * region) {
+  struct region_mark empty = { NULL, 0 };
+  region_reset_to_mark (region, empty);
+}
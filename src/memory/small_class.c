@@ -1,132 +1,643 @@
 #include <stdint.h>
+#include <string.h>
 #include <memory.h>
+#include <tls.h>
+#include <rseq.h>
+#include <config.h>
 
 /* The small-class allocator manages small allocations (smaller than 2048 bytes).
    We request blocks of size 65536 (16 pages) from the buddy allocator, and divide them into small slots in multiples of 32 bytes.
-   Small classes are 32, 64, 96, ..., 512, 1024, 2048
+   Small classes are 32, 64, 96, ..., 512, followed by four classes between consecutive powers of two:
+   640, 768, 896, 1024, 1280, 1536, 1792, 2048.
+
+   Since buddy chunks are aligned to their own size, every block is aligned to 65536 bytes.
+   Hence the block containing a slot can be found by masking the slot address,
+   and the block header records the size class and the owning arena.
+   This allows malloc() to hand out small-class slots without any per-allocation metadata.
+
+   The header of each block has size 16 mod 32, and each slot is a multiple of 32 bytes.
+   Therefore the address of every slot is 16 mod 32.
+   malloc() relies on this to tell small-class slots apart from other allocations.
+
+   Slots are always allocated from the lowest available index.
+   Therefore the slots that have ever been handed out form a prefix of the block, and fresh_idx records its end.
+   If the block was filled with zeroes when it was obtained from the buddy allocator,
+   slots at or above fresh_idx are still zero, and calloc() need not clear them.
+   Otherwise, fresh_idx is set to the number of slots in the block.
+
+   In front of the bitmaps, each arena keeps a LIFO cache of recently freed slots for each class,
+   holding at most LIBC_SMALL_CACHE_NUM slots.
+   Cached slots are still marked as allocated in the bitmap of their block,
+   and are linked through their first 8 bytes.
+   small_alloc pops from the cache and small_free pushes to it,
+   only falling back to the bitmap when the cache is empty or full.
+   Cached slots have been used before, so calloc() must clear them.
+   With per-CPU caches (LIBC_MALLOC_PERCPU_CACHE), small_free does not cache slots in the arena,
+   so that the memory held in caches stays bounded by the number of CPUs.
  */
 
 struct small_class_block {
   void *buddy_ctx;
   struct small_class_block *prev_avail_block, *next_avail_block;
+  struct small_class_arena_t *arena;
+  uint64_t class_size;
   uint64_t bitmap[32];
-  uint64_t avail_num;
+  uint32_t avail_num;
+  uint32_t fresh_idx;
   char block[];
 };
 
+#define CLASS_BLOCK_SIZE 65536
 #define CLASS_BLOCK_HEADER_SIZE (offsetof (struct small_class_block, block))
-_Static_assert (CLASS_BLOCK_HEADER_SIZE % 16 == 0, "CLASS_BLOCK_HEADER_SIZE is not multiple of 16");
+_Static_assert (CLASS_BLOCK_HEADER_SIZE % 32 == 16, "CLASS_BLOCK_HEADER_SIZE is not 16 mod 32");
+
+#if LIBC_MALLOC_STATS
+#define SMALL_STAT_ADD(field, idx, val) ((field)[idx] += (val))
+#else
+#define SMALL_STAT_ADD(field, idx, val) ((void) 0)
+#endif
 
 #define SMALL_CLASS_IDX_SLOT(block_, idx, size) ((void *) ((&(block_)->block[0]) + (idx) * (size)))
 #define SMALL_CLASS_SLOT_IDX(block_, slot, size) ((((uintptr_t) (slot)) - ((uintptr_t) (&(block_)->block[0]))) / (size))
 
-/* allocate_class_block
-   Allocate new class block using buddy allocator.
-   size must be 32, 64, 96, ..., 512, or 1024, 2048.
-   The new block is added to the corresponding list.
-   Upon failure, the corresponding list is unmodified.
+/* get_class_idx
+   Returns the index of size class len.
+   Classes up to 512 are indexed 0 to 15, and the classes (2^k, 2^(k+1)] for k = 9, 10 are split into four each.
  */
-static void allocate_class_block (uint64_t size, struct small_class_arena_t * arena) {
+static inline uint32_t get_class_idx (uint64_t len) {
+  if (len <= 512) return len / 32 - 1;
+  uint32_t k = 63 - __builtin_clzll (len - 1);
+  return 16 + (k - 9) * 4 + ((len - (1ull << k)) >> (k - 2)) - 1;
+}
+
+/* get_avail_list
+   Returns the list of blocks with available slots for size class len.
+ */
+static inline struct small_class_block ** get_avail_list (uint64_t len, struct small_class_arena_t * arena) {
+  return &(arena->small_class_avail_lists[get_class_idx (len)]);
+}
+
+/* allocate_block
+   Allocate a new block using buddy allocator, holding avail_num slots of the given size.
+   The new block is added to list_head, and returned.
+   Upon failure, returns NULL and the list is unmodified.
+ */
+static struct small_class_block * allocate_block (uint64_t size, uint32_t avail_num, struct small_class_block ** list_head, struct small_class_arena_t * arena) {
   struct small_class_block * ptr;
   void * buddy_ctx;
 
-  struct small_class_block ** list_head;
-  if (size <= 512) {
-    uint32_t cls_idx = size / 32 - 1;
-    list_head = &(arena->small_class_avail_lists[cls_idx]);
-  } else if (size == 1024) {
-    list_head = &arena->class1024_avail_list;
-  } else {
-    list_head = &arena->class2048_avail_list;
-  }
-
   ptr = buddy_alloc_4 (&buddy_ctx, arena->buddy_arena);
-  if (ptr == NULL) return;
+  if (ptr == NULL) return NULL;
+  uint32_t clean = buddy_is_clean (ptr, buddy_ctx, CLASS_BLOCK_SIZE);
   ptr->buddy_ctx = buddy_ctx;
   ptr->prev_avail_block = NULL;
+  ptr->arena = arena;
+  ptr->class_size = size;
 
   ptr->next_avail_block = *list_head;
   if (*list_head != NULL) (*list_head)->prev_avail_block = ptr;
   *list_head = ptr;
 
-  uint32_t avail_num = (65536 - CLASS_BLOCK_HEADER_SIZE) / size;
   ptr->avail_num = avail_num;
+  ptr->fresh_idx = clean ? 0 : avail_num;
+  /* The block may be recycled, so every word of the bitmap must be written */
+  for (uint32_t i = 0; i < 32; ++i) ptr->bitmap[i] = 0;
   for (uint32_t i = 0; i < avail_num / 64; ++i) ptr->bitmap[i] = ~ 0ull;
   uint32_t avail_num_rem = avail_num % 64;
-  ptr->bitmap[avail_num / 64] = (1ull << avail_num_rem) - 1;
+  if (avail_num_rem) ptr->bitmap[avail_num / 64] = (1ull << avail_num_rem) - 1;
+  return ptr;
 }
 
-void * small_alloc (size_t len, void ** ctx_ptr, void * arena_vp) {
-  struct small_class_block ** out_class_block = (struct small_class_block **) ctx_ptr;
-  struct small_class_arena_t * arena = (struct small_class_arena_t *) arena_vp;
-
-  struct small_class_block ** list_head;
-  if (len <= 512) {
-    uint32_t cls_idx = len / 32 - 1;
-    list_head = &(arena->small_class_avail_lists[cls_idx]);
-  } else if (len == 1024) {
-    list_head = &arena->class1024_avail_list;
-  } else {
-    list_head = &arena->class2048_avail_list;
-  }
-
-  if (*list_head == NULL) allocate_class_block (len, arena);
-  if (*list_head == NULL) {
-    *out_class_block = NULL;
-    return NULL;
-  }
+/* allocate_class_block
+   Allocate new class block using buddy allocator.
+   size must be one of the small classes.
+   The new block is added to the corresponding list.
+   Upon failure, the corresponding list is unmodified.
+ */
+static void allocate_class_block (uint64_t size, struct small_class_arena_t * arena) {
+  if (allocate_block (size, (CLASS_BLOCK_SIZE - CLASS_BLOCK_HEADER_SIZE) / size, get_avail_list (size, arena), arena) == NULL) return;
+  SMALL_STAT_ADD (arena->stat_blocks, get_class_idx (size), 1);
+}
 
-  struct small_class_block * block = *list_head;
+/* take_block_slot
+   Take the available slot with the lowest index from block, which must be the head of list_head.
+   The block is removed from the list once it has no available slot.
+   Returns the index of the slot.
+ */
+static inline uint32_t take_block_slot (struct small_class_block * block, struct small_class_block ** list_head) {
   for (uint32_t i = 0; i < 32; ++i) {
     if (block->bitmap[i] != 0) {
       uint32_t idx = __builtin_ctzll (block->bitmap[i]);
       block->bitmap[i] &= ~ (1ull << idx);
-      *out_class_block = block;
       block->avail_num--;
       if (block->avail_num == 0) {
 	if (block->next_avail_block != NULL) block->next_avail_block->prev_avail_block = block->prev_avail_block;
 	*list_head = block->next_avail_block;
 	block->next_avail_block = NULL;
       }
-      return SMALL_CLASS_IDX_SLOT (block, 64 * i + idx, len);
+      return idx + 64 * i;
     }
   }
 
   /* Should not reach here */
-  *out_class_block = NULL;
-  return NULL;
+  return 0;
 }
 
-void small_free (void * ptr, void * ctx, size_t len, void * arena_vp) {
-  struct small_class_block * block = (struct small_class_block *) ctx;
-  struct small_class_arena_t * arena = (struct small_class_arena_t *) arena_vp;
-  uint32_t idx = SMALL_CLASS_SLOT_IDX (block, ptr, len);
+/* small_alloc_internal
+   Common part of small_alloc and small_calloc.
+   Outputs whether the slot is known to be filled with zeroes.
+ */
+static inline void * small_alloc_internal (size_t len, void ** ctx_ptr, struct small_class_arena_t * arena, uint32_t * clean_ptr) {
+  struct small_class_block ** out_class_block = (struct small_class_block **) ctx_ptr;
+  uint32_t cls_idx = get_class_idx (len);
 
-  struct small_class_block ** list_head;
-  if (len <= 512) {
-    uint32_t cls_idx = len / 32 - 1;
-    list_head = &(arena->small_class_avail_lists[cls_idx]);
-  } else if (len == 1024) {
-    list_head = &arena->class1024_avail_list;
-  } else {
-    list_head = &arena->class2048_avail_list;
+  void * slot = arena->cache_lists[cls_idx];
+  if (slot != NULL) {
+    arena->cache_lists[cls_idx] = *(void **) slot;
+    arena->cache_num[cls_idx]--;
+    SMALL_STAT_ADD (arena->stat_live_slots, cls_idx, 1);
+    *out_class_block = (struct small_class_block *) (((uintptr_t) slot) & ~ ((uintptr_t) CLASS_BLOCK_SIZE - 1));
+    *clean_ptr = 0;
+    return slot;
   }
 
-  block->bitmap[idx / 64] |= (1ull << (idx % 64));
-  block->avail_num++;
-  if (block->avail_num == 1) {
+  struct small_class_block ** list_head = get_avail_list (len, arena);
+
+  if (*list_head == NULL) allocate_class_block (len, arena);
+  if (*list_head == NULL) {
+    *out_class_block = NULL;
+    return NULL;
+  }
+
+  struct small_class_block * block = *list_head;
+  uint32_t idx = take_block_slot (block, list_head);
+  *out_class_block = block;
+  SMALL_STAT_ADD (arena->stat_live_slots, cls_idx, 1);
+  *clean_ptr = idx >= block->fresh_idx;
+  if (idx >= block->fresh_idx) block->fresh_idx = idx + 1;
+  return SMALL_CLASS_IDX_SLOT (block, idx, len);
+}
+
+void * small_alloc (size_t len, void ** ctx_ptr, void * arena_vp) {
+  uint32_t clean;
+  return small_alloc_internal (len, ctx_ptr, (struct small_class_arena_t *) arena_vp, &clean);
+}
+
+void * small_calloc (size_t len, void ** ctx_ptr, void * arena_vp) {
+  uint32_t clean;
+  void * ptr = small_alloc_internal (len, ctx_ptr, (struct small_class_arena_t *) arena_vp, &clean);
+  if (ptr != NULL && !clean) memset (ptr, 0, len);
+  return ptr;
+}
+
+/* release_block
+   Update list_head, the list of blocks with available slots, after some slots of block have been freed.
+   old_avail_num is the number of available slots before these slots were freed, and total_num the number of slots in the block.
+   Returns 1 if the block became empty and was returned to the buddy allocator, 0 otherwise.
+ */
+static uint32_t release_block (struct small_class_block * block, uint32_t old_avail_num, uint32_t total_num, struct small_class_block ** list_head, struct small_class_arena_t * arena) {
+  if (old_avail_num == 0) {
     block->next_avail_block = *list_head;
     if (*list_head != NULL) (*list_head)->prev_avail_block = block;
     *list_head = block;
-  } else if (block->avail_num == (65536 - CLASS_BLOCK_HEADER_SIZE) / len) {
-    /* If the current block is the only block of this class with empty slots, do not free it,
+  }
+
+  if (block->avail_num == total_num) {
+    /* If the current block is the only block of this list with empty slots, do not free it,
        since we anticipate there will be more allocations later.
      */
     if (block->prev_avail_block != NULL || block->next_avail_block != NULL) {
       if (block->prev_avail_block != NULL) block->prev_avail_block->next_avail_block = block->next_avail_block;
       if (block->next_avail_block != NULL) block->next_avail_block->prev_avail_block = block->prev_avail_block;
       if (*list_head == block) *list_head = block->next_avail_block;
-      buddy_free_4 (block->buddy_ctx, block, arena->buddy_arena);
+      buddy_free_4 (block, block->buddy_ctx, arena->buddy_arena);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* release_block_slots
+   Same as release_block, for a block of one of the small classes.
+ */
+static void release_block_slots (struct small_class_block * block, uint32_t old_avail_num, struct small_class_arena_t * arena) {
+  uint64_t len = block->class_size;
+  if (release_block (block, old_avail_num, (CLASS_BLOCK_SIZE - CLASS_BLOCK_HEADER_SIZE) / len, get_avail_list (len, arena), arena)) {
+    SMALL_STAT_ADD (arena->stat_blocks, get_class_idx (len), -1);
+  }
+}
+
+void small_free (void * ptr, void * ctx, size_t len, void * arena_vp) {
+  struct small_class_block * block = (struct small_class_block *) ctx;
+  struct small_class_arena_t * arena = (struct small_class_arena_t *) arena_vp;
+  uint32_t idx = SMALL_CLASS_SLOT_IDX (block, ptr, len);
+
+  uint32_t cls_idx = get_class_idx (len);
+  SMALL_STAT_ADD (arena->stat_live_slots, cls_idx, -1);
+#if !LIBC_MALLOC_PERCPU_CACHE
+  if (arena->cache_num[cls_idx] < LIBC_SMALL_CACHE_NUM) {
+    /* ptr may point into the middle of the slot (for aligned allocations), so push the start of the slot */
+    void * slot = SMALL_CLASS_IDX_SLOT (block, idx, len);
+    *(void **) slot = arena->cache_lists[cls_idx];
+    arena->cache_lists[cls_idx] = slot;
+    arena->cache_num[cls_idx]++;
+    return;
+  }
+#else
+  (void) cls_idx;
+#endif
+
+  uint32_t old_avail_num = block->avail_num;
+  block->bitmap[idx / 64] |= (1ull << (idx % 64));
+  block->avail_num++;
+  release_block_slots (block, old_avail_num, arena);
+}
+
+/* small_alloc_bulk
+   Allocate up to n slots of size class len, and store them into out_ptrs.
+   Each bitmap word is scanned once, and may provide up to 64 slots.
+   The cache is bypassed, since it can only provide a few slots.
+   Returns the number of slots allocated, which is less than n only if we run out of memory.
+ */
+size_t small_alloc_bulk (size_t len, size_t n, void ** out_ptrs, void * arena_vp) {
+  struct small_class_arena_t * arena = (struct small_class_arena_t *) arena_vp;
+  struct small_class_block ** list_head = get_avail_list (len, arena);
+  size_t num = 0;
+
+  while (num < n) {
+    if (*list_head == NULL) allocate_class_block (len, arena);
+    if (*list_head == NULL) break;
+
+    struct small_class_block * block = *list_head;
+    uint32_t last_idx = 0;
+
+    for (uint32_t i = 0; i < 32 && num < n && block->avail_num != 0; ++i) {
+      uint64_t word = block->bitmap[i];
+      if (word == 0) continue;
+
+      uint32_t taken = 0;
+      while (word != 0 && num < n) {
+	uint32_t idx = __builtin_ctzll (word) + 64 * i;
+	word &= word - 1;
+	out_ptrs[num++] = SMALL_CLASS_IDX_SLOT (block, idx, len);
+	last_idx = idx;
+	taken++;
+      }
+
+      block->bitmap[i] = word;
+      block->avail_num -= taken;
+    }
+
+    if (last_idx >= block->fresh_idx) block->fresh_idx = last_idx + 1;
+
+    if (block->avail_num == 0) {
+      if (block->next_avail_block != NULL) block->next_avail_block->prev_avail_block = NULL;
+      *list_head = block->next_avail_block;
+      block->next_avail_block = NULL;
+    }
+  }
+
+  SMALL_STAT_ADD (arena->stat_live_slots, get_class_idx (len), num);
+  return num;
+}
+
+/* small_free_bulk
+   Free n slots allocated by this arena, bypassing the cache.
+   Consecutive slots from the same block are returned together, so the list of blocks is updated once per run.
+ */
+void small_free_bulk (void ** ptrs, size_t n, void * arena_vp) {
+  struct small_class_arena_t * arena = (struct small_class_arena_t *) arena_vp;
+  size_t i = 0;
+
+  while (i < n) {
+    struct small_class_block * block = (struct small_class_block *) (((uintptr_t) ptrs[i]) & ~ ((uintptr_t) CLASS_BLOCK_SIZE - 1));
+    uint64_t len = block->class_size;
+    uint32_t old_avail_num = block->avail_num;
+
+    do {
+      uint32_t idx = SMALL_CLASS_SLOT_IDX (block, ptrs[i], len);
+      block->bitmap[idx / 64] |= (1ull << (idx % 64));
+      block->avail_num++;
+      ++i;
+    } while (i < n && (((uintptr_t) ptrs[i]) & ~ ((uintptr_t) CLASS_BLOCK_SIZE - 1)) == (uintptr_t) block);
+
+    SMALL_STAT_ADD (arena->stat_live_slots, get_class_idx (len), -(int64_t) (block->avail_num - old_avail_num));
+    release_block_slots (block, old_avail_num, arena);
+  }
+}
+
+/* small_trim
+   Return all cached slots to their blocks, then release every empty block to the buddy allocator,
+   including the last empty block of each class.
+   Returns the number of blocks released.
+ */
+size_t small_trim (void * arena_vp) {
+  struct small_class_arena_t * arena = (struct small_class_arena_t *) arena_vp;
+  size_t released = 0;
+
+  for (uint32_t cls_idx = 0; cls_idx < 24; ++cls_idx) {
+    while (arena->cache_lists[cls_idx] != NULL) {
+      void * slot = arena->cache_lists[cls_idx];
+      arena->cache_lists[cls_idx] = *(void **) slot;
+      /* Cached slots are not live, but small_free_bulk counts them as such */
+      SMALL_STAT_ADD (arena->stat_live_slots, cls_idx, 1);
+      small_free_bulk (&slot, 1, arena);
+    }
+    arena->cache_num[cls_idx] = 0;
+
+    struct small_class_block ** list_head = &(arena->small_class_avail_lists[cls_idx]);
+    struct small_class_block * block = *list_head;
+    while (block != NULL) {
+      struct small_class_block * next = block->next_avail_block;
+      if (block->avail_num == (CLASS_BLOCK_SIZE - CLASS_BLOCK_HEADER_SIZE) / block->class_size) {
+	if (block->prev_avail_block != NULL) block->prev_avail_block->next_avail_block = next;
+	if (next != NULL) next->prev_avail_block = block->prev_avail_block;
+	if (*list_head == block) *list_head = next;
+	SMALL_STAT_ADD (arena->stat_blocks, cls_idx, -1);
+	buddy_free_4 (block, block->buddy_ctx, arena->buddy_arena);
+	released++;
+      }
+      block = next;
+    }
+  }
+
+  return released;
+}
+
+void small_stats (void * arena_vp, struct malloc_stats * stats) {
+  struct small_class_arena_t * arena = (struct small_class_arena_t *) arena_vp;
+
+  for (uint32_t cls_idx = 0; cls_idx < 24; ++cls_idx) {
+    if (cls_idx < 16) stats->small_class_size[cls_idx] = 32 * (cls_idx + 1);
+    else stats->small_class_size[cls_idx] = (512ull << ((cls_idx - 16) / 4)) / 4 * (4 + (cls_idx - 16) % 4 + 1);
+    stats->small_cached_slots[cls_idx] = arena->cache_num[cls_idx];
+#if LIBC_MALLOC_STATS
+    stats->small_live_slots[cls_idx] = arena->stat_live_slots[cls_idx];
+    stats->small_blocks[cls_idx] = arena->stat_blocks[cls_idx];
+#endif
+  }
+}
+
+void * small_lookup (void * ptr, void ** ctx_ptr, size_t * len_ptr) {
+  struct small_class_block * block = (struct small_class_block *) (((uintptr_t) ptr) & ~ ((uintptr_t) CLASS_BLOCK_SIZE - 1));
+  *ctx_ptr = block;
+  *len_ptr = block->class_size;
+  return block->arena;
+}
+
+void * small_slot_end (void * ptr, void * ctx, size_t len) {
+  struct small_class_block * block = (struct small_class_block *) ctx;
+  uint32_t idx = SMALL_CLASS_SLOT_IDX (block, ptr, len);
+  return SMALL_CLASS_IDX_SLOT (block, idx + 1, len);
+}
+
+#if LIBC_MALLOC_PERCPU_CACHE
+
+/* Per-CPU caches
+
+   In place of the caches of the arenas (see small_free), each CPU has a LIFO cache of freed slots for each class,
+   holding at most LIBC_PERCPU_CACHE_NUM slots in an array.
+   Like slots in the cache of an arena, slots in a per-CPU cache are still marked as allocated in the bitmap of their block.
+   They are shared by all threads running on the CPU, whichever arena they belong to:
+   a slot taken from a per-CPU cache keeps its owning arena, and goes back to it if it is ever freed past the caches.
+   Hence the memory held in caches by threads that rarely run is bounded by the number of CPUs rather than the number of threads.
+   The statistics of the owning arena count slots in per-CPU caches as live.
+
+   Each push and pop is a restartable sequence (see rseq.h), committed by the store of the new count.
+   If the thread is preempted, migrated or interrupted by a signal before that store, the operation fails without any effect,
+   and the caller falls back to its arena.
+   Threads that have not registered rseq (cpu_id is RSEQ_CPU_ID_UNINITIALIZED),
+   and CPUs whose ID is at least LIBC_PERCPU_CACHE_CPUS, do not use per-CPU caches.
+   The descriptor of each sequence is filled in with PC-relative addresses the first time it is used,
+   rather than with absolute addresses, which would need relocations that are never applied to libc_pic.a.
+   Its abort_ip is stored last, with release semantics, and a nonzero abort_ip is read with acquire semantics,
+   so that every thread registers a complete descriptor.
+ */
+
+struct percpu_cache_class {
+  uint64_t num;
+  void * slots[LIBC_PERCPU_CACHE_NUM];
+};
+
+struct percpu_cache {
+  struct percpu_cache_class classes[24];
+} __attribute__((aligned (LIBC_CACHE_LINE_LEN)));
+
+static struct percpu_cache percpu_caches[LIBC_PERCPU_CACHE_CPUS];
+
+/* percpu_pop
+   Pop a slot from the cache classes[0] + cpu_id * sizeof (struct percpu_cache) of the current CPU.
+   Returns NULL if the cache is empty or unavailable, or if the sequence was aborted.
+ */
+static inline void * percpu_pop (struct rseq * rseq, struct percpu_cache_class * classes) {
+  void * slot;
+  uint64_t cpu, num, cls;
+
+  __asm__ volatile (
+    ".pushsection .data.rseq_cs, \"aw\"\n\t"
+    ".balign 32\n"
+    "3:\n\t"
+    ".long 0, 0\n\t"
+    ".quad 0, 0, 0\n\t"
+    ".popsection\n\t"
+    "adrp %[cls], 3b\n\t"
+    "add %[cls], %[cls], :lo12:3b\n\t"
+    "add %[num], %[cls], #24\n\t"
+    "ldar %[cpu], [%[num]]\n\t"
+    "cbnz %[cpu], 6f\n\t"
+    "adr %[cpu], 1f\n\t"
+    "str %[cpu], [%[cls], #8]\n\t"
+    "adr %[num], 2f\n\t"
+    "sub %[num], %[num], %[cpu]\n\t"
+    "str %[num], [%[cls], #16]\n\t"
+    "add %[num], %[cls], #24\n\t"
+    "adr %[cpu], 4f\n\t"
+    "stlr %[cpu], [%[num]]\n"
+    "6:\n\t"
+    "str %[cls], [%[rseq], #8]\n"
+    "1:\n\t"
+    "ldr %w[cpu], [%[rseq], #4]\n\t"
+    "cmp %[cpu], %[cpu_num]\n\t"
+    "b.hs 4f\n\t"
+    "madd %[cls], %[cpu], %[stride], %[classes]\n\t"
+    "ldr %[num], [%[cls]]\n\t"
+    "cbz %[num], 4f\n\t"
+    "sub %[num], %[num], #1\n\t"
+    "add %[slot], %[cls], %[num], lsl #3\n\t"
+    "ldr %[slot], [%[slot], #8]\n\t"
+    "str %[num], [%[cls]]\n"
+    "2:\n\t"
+    "b 5f\n\t"
+    ".inst %c[sig]\n"
+    "4:\n\t"
+    "mov %[slot], #0\n"
+    "5:"
+  : [slot] "=&r" (slot), [cpu] "=&r" (cpu), [num] "=&r" (num), [cls] "=&r" (cls)
+  : [rseq] "r" (rseq), [classes] "r" (classes), [stride] "r" ((uint64_t) sizeof (struct percpu_cache)), [cpu_num] "r" ((uint64_t) LIBC_PERCPU_CACHE_CPUS), [sig] "i" (RSEQ_SIG)
+  : "memory", "cc"
+  );
+
+  return slot;
+}
+
+/* percpu_push
+   Push slot to the cache classes[0] + cpu_id * sizeof (struct percpu_cache) of the current CPU.
+   Returns 0 if the cache is full or unavailable, or if the sequence was aborted.
+ */
+static inline uint32_t percpu_push (struct rseq * rseq, struct percpu_cache_class * classes, void * slot) {
+  uint64_t ok, cpu, num, cls;
+
+  __asm__ volatile (
+    ".pushsection .data.rseq_cs, \"aw\"\n\t"
+    ".balign 32\n"
+    "3:\n\t"
+    ".long 0, 0\n\t"
+    ".quad 0, 0, 0\n\t"
+    ".popsection\n\t"
+    "adrp %[cls], 3b\n\t"
+    "add %[cls], %[cls], :lo12:3b\n\t"
+    "add %[num], %[cls], #24\n\t"
+    "ldar %[cpu], [%[num]]\n\t"
+    "cbnz %[cpu], 6f\n\t"
+    "adr %[cpu], 1f\n\t"
+    "str %[cpu], [%[cls], #8]\n\t"
+    "adr %[num], 2f\n\t"
+    "sub %[num], %[num], %[cpu]\n\t"
+    "str %[num], [%[cls], #16]\n\t"
+    "add %[num], %[cls], #24\n\t"
+    "adr %[cpu], 4f\n\t"
+    "stlr %[cpu], [%[num]]\n"
+    "6:\n\t"
+    "str %[cls], [%[rseq], #8]\n"
+    "1:\n\t"
+    "ldr %w[cpu], [%[rseq], #4]\n\t"
+    "cmp %[cpu], %[cpu_num]\n\t"
+    "b.hs 4f\n\t"
+    "madd %[cls], %[cpu], %[stride], %[classes]\n\t"
+    "ldr %[num], [%[cls]]\n\t"
+    "cmp %[num], %[max_num]\n\t"
+    "b.hs 4f\n\t"
+    "add %[cpu], %[cls], %[num], lsl #3\n\t"
+    "str %[slot], [%[cpu], #8]\n\t"
+    "add %[num], %[num], #1\n\t"
+    "str %[num], [%[cls]]\n"
+    "2:\n\t"
+    "mov %[ok], #1\n\t"
+    "b 5f\n\t"
+    ".inst %c[sig]\n"
+    "4:\n\t"
+    "mov %[ok], #0\n"
+    "5:"
+  : [ok] "=&r" (ok), [cpu] "=&r" (cpu), [num] "=&r" (num), [cls] "=&r" (cls)
+  : [rseq] "r" (rseq), [classes] "r" (classes), [slot] "r" (slot), [stride] "r" ((uint64_t) sizeof (struct percpu_cache)), [cpu_num] "r" ((uint64_t) LIBC_PERCPU_CACHE_CPUS), [max_num] "r" ((uint64_t) LIBC_PERCPU_CACHE_NUM), [sig] "i" (RSEQ_SIG)
+  : "memory", "cc"
+  );
+
+  return ok;
+}
+
+void * small_percpu_alloc (size_t len) {
+  struct rseq * rseq = &((struct tls_struct *) get_thread_pointer ()) -> rseq;
+  return percpu_pop (rseq, &percpu_caches[0].classes[get_class_idx (len)]);
+}
+
+uint32_t small_percpu_free (void * ptr) {
+  struct rseq * rseq = &((struct tls_struct *) get_thread_pointer ()) -> rseq;
+  struct small_class_block * block = (struct small_class_block *) (((uintptr_t) ptr) & ~ ((uintptr_t) CLASS_BLOCK_SIZE - 1));
+  return percpu_push (rseq, &percpu_caches[0].classes[get_class_idx (block->class_size)], ptr);
+}
+
+#endif
+
+/* Object pools
+
+   A pool hands out objects of a fixed size chosen by the caller, rounded up only to the alignment of the pool.
+   Each pool has its own list of blocks, which are ordinary 64KiB small-class blocks from buddy_alloc_4.
+   The pool pointer is stored at the start of the data area of each block, followed by the slots,
+   so that any address within an object leads back to its pool by masking.
+   The class_size field of a pool block holds the stride of the pool.
+   Blocks without available slots are kept in the full list of the pool, linked through the same fields as the avail list,
+   so that small_pool_destroy can release them as well.
+ */
+
+#define POOL_OF_BLOCK(block_) (*(struct pool_t **) (&(block_)->block[0]))
+#define POOL_IDX_SLOT(block_, idx, pool) ((void *) ((&(block_)->block[0]) + (pool)->slot_offset + (idx) * (pool)->stride))
+#define POOL_SLOT_IDX(block_, slot, pool) ((((uintptr_t) (slot)) - ((uintptr_t) (&(block_)->block[0])) - (pool)->slot_offset) / (pool)->stride)
+
+uint32_t small_pool_init (struct pool_t * pool, size_t obj_size, size_t align) {
+  if (align < 8) align = 8;
+  if (align & (align - 1)) return 0;
+  if (align > 4096 || obj_size > 8192) return 0;
+
+  /* The bitmap of a block covers at most 2048 slots */
+  uint64_t stride = obj_size < 32 ? 32 : obj_size;
+  stride = (stride + align - 1) & ~ ((uint64_t) align - 1);
+
+  uint64_t data_start = (CLASS_BLOCK_HEADER_SIZE + sizeof (struct pool_t *) + align - 1) & ~ ((uint64_t) align - 1);
+  pool->avail_list = NULL;
+  pool->full_list = NULL;
+  pool->stride = stride;
+  pool->slot_offset = data_start - CLASS_BLOCK_HEADER_SIZE;
+  pool->slot_num = (CLASS_BLOCK_SIZE - data_start) / stride;
+  return 1;
+}
+
+void * small_pool_alloc (struct pool_t * pool, void * arena_vp) {
+  struct small_class_arena_t * arena = (struct small_class_arena_t *) arena_vp;
+
+  if (pool->avail_list == NULL) {
+    struct small_class_block * block = allocate_block (pool->stride, pool->slot_num, &pool->avail_list, arena);
+    if (block == NULL) return NULL;
+    POOL_OF_BLOCK (block) = pool;
+  }
+
+  struct small_class_block * block = pool->avail_list;
+  uint32_t idx = take_block_slot (block, &pool->avail_list);
+  if (block->avail_num == 0) {
+    block->prev_avail_block = NULL;
+    block->next_avail_block = pool->full_list;
+    if (pool->full_list != NULL) pool->full_list->prev_avail_block = block;
+    pool->full_list = block;
+  }
+  return POOL_IDX_SLOT (block, idx, pool);
+}
+
+void small_pool_free (void * ptr, struct pool_t * pool, void * arena_vp) {
+  struct small_class_arena_t * arena = (struct small_class_arena_t *) arena_vp;
+  struct small_class_block * block = (struct small_class_block *) (((uintptr_t) ptr) & ~ ((uintptr_t) CLASS_BLOCK_SIZE - 1));
+  uint32_t idx = POOL_SLOT_IDX (block, ptr, pool);
+
+  uint32_t old_avail_num = block->avail_num;
+  if (old_avail_num == 0) {
+    /* Take the block out of the full list, before release_block puts it back in the avail list */
+    if (block->prev_avail_block != NULL) block->prev_avail_block->next_avail_block = block->next_avail_block;
+    if (block->next_avail_block != NULL) block->next_avail_block->prev_avail_block = block->prev_avail_block;
+    if (pool->full_list == block) pool->full_list = block->next_avail_block;
+    block->prev_avail_block = NULL;
+    block->next_avail_block = NULL;
+  }
+  block->bitmap[idx / 64] |= (1ull << (idx % 64));
+  block->avail_num++;
+  release_block (block, old_avail_num, pool->slot_num, &pool->avail_list, arena);
+}
+
+struct pool_t * small_pool_lookup (void * ptr) {
+  struct small_class_block * block = (struct small_class_block *) (((uintptr_t) ptr) & ~ ((uintptr_t) CLASS_BLOCK_SIZE - 1));
+  return POOL_OF_BLOCK (block);
+}
+
+void small_pool_destroy (struct pool_t * pool, void * arena_vp) {
+  struct small_class_arena_t * arena = (struct small_class_arena_t *) arena_vp;
+  struct small_class_block * lists[2] = { pool->avail_list, pool->full_list };
+  for (uint32_t i = 0; i < 2; ++i) {
+    struct small_class_block * block = lists[i];
+    while (block != NULL) {
+      struct small_class_block * next = block->next_avail_block;
+      buddy_free_4 (block, block->buddy_ctx, arena->buddy_arena);
+      block = next;
     }
   }
+  pool->avail_list = NULL;
+  pool->full_list = NULL;
 }
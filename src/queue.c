@@ -0,0 +1,103 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <queue.h>
+
+uint32_t spsc_ring_init (struct spsc_ring_t * ring, void ** slots, uint64_t capacity) {
+  if (capacity == 0 || (capacity & (capacity - 1)) != 0) return 0;
+  ring->tail = 0;
+  ring->head_cache = 0;
+  ring->head = 0;
+  ring->tail_cache = 0;
+  ring->slots = slots;
+  ring->mask = capacity - 1;
+  return 1;
+}
+
+/* The producer only reads head when the ring looks full from its cached copy, and the consumer only reads tail when the ring looks empty,
+   so that each index is rarely transferred between the two cache lines.
+ */
+
+uint32_t spsc_ring_push (struct spsc_ring_t * ring, void * data) {
+  uint64_t tail = ring->tail;
+  if (tail - ring->head_cache > ring->mask) {
+    ring->head_cache = __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE);
+    if (tail - ring->head_cache > ring->mask) return 0;
+  }
+
+  ring->slots[tail & ring->mask] = data;
+  __atomic_store_n (&ring->tail, tail + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+uint32_t spsc_ring_pop (struct spsc_ring_t * ring, void ** out) {
+  uint64_t head = ring->head;
+  if (head == ring->tail_cache) {
+    ring->tail_cache = __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE);
+    if (head == ring->tail_cache) return 0;
+  }
+
+  *out = ring->slots[head & ring->mask];
+  __atomic_store_n (&ring->head, head + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/* A cell at index i holds sequence number pos when it is ready for the push at position pos (pos & mask == i),
+   and pos + 1 once that push has written it. The pop at position pos sets it to pos + mask + 1,
+   which makes the cell ready for the push one lap later.
+ */
+
+uint32_t mpmc_ring_init (struct mpmc_ring_t * ring, struct mpmc_cell * cells, uint64_t capacity) {
+  if (capacity == 0 || (capacity & (capacity - 1)) != 0) return 0;
+  for (uint64_t i = 0; i < capacity; ++i) cells[i].seq = i;
+  ring->enqueue_pos = 0;
+  ring->dequeue_pos = 0;
+  ring->cells = cells;
+  ring->mask = capacity - 1;
+  return 1;
+}
+
+uint32_t mpmc_ring_push (struct mpmc_ring_t * ring, void * data) {
+  uint64_t pos = __atomic_load_n (&ring->enqueue_pos, __ATOMIC_RELAXED);
+  struct mpmc_cell * cell;
+
+  while (true) {
+    cell = &ring->cells[pos & ring->mask];
+    uint64_t seq = __atomic_load_n (&cell->seq, __ATOMIC_ACQUIRE);
+    int64_t diff = (int64_t) (seq - pos);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n (&ring->enqueue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+    } else if (diff < 0) {
+      /* The cell still holds the element pushed one lap earlier */
+      return 0;
+    } else {
+      pos = __atomic_load_n (&ring->enqueue_pos, __ATOMIC_RELAXED);
+    }
+  }
+
+  cell->data = data;
+  __atomic_store_n (&cell->seq, pos + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+uint32_t mpmc_ring_pop (struct mpmc_ring_t * ring, void ** out) {
+  uint64_t pos = __atomic_load_n (&ring->dequeue_pos, __ATOMIC_RELAXED);
+  struct mpmc_cell * cell;
+
+  while (true) {
+    cell = &ring->cells[pos & ring->mask];
+    uint64_t seq = __atomic_load_n (&cell->seq, __ATOMIC_ACQUIRE);
+    int64_t diff = (int64_t) (seq - (pos + 1));
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n (&ring->dequeue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+    } else if (diff < 0) {
+      /* The cell has not been written since the last lap */
+      return 0;
+    } else {
+      pos = __atomic_load_n (&ring->dequeue_pos, __ATOMIC_RELAXED);
+    }
+  }
+
+  *out = cell->data;
+  __atomic_store_n (&cell->seq, pos + ring->mask + 1, __ATOMIC_RELEASE);
+  return 1;
+}
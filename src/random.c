@@ -22,8 +22,8 @@ void setup_vdso_getrandom (void) {
   getrandom_func_ptr (0, 0, 0, &getrandom_params, ~0ull);
 
   /* Allocate opaque state space.
-     We shall assume that one page is enough for all threads.
-     TODO: Implement more robust framework for per-thread state management.
+     This page is shared by the threads that have no state of their own (see getrandom_alloc_state),
+     each using the state indexed by its thread ID.
   */
   getrandom_page = mmap (NULL, 4096, getrandom_params.mmap_prot, getrandom_params.mmap_flags | MAP_ANONYMOUS, 0, 0);
   if (getrandom_page == NULL) getrandom_func_ptr = NULL;
@@ -31,14 +31,30 @@ void setup_vdso_getrandom (void) {
   return;
 }
 
+void * getrandom_alloc_state (void) {
+  if (getrandom_func_ptr == NULL) return NULL;
+  if (getrandom_params.size_of_opaque_state > 4096) return NULL;
+
+  /* A state must not straddle pages, so we simply give each thread a page of its own */
+  void * state = mmap (NULL, 4096, getrandom_params.mmap_prot, getrandom_params.mmap_flags | MAP_ANONYMOUS, 0, 0);
+  if (((intptr_t) state) < 0) return NULL;
+  return state;
+}
+
 ssize_t getrandom_syscall (void * buf, size_t buflen, unsigned int flags) {
   return syscall3 ((long) buf, buflen, flags, __NR_getrandom);
 }
 
 ssize_t getrandom (void * buf, size_t buflen, unsigned int flags) {
   if (getrandom_func_ptr) {
+    void * state = ((struct tls_struct *) get_thread_pointer ()) -> gerandom_opaque_state;
+    if (state != NULL) return getrandom_func_ptr (buf, buflen, flags, state, getrandom_params.size_of_opaque_state);
+
+    /* Threads without a state of their own share the page allocated during initialization */
     uint16_t tid = get_thread_id ();
-    return getrandom_func_ptr (buf, buflen, flags, ((char *) getrandom_page) + getrandom_params.size_of_opaque_state * tid, getrandom_params.size_of_opaque_state);
+    if (getrandom_params.size_of_opaque_state * (tid + 1) <= 4096) {
+      return getrandom_func_ptr (buf, buflen, flags, ((char *) getrandom_page) + getrandom_params.size_of_opaque_state * tid, getrandom_params.size_of_opaque_state);
+    }
   }
 
   return getrandom_syscall (buf, buflen, flags);
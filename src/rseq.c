@@ -0,0 +1,18 @@
+#include <stdint.h>
+#include <syscall.h>
+#include <syscall_nr.h>
+#include <rseq.h>
+
+uint32_t rseq_register (struct rseq * area) {
+  area->cpu_id_start = 0;
+  area->cpu_id = RSEQ_CPU_ID_UNINITIALIZED;
+  area->rseq_cs = 0;
+  area->flags = 0;
+  return syscall4 ((long) area, sizeof (struct rseq), 0, RSEQ_SIG, __NR_rseq) == 0;
+}
+
+void rseq_unregister (struct rseq * area) {
+  if (area->cpu_id == RSEQ_CPU_ID_UNINITIALIZED) return;
+  /* The kernel sets cpu_id back to RSEQ_CPU_ID_UNINITIALIZED */
+  syscall4 ((long) area, sizeof (struct rseq), RSEQ_FLAG_UNREGISTER, RSEQ_SIG, __NR_rseq);
+}
@@ -1,5 +1,8 @@
 /* memcpy.c
-   Derived from musl-libc src/string/memcpy.c
+   Up to 128 bytes are copied by copy_small, without a loop.
+   Larger copies align the destination to 16 bytes, then copy 64 bytes per iteration
+   with two pairs of NEON loads followed by two pairs of stores,
+   and finish with the last 64 bytes of the buffers, which may overlap bytes already copied.
  */
 
 #include <stddef.h>
@@ -10,60 +13,37 @@
 void * memcpy (void * restrict dest, const void * restrict src, size_t n) {
   const unsigned char * s = src;
   unsigned char * d = dest;
+  vec128_t a, b, c, e;
 
-  /* 1. Copy initial bytes until s is aligned */
-
-  while (n && ((uintptr_t) s & 7)) { *d = *s; s++; d++; n--; }
-  if (!n) return dest;
-
-  uint64_t s_buf, s_buf2, s_buf3;
-
-  /* 2. If d is also aligned, copy 8 bytes at a time */
-
-  if (((uintptr_t) d & 7) == 0) {
-    while (n >= 8) {
-      s_buf = read_u64 (s);
-      *((uint64_alias_t *) d) = s_buf;
-      s += 8; d += 8; n -= 8;
-    }
-
-    if (!n) return dest;
-
-    s_buf = read_u64 (s);
-
-    while (n) { *d = s_buf & 0xff; s_buf >>= 8; d++; n--; }
-
+  if (n <= 128) {
+    copy_small (d, s, n);
     return dest;
   }
 
-  /* 3. Align d */
-
-  uint32_t d_off = (uintptr_t) d & 7;
-  s_buf = read_u64 (s);
-
-  uint32_t i = 8 - d_off;
-  while (i && n) { *d = s_buf & 0xff; s_buf >>= 8; d++; n--; i--; }
-  if (!n) return dest;
+  /* 1. Copy the first 16 bytes, then advance to the next 16-byte boundary of d,
+	so that no store in the loop crosses a cache line */
 
-  /* 4. Copy 8 bytes at once */
+  write_q (d, read_q (s));
 
-  s += 8;
+  size_t off = 16 - ((uintptr_t) d & 15);
+  s += off; d += off; n -= off;
 
-  while (n >= 8) {
-    s_buf2 = read_u64 (s);
-    s_buf3 = s_buf | (s_buf2 << (8 * d_off));
-    *((uint64_alias_t *) d) = s_buf3;
+  /* 2. Copy 64 bytes at once, leaving between 1 and 64 bytes */
 
-    s_buf = s_buf2 >> (8 * (8 - d_off));
-    s += 8; d += 8; n -= 8;
+  while (n > 64) {
+    read_q_pair (s, &a, &b);
+    read_q_pair (s + 32, &c, &e);
+    write_q_pair (d, a, b);
+    write_q_pair (d + 32, c, e);
+    s += 64; d += 64; n -= 64;
   }
 
-  if (!n) return dest;
+  /* 3. Copy the last 64 bytes. At least 64 bytes have been copied already, so this stays within the buffers. */
 
-  /* 5. Copy final bytes */
+  read_q_pair (s + n - 64, &a, &b);
+  read_q_pair (s + n - 32, &c, &e);
+  write_q_pair (d + n - 64, a, b);
+  write_q_pair (d + n - 32, c, e);
 
-  if (n <= d_off) s_buf2 = 0; else s_buf2 = read_u64 (s);
-  s_buf3 = s_buf | (s_buf2 << (8 * d_off));
-  while (n) { *d = s_buf3 & 0xff; s_buf3 >>= 8; d++; n--; }
   return dest;
 }
@@ -1,5 +1,9 @@
 /* memmove.c
-   Derived from musl-libc src/string/memmove.c
+   Buffers that do not overlap are handed to memcpy, and up to 128 bytes are moved by copy_small,
+   which loads every byte before storing any.
+   Otherwise, 64-byte blocks are moved away from the overlap: front to back if d < s, back to front if d > s.
+   Each block is loaded entirely before it is stored, and a store only overwrites source bytes that were already loaded.
+   The remaining bytes, fewer than 64, are moved last by copy_small.
  */
 
 #include <stddef.h>
@@ -8,8 +12,9 @@
 #include <string_internal.h>
 
 void * memmove (void * dest, const void * src, size_t n) {
-  char * d = dest;
-  const char * s = src;
+  unsigned char * d = dest;
+  const unsigned char * s = src;
+  vec128_t a, b, c, e;
 
   if (d == s) return d;
 
@@ -24,110 +29,43 @@ void * memmove (void * dest, const void * src, size_t n) {
    */
   if ((uintptr_t) s - (uintptr_t) d - n <= -2 * n) return memcpy (d, s, n);
 
-  if ((uintptr_t) d < (uintptr_t) s) {
-
-    /* 1. Align s */
-    while (n && ((uintptr_t) s & 7)) { *d = *s; s++; d++; n--; }
-    if (!n) return dest;
-
-    /* 2. If d is also aligned, copy 8 bytes at once */
-    uint64_t s_buf, s_buf2;
-
-    if (((uintptr_t) d & 7) == 0) {
-      while (n >= 8) {
-	s_buf = read_u64 (s);
-	* ((uint64_alias_t *) d) = s_buf;
-
-	s += 8; d += 8; n -= 8;
-      }
-
-      while (n) { *d = *s; s++; d++; n--; }
-      return dest;
-    }
-
-    /* 3. Otherwise, first copy (8 - d_off) bytes to align d */
-    uint32_t d_off = (uintptr_t) d & 7;
-    s_buf = read_u64 (s);
-
-    uint32_t i = 8 - d_off;
-    while (i && n) { *d = s_buf & 0xff; s_buf >>= 8; d++; i--; n--; }
-    if (!n) return dest;
-
-    s += 8;
+  if (n <= 128) {
+    copy_small (d, s, n);
+    return dest;
+  }
 
-    /* 4. Repeat copy 8 bytes to d at once */
-    while (n >= 8) {
-      s_buf2 = read_u64 (s);
-      * ((uint64_alias_t *) d) = s_buf | (s_buf2 << (8 * d_off));
+  if ((uintptr_t) d < (uintptr_t) s) {
 
-      s_buf = s_buf2 >> (8 * (8 - d_off));
-      s += 8;
-      d += 8;
-      n -= 8;
+    /* 1. Move 64 bytes at once from the front */
+    while (n > 64) {
+      read_q_pair (s, &a, &b);
+      read_q_pair (s + 32, &c, &e);
+      write_q_pair (d, a, b);
+      write_q_pair (d + 32, c, e);
+      s += 64; d += 64; n -= 64;
     }
 
-    if (!n) return dest;
-
-    /* 5. Copy final bytes */
-    if (n <= d_off) s_buf2 = 0; else s_buf2 = read_u64 (s);
-    s_buf = s_buf | (s_buf2 << (8 * d_off));
-
-    while (n) { *d = s_buf & 0xff; s_buf >>= 8; d++; n--; }
+    /* 2. Move the final bytes */
+    copy_small (d, s, n);
     return dest;
 
   } else {
 
     /* Symmetric to the case above,
-       except we copy backwards. */
+       except we move backwards. */
     s = s + n;
     d = d + n;
 
-    while (n && ((uintptr_t) s & 7)) { s--; d--; *d = *s; n--; }
-    if (!n) return dest;
-
-    uint64_t s_buf, s_buf2;
-
-    if (((uintptr_t) d & 7) == 0) {
-      while (n >= 8) {
-	s -= 8;
-	d -= 8;
-
-	s_buf = read_u64 (s);
-	* ((uint64_alias_t *) d) = s_buf;
-
-	n -= 8;
-      }
-
-      while (n) { s--; d--; *d = *s; n--; }
-      return dest;
-    }
-
-    uint32_t d_off = (uintptr_t) d & 7;
-    s -= 8;
-    s_buf = read_u64 (s);
-
-    uint32_t i = d_off;
-    while (i && n) { d--; *d = (s_buf >> 56); s_buf <<= 8; i--; n--; }
-    if (!n) return dest;
-
-    while (n >= 8) {
-      s -= 8;
-      d -= 8;
-
-      s_buf2 = read_u64 (s);
-      * ((uint64_alias_t *) d) = s_buf | (s_buf2 >> (8 * (8 - d_off)));
-
-      s_buf = s_buf2 << (8 * d_off);
-      n -= 8;
+    while (n > 64) {
+      s -= 64; d -= 64;
+      read_q_pair (s, &a, &b);
+      read_q_pair (s + 32, &c, &e);
+      write_q_pair (d, a, b);
+      write_q_pair (d + 32, c, e);
+      n -= 64;
     }
 
-    if (!n) return dest;
-
-    s -= 8;
-    if (n <= 8 - d_off) s_buf2 = 0; else s_buf2 = read_u64 (s);
-    s_buf = s_buf | (s_buf2 >> (8 * (8 - d_off)));
-
-    while (n) { d--; *d = (s_buf >> 56); s_buf <<= 8; n--; }
+    copy_small (dest, src, n);
     return dest;
 
   }
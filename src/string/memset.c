@@ -1,24 +1,107 @@
 /* memset.c
-   Derived from musl-libc src/string/memset.c
+   Up to 128 bytes are filled without a loop, by stores of equal width from both ends of the buffer.
+   Larger buffers are filled 64 bytes at a time with pairs of NEON stores aligned to 16 bytes,
+   and large zero fills clear whole blocks with dc zva, which does not read the block into the cache first.
  */
 
 #include <string.h>
 #include <stdint.h>
 #include <string_internal.h>
 
+/* The number of bytes zeroed by dc zva, or 0 if dc zva is prohibited.
+   It is read from dczid_el0 by crt.o before main() is called.
+ */
+uint64_t memset_zva_len = 0;
+
+static inline __attribute__((always_inline)) void zero_block (void * ptr) {
+  __asm__ volatile (
+    "dc zva, %[ptr]"
+  :
+  : [ptr] "r" (ptr)
+  : "memory"
+  );
+}
+
 void * memset (void * dest, uint32_t c, size_t n) {
   unsigned char * d = dest;
   c &= 0xff;
   uint64_t c_long = ((uint64_t) c) * 0x0101010101010101;
+  vec128_t v = { 0 };
+  v += (uint8_t) c;
+
+  if (n <= 16) {
+    if (n >= 8) {
+      write_u64 (d, c_long);
+      write_u64 (d + n - 8, c_long);
+    } else if (n >= 4) {
+      write_u32 (d, (uint32_t) c_long);
+      write_u32 (d + n - 4, (uint32_t) c_long);
+    } else if (n) {
+      d[0] = c; d[n >> 1] = c; d[n - 1] = c;
+    }
+    return dest;
+  }
 
-  while (n && ((uintptr_t) d & 7)) { *d = c; d++; n--; }
+  if (n <= 32) {
+    write_q (d, v);
+    write_q (d + n - 16, v);
+    return dest;
+  }
+
+  if (n <= 64) {
+    write_q_pair (d, v, v);
+    write_q_pair (d + n - 32, v, v);
+    return dest;
+  }
 
-  while (n >= 8) {
-    *((uint64_alias_t *) d) = c_long;
-    d += 8; n -= 8;
+  if (n <= 128) {
+    write_q_pair (d, v, v);
+    write_q_pair (d + 32, v, v);
+    write_q_pair (d + n - 64, v, v);
+    write_q_pair (d + n - 32, v, v);
+    return dest;
   }
 
-  while (n) { *d = c; d++; n--; }
+  /* 1. Fill the first 16 bytes, then advance to the next 16-byte boundary */
+
+  write_q (d, v);
+
+  size_t off = 16 - ((uintptr_t) d & 15);
+  d += off; n -= off;
+
+  /* 2. Zero whole blocks with dc zva.
+	The bytes before the first block boundary are filled by 64-byte stores, which may run up to 63 bytes past it,
+	hence the buffer must span at least two blocks and 64 bytes for a whole block to be left. */
+
+  uint64_t zva_len = memset_zva_len;
+
+  if (c == 0 && zva_len != 0 && n >= 2 * zva_len + 64) {
+    unsigned char * end = d + n;
+    unsigned char * block = (unsigned char *) (((uintptr_t) d + zva_len - 1) & ~(zva_len - 1));
+
+    while (d < block) {
+      write_q_pair (d, v, v);
+      write_q_pair (d + 32, v, v);
+      d += 64;
+    }
+
+    for (d = block; (size_t) (end - d) >= zva_len; d += zva_len) zero_block (d);
+
+    n = end - d;
+  }
+
+  /* 3. Fill 64 bytes at once, leaving at most 64 bytes */
+
+  while (n > 64) {
+    write_q_pair (d, v, v);
+    write_q_pair (d + 32, v, v);
+    d += 64; n -= 64;
+  }
+
+  /* 4. Fill the last 64 bytes. At least 64 bytes have been filled already, so this stays within the buffer. */
+
+  write_q_pair (d + n - 64, v, v);
+  write_q_pair (d + n - 32, v, v);
 
   return dest;
 }
@@ -0,0 +1,246 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <syscall.h>
+#include <syscall_nr.h>
+#include <sync.h>
+#include <config.h>
+#include <errno.h>
+
+/* Adapted from Linux kernel include/uapi/linux/futex.h */
+#define FUTEX_WAIT_PRIVATE 128
+#define FUTEX_WAKE_PRIVATE 129
+#define FUTEX_CMP_REQUEUE_PRIVATE 132
+#define FUTEX2_SIZE_U32 0x02
+#define FUTEX2_PRIVATE 128
+#define FUTEX_BITSET_MATCH_ANY 0xffffffff
+
+struct futex_waitv {
+  uint64_t val;
+  uint64_t uaddr;
+  uint32_t flags;
+  uint32_t reserved;
+};
+
+/* The futex2 system calls (futex_wait, futex_wake, futex_requeue) need Linux 6.7.
+   On older kernels they fail with ENOSYS, after which we only use the private operations of the futex system call.
+ */
+static uint32_t no_futex2;
+
+static inline bool use_futex2 (void) {
+  return !__atomic_load_n (&no_futex2, __ATOMIC_RELAXED);
+}
+
+/* futex2_result
+   Returns true if ret is the result of a futex2 system call supported by the kernel.
+ */
+static inline bool futex2_result (long ret) {
+  if (ret != -ENOSYS) return true;
+  __atomic_store_n (&no_futex2, 1, __ATOMIC_RELAXED);
+  return false;
+}
+
+void futex_wait (uint32_t * addr, uint32_t val) {
+  if (use_futex2 () && futex2_result (syscall6 ((long) addr, val, FUTEX_BITSET_MATCH_ANY, FUTEX2_SIZE_U32 | FUTEX2_PRIVATE, 0, 0, __NR_futex_wait))) return;
+  syscall4 ((long) addr, FUTEX_WAIT_PRIVATE, val, 0, __NR_futex);
+}
+
+void futex_wake (uint32_t * addr, int n) {
+  if (use_futex2 () && futex2_result (syscall4 ((long) addr, FUTEX_BITSET_MATCH_ANY, n, FUTEX2_SIZE_U32 | FUTEX2_PRIVATE, __NR_futex_wake))) return;
+  syscall3 ((long) addr, FUTEX_WAKE_PRIVATE, n, __NR_futex);
+}
+
+/* futex_requeue
+   If *from is still val, wake up at most nr_wake threads sleeping on from,
+   and move at most nr_requeue of the others to sleep on to.
+   Returns a negative value upon failure.
+ */
+static inline long futex_requeue (uint32_t * from, uint32_t val, uint32_t * to, int nr_wake, int nr_requeue) {
+  if (use_futex2 ()) {
+    struct futex_waitv waiters[2] = {
+      { val, (uintptr_t) from, FUTEX2_SIZE_U32 | FUTEX2_PRIVATE, 0 },
+      { 0, (uintptr_t) to, FUTEX2_SIZE_U32 | FUTEX2_PRIVATE, 0 }
+    };
+    long ret = syscall4 ((long) waiters, 0, nr_wake, nr_requeue, __NR_futex_requeue);
+    if (futex2_result (ret)) return ret;
+  }
+  /* nr_requeue is passed in place of the timeout */
+  return syscall6 ((long) from, FUTEX_CMP_REQUEUE_PRIVATE, nr_wake, nr_requeue, (long) to, val, __NR_futex);
+}
+
+/* Mutex
+
+   The state of a mutex is 0 if it is unlocked, 1 if it is locked without waiters,
+   and 2 if it is locked and some threads may be sleeping on it
+   (see Ulrich Drepper, "Futexes Are Tricky").
+
+   Before sleeping, mutex_lock polls the mutex up to LIBC_MUTEX_SPIN times.
+   Each poll loads the state with ldaxr, which arms the exclusive monitor on it,
+   and waits with wfe if the mutex is held.
+   The store that releases the mutex clears the monitor, which sends an event and ends the wfe.
+ */
+
+/* spin_load
+   Load *addr with acquire semantics, and arm the exclusive monitor on it.
+ */
+static inline uint32_t spin_load (uint32_t * addr) {
+  uint32_t val;
+  __asm__ volatile ("ldaxr %w0, [%1]" : "=&r" (val) : "r" (addr) : "memory");
+  return val;
+}
+
+/* spin_pause
+   Wait for an event, such as a store to the address last loaded by spin_load.
+   The event stream of the generic timer bounds the wait.
+ */
+static inline void spin_pause (void) {
+  __asm__ volatile ("wfe" : : : "memory");
+}
+
+static inline uint32_t mutex_cas (struct mutex_t * mutex, uint32_t from, uint32_t to) {
+  return __atomic_compare_exchange_n (&mutex->state, &from, to, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+/* mutex_lock_contended
+   Acquire mutex, marking it as having waiters.
+ */
+static void mutex_lock_contended (struct mutex_t * mutex) {
+  while (__atomic_exchange_n (&mutex->state, 2, __ATOMIC_ACQUIRE) != 0) futex_wait (&mutex->state, 2);
+}
+
+void mutex_lock (struct mutex_t * mutex) {
+  if (mutex_cas (mutex, 0, 1)) return;
+
+  for (uint32_t i = 0; i < LIBC_MUTEX_SPIN; ++i) {
+    uint32_t state = spin_load (&mutex->state);
+    /* Stop polling once others are sleeping, so that we do not overtake them forever */
+    if (state == 2) break;
+    if (state == 0) {
+      if (mutex_cas (mutex, 0, 1)) return;
+    } else {
+      spin_pause ();
+    }
+  }
+
+  mutex_lock_contended (mutex);
+}
+
+uint32_t mutex_trylock (struct mutex_t * mutex) {
+  return mutex_cas (mutex, 0, 1);
+}
+
+void mutex_unlock (struct mutex_t * mutex) {
+  if (__atomic_exchange_n (&mutex->state, 0, __ATOMIC_RELEASE) == 2) futex_wake (&mutex->state, 1);
+}
+
+/* Condition variable
+
+   The word of a condition variable is a sequence number, incremented by every signal and broadcast.
+   A waiter reads it before releasing the mutex, and sleeps only if it has not changed since,
+   so a signal sent after the mutex is released is never lost.
+
+   cond_broadcast wakes up one waiter, and moves the others to sleep on the mutex with futex_requeue,
+   rather than waking all of them only to have them contend for the mutex.
+   Since requeued waiters are woken up by mutex_unlock, every waiter acquires the mutex with mutex_lock_contended.
+ */
+
+void cond_wait (struct cond_t * cond, struct mutex_t * mutex) {
+  uint32_t seq = __atomic_load_n (&cond->seq, __ATOMIC_RELAXED);
+  mutex_unlock (mutex);
+  futex_wait (&cond->seq, seq);
+  mutex_lock_contended (mutex);
+}
+
+void cond_signal (struct cond_t * cond) {
+  __atomic_add_fetch (&cond->seq, 1, __ATOMIC_RELEASE);
+  futex_wake (&cond->seq, 1);
+}
+
+void cond_broadcast (struct cond_t * cond, struct mutex_t * mutex) {
+  uint32_t seq = __atomic_add_fetch (&cond->seq, 1, __ATOMIC_RELEASE);
+  /* If the sequence number changed in the meantime, or requeueing is not supported, simply wake up everyone */
+  if (futex_requeue (&cond->seq, seq, &mutex->state, 1, 0x7fffffff) < 0) futex_wake (&cond->seq, 0x7fffffff);
+}
+
+/* Reader-writer lock
+
+   The state holds the number of readers in its low 15 bits, the number of waiting writers in the next 15 bits, and two flags:
+   RWLOCK_WRITER if a writer holds the lock, and RWLOCK_READER_WAITING if a reader may be sleeping.
+   A writer counts itself as waiting until it takes the lock, and new readers wait as long as any writer waits,
+   so that writers are not starved.
+
+   Readers sleep on the state word, while writers sleep on the separate sequence number writer_seq,
+   so that a single writer can be woken up without waking the readers.
+   The thread that leaves the lock free (see rwlock_wake) wakes up one writer if some are waiting,
+   and otherwise clears RWLOCK_READER_WAITING and wakes up all readers.
+ */
+
+#define RWLOCK_WRITER (1u << 31)
+#define RWLOCK_READER_WAITING (1u << 30)
+#define RWLOCK_WRITER_ONE (1u << 15)
+#define RWLOCK_WRITERS_WAITING (RWLOCK_READER_WAITING - RWLOCK_WRITER_ONE)
+#define RWLOCK_READERS (RWLOCK_WRITER_ONE - 1)
+
+static inline uint32_t rwlock_cas (struct rwlock_t * rwlock, uint32_t from, uint32_t to) {
+  return __atomic_compare_exchange_n (&rwlock->state, &from, to, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+/* rwlock_wake
+   Wake up the waiters that may proceed, given the state just after a thread left the lock.
+ */
+static void rwlock_wake (struct rwlock_t * rwlock, uint32_t state) {
+  while (true) {
+    /* The writer holding the lock wakes up the waiters when it leaves */
+    if (state & RWLOCK_WRITER) return;
+
+    if (state & RWLOCK_WRITERS_WAITING) {
+      /* The last reader to leave wakes up a writer */
+      if ((state & RWLOCK_READERS) != 0) return;
+      __atomic_add_fetch (&rwlock->writer_seq, 1, __ATOMIC_SEQ_CST);
+      futex_wake (&rwlock->writer_seq, 1);
+      return;
+    }
+
+    if ((state & RWLOCK_READER_WAITING) == 0) return;
+    if (__atomic_compare_exchange_n (&rwlock->state, &state, state & ~ RWLOCK_READER_WAITING, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      futex_wake (&rwlock->state, 0x7fffffff);
+      return;
+    }
+  }
+}
+
+void rwlock_read_lock (struct rwlock_t * rwlock) {
+  while (true) {
+    uint32_t state = __atomic_load_n (&rwlock->state, __ATOMIC_RELAXED);
+    if ((state & (RWLOCK_WRITER | RWLOCK_WRITERS_WAITING)) == 0) {
+      if (rwlock_cas (rwlock, state, state + 1)) return;
+    } else if (rwlock_cas (rwlock, state, state | RWLOCK_READER_WAITING)) {
+      futex_wait (&rwlock->state, state | RWLOCK_READER_WAITING);
+    }
+  }
+}
+
+void rwlock_read_unlock (struct rwlock_t * rwlock) {
+  rwlock_wake (rwlock, __atomic_sub_fetch (&rwlock->state, 1, __ATOMIC_RELEASE));
+}
+
+void rwlock_write_lock (struct rwlock_t * rwlock) {
+  if (rwlock_cas (rwlock, 0, RWLOCK_WRITER)) return;
+
+  /* From now on, new readers wait for us */
+  __atomic_add_fetch (&rwlock->state, RWLOCK_WRITER_ONE, __ATOMIC_RELAXED);
+
+  while (true) {
+    /* Read the sequence number first, so that a wake-up sent after we find the lock taken is not lost */
+    uint32_t seq = __atomic_load_n (&rwlock->writer_seq, __ATOMIC_SEQ_CST);
+    uint32_t state = __atomic_load_n (&rwlock->state, __ATOMIC_SEQ_CST);
+    if ((state & (RWLOCK_WRITER | RWLOCK_READERS)) == 0) {
+      if (rwlock_cas (rwlock, state, state - RWLOCK_WRITER_ONE + RWLOCK_WRITER)) return;
+    } else {
+      futex_wait (&rwlock->writer_seq, seq);
+    }
+  }
+}
+
+void rwlock_write_unlock (struct rwlock_t * rwlock) {
+  rwlock_wake (rwlock, __atomic_and_fetch (&rwlock->state, ~ RWLOCK_WRITER, __ATOMIC_RELEASE));
+}
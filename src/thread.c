@@ -0,0 +1,261 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <syscall.h>
+#include <syscall_nr.h>
+#include <memory.h>
+#include <random.h>
+#include <rseq.h>
+#include <exit.h>
+#include <tls.h>
+#include <thread.h>
+#include <config.h>
+
+/* Each registered thread owns a slot holding its tls_struct and its malloc arena.
+   Slots are mapped on demand and never unmapped; they are linked into a list that only grows,
+   so that it can be walked without taking any lock.
+   The state of each slot is changed with compare-and-swap:
+   ACTIVE when it belongs to a running thread, ORPHAN when its thread has exited,
+   and DRAINING while some thread is completing the frees pending in its free set.
+ */
+
+#define THREAD_SLOT_ACTIVE 1
+#define THREAD_SLOT_ORPHAN 2
+#define THREAD_SLOT_DRAINING 3
+
+struct thread_slot {
+  struct tls_struct tls;
+  struct thread_slot * next;
+  uint32_t state;
+  struct malloc_arena_t arena;
+};
+
+#define THREAD_SLOT_LEN ((sizeof (struct thread_slot) + 4095) & ~ 4095ull)
+
+static struct thread_slot * slot_list = NULL;
+static uint32_t next_thread_id = 0;
+
+/* claim_slot
+   Change the state of slot from `from` to `to`. Returns 1 upon success.
+ */
+static inline uint32_t claim_slot (struct thread_slot * slot, uint32_t from, uint32_t to) {
+  return __atomic_compare_exchange_n (&slot->state, &from, to, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+struct tls_struct * thread_register (void) {
+  struct thread_slot * slot;
+
+  /* Adopt an orphan, along with the allocations left in its arena */
+  for (slot = __atomic_load_n (&slot_list, __ATOMIC_SEQ_CST); slot != NULL; slot = slot->next) {
+    if (claim_slot (slot, THREAD_SLOT_ORPHAN, THREAD_SLOT_ACTIVE)) {
+      slot->tls.thread_pool_worker = NULL;
+      rseq_register (&slot->tls.rseq);
+      set_thread_pointer (&slot->tls);
+      return &slot->tls;
+    }
+  }
+
+  uint32_t id = __atomic_fetch_add (&next_thread_id, 1, __ATOMIC_SEQ_CST);
+  if (id > UINT16_MAX) return NULL;
+
+  void * ctx;
+  slot = mmap_alloc (THREAD_SLOT_LEN, &ctx);
+  if (slot == NULL) return NULL;
+
+  slot->tls.thread_id = id;
+  slot->tls.malloc_arena = &slot->arena;
+  slot->tls.gerandom_opaque_state = getrandom_alloc_state ();
+  slot->tls.thread_pool_worker = NULL;
+  __builtin_memset (&slot->tls.ebr, 0, sizeof (struct ebr_thread_t));
+  rseq_register (&slot->tls.rseq);
+  slot->state = THREAD_SLOT_ACTIVE;
+  set_thread_pointer (&slot->tls);
+  malloc_init ();
+
+  struct thread_slot * head = __atomic_load_n (&slot_list, __ATOMIC_SEQ_CST);
+  do {
+    slot->next = head;
+  } while (!__atomic_compare_exchange_n (&slot_list, &head, slot, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+
+  return &slot->tls;
+}
+
+void thread_unregister (void) {
+  /* tls is the first member of the slot */
+  struct thread_slot * slot = (struct thread_slot *) get_thread_pointer ();
+  clear_free_set ();
+  /* The next thread adopting the slot registers the same area, so the kernel must stop writing to it first */
+  rseq_unregister (&slot->tls.rseq);
+  __atomic_store_n (&slot->state, THREAD_SLOT_ORPHAN, __ATOMIC_SEQ_CST);
+}
+
+size_t thread_drain_orphans (void) {
+  size_t drained = 0;
+
+  for (struct thread_slot * slot = __atomic_load_n (&slot_list, __ATOMIC_SEQ_CST); slot != NULL; slot = slot->next) {
+    if (claim_slot (slot, THREAD_SLOT_ORPHAN, THREAD_SLOT_DRAINING)) {
+      clear_free_set_of_arena (&slot->arena);
+      __atomic_store_n (&slot->state, THREAD_SLOT_ORPHAN, __ATOMIC_SEQ_CST);
+      drained++;
+    }
+  }
+
+  return drained;
+}
+
+struct tls_struct * thread_iterate (struct tls_struct * tls) {
+  /* tls is the first member of the slot */
+  struct thread_slot * slot = tls == NULL ? __atomic_load_n (&slot_list, __ATOMIC_SEQ_CST) : ((struct thread_slot *) tls)->next;
+  return slot == NULL ? NULL : &slot->tls;
+}
+
+/* Thread creation
+
+   Threads are created with clone3, sharing everything with the creating thread.
+   The kernel stores the thread ID of the new thread into thread->tid before clone3 returns (CLONE_PARENT_SETTID),
+   and clears it and wakes up the futex at that address when the thread exits (CLONE_CHILD_CLEARTID).
+   thread_join waits on this futex. The kernel wakes it as a shared futex, so we must not wait with FUTEX_PRIVATE_FLAG.
+
+   The new thread starts on its own stack, with the thread pointer of its creator.
+   It registers itself before running any C code that might use the thread pointer.
+ */
+
+/* Adapted from Linux kernel include/uapi/linux/sched.h */
+#define CLONE_VM 0x00000100
+#define CLONE_FS 0x00000200
+#define CLONE_FILES 0x00000400
+#define CLONE_SIGHAND 0x00000800
+#define CLONE_THREAD 0x00010000
+#define CLONE_SYSVSEM 0x00040000
+#define CLONE_PARENT_SETTID 0x00100000
+#define CLONE_CHILD_CLEARTID 0x00200000
+
+struct clone_args {
+  uint64_t flags;
+  uint64_t pidfd;
+  uint64_t child_tid;
+  uint64_t parent_tid;
+  uint64_t exit_signal;
+  uint64_t stack;
+  uint64_t stack_size;
+  uint64_t tls;
+  uint64_t set_tid;
+  uint64_t set_tid_size;
+  uint64_t cgroup;
+};
+
+#define FUTEX_WAIT 0
+
+struct thread_t {
+  uint32_t tid;
+  void * (* func) (void *);
+  void * arg;
+  void * result;
+  /* The mapping of the stack, starting with the guard page */
+  void * stack;
+};
+
+/* Each stack is preceded by an inaccessible guard page, so that a stack overflow faults
+   instead of silently overwriting whatever is mapped below.
+   Stacks are mapped directly rather than with mmap_alloc, which may back them with huge pages that cannot be protected page by page.
+ */
+#define THREAD_GUARD_LEN 4096
+#define THREAD_STACK_MAP_LEN (LIBC_THREAD_STACK_SIZE + THREAD_GUARD_LEN)
+
+/* thread_entry
+   The first function run by a new thread, on its own stack.
+ */
+static __attribute__((used, noreturn)) void thread_entry (struct thread_t * thread) {
+  if (thread_register () == NULL) exit (1);
+  thread->result = thread->func (thread->arg);
+  thread_unregister ();
+  exit (0);
+}
+
+/* clone_thread
+   Call clone3 with args. The new thread jumps to thread_entry (thread) right away, with no frame record.
+   Returns the result of clone3 in the calling thread.
+ */
+static long clone_thread (struct clone_args * args, struct thread_t * thread) {
+  register long _arg1 __asm__ ("x0") = (long) args;
+  register long _arg2 __asm__ ("x1") = sizeof (struct clone_args);
+  register long _thread __asm__ ("x2") = (long) thread;
+  register long _num __asm__ ("x8") = __NR_clone3;
+
+  /* The system call preserves x2 in both threads */
+  __asm__ volatile (
+    "svc 0\n\t"
+    "cbnz x0, 1f\n\t"
+    "mov x0, x2\n\t"
+    "mov x29, #0\n\t"
+    "mov x30, #0\n\t"
+    "b thread_entry\n"
+    "1:"
+  : "=r"(_arg1)
+  : "0"(_arg1), "r"(_arg2), "r"(_thread), "r"(_num)
+  : "memory", "cc"
+  );
+
+  return _arg1;
+}
+
+struct thread_t * thread_create (void * (* func) (void *), void * arg) {
+  struct thread_t * thread = malloc (sizeof (struct thread_t));
+  if (thread == NULL) return NULL;
+
+  thread->stack = mmap (NULL, THREAD_STACK_MAP_LEN, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
+  if (((intptr_t) thread->stack) < 0) {
+    free (thread);
+    return NULL;
+  }
+  if (mprotect (thread->stack, THREAD_GUARD_LEN, PROT_NONE) < 0) {
+    munmap (thread->stack, THREAD_STACK_MAP_LEN);
+    free (thread);
+    return NULL;
+  }
+
+  thread->tid = 0;
+  thread->func = func;
+  thread->arg = arg;
+  thread->result = NULL;
+
+  struct clone_args args;
+  __builtin_memset (&args, 0, sizeof (struct clone_args));
+  args.flags = CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_SIGHAND | CLONE_THREAD | CLONE_SYSVSEM | CLONE_PARENT_SETTID | CLONE_CHILD_CLEARTID;
+  args.child_tid = (uintptr_t) &thread->tid;
+  args.parent_tid = (uintptr_t) &thread->tid;
+  args.stack = ((uintptr_t) thread->stack) + THREAD_GUARD_LEN;
+  args.stack_size = LIBC_THREAD_STACK_SIZE;
+
+  if (clone_thread (&args, thread) < 0) {
+    munmap (thread->stack, THREAD_STACK_MAP_LEN);
+    free (thread);
+    return NULL;
+  }
+
+  return thread;
+}
+
+void * thread_join (struct thread_t * thread) {
+  while (true) {
+    uint32_t tid = __atomic_load_n (&thread->tid, __ATOMIC_SEQ_CST);
+    if (tid == 0) break;
+    syscall4 ((long) &thread->tid, FUTEX_WAIT, tid, 0, __NR_futex);
+  }
+
+  /* The thread no longer runs on its stack once the kernel has cleared its ID */
+  void * result = thread->result;
+  munmap (thread->stack, THREAD_STACK_MAP_LEN);
+  free (thread);
+  return result;
+}
+
+uint32_t thread_cpu_count (void) {
+  uint64_t mask[16];
+  long len = syscall3 (0, sizeof (mask), (long) mask, __NR_sched_getaffinity);
+  if (len <= 0) return 1;
+
+  uint32_t count = 0;
+  for (long i = 0; i < len / 8; ++i) count += __builtin_popcountll (mask[i]);
+  return count ? count : 1;
+}
@@ -0,0 +1,437 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <memory.h>
+#include <tls.h>
+#include <thread.h>
+#include <sync.h>
+#include <thread_pool.h>
+#include <config.h>
+
+/* Each worker of a thread pool owns a Chase-Lev deque of tasks
+   (see Lê et al., "Correct and Efficient Work-Stealing for Weak Memory Models", PPoPP 2013).
+   The owner pushes and takes tasks at the bottom of its deque without any atomic read-modify-write,
+   except when taking the last task; other workers steal from the top with a compare-and-swap.
+   The deque has a fixed capacity of LIBC_THREAD_POOL_DEQUE_SIZE tasks;
+   a worker whose deque is full runs the tasks it submits right away.
+
+   Tasks submitted by threads outside the pool are put into an injection queue protected by a mutex.
+   A worker looks for a task in its own deque, then in the injection queue,
+   then in the deques of the other workers, starting from a random one.
+
+   Idle workers park on the futex idle_seq. A worker first increments idle_num, then looks for a task once more,
+   and sleeps only if idle_seq has not changed. A submitter increments idle_seq and wakes up one worker
+   whenever idle_num is not zero after it has published its task, so no task is left behind while every worker sleeps.
+   A worker waiting for a task to complete (see wait_done) parks in the same way, so that it is woken up for new tasks as well,
+   and the thread completing the task wakes up all parked workers.
+
+   Tasks are allocated with malloc by the thread submitting them, on the thread-local path of its own arena,
+   and freed by the thread joining them (or running them, for the ranges of thread_pool_parallel_for).
+ */
+
+struct thread_pool_task {
+  void (* run) (struct thread_pool_task * task);
+  /* Link in the injection queue */
+  struct thread_pool_task * next;
+  struct thread_pool_t * pool;
+  /* Completion word (see wait_done) */
+  uint32_t done;
+  void (* func) (void *);
+  void * arg;
+};
+
+struct parallel_for_state {
+  void (* func) (void *, uint64_t, uint64_t);
+  void * ctx;
+  uint64_t grain;
+  uint64_t remaining;
+  uint32_t done;
+};
+
+struct parallel_for_task {
+  struct thread_pool_task task;
+  struct parallel_for_state * state;
+  uint64_t begin;
+  uint64_t end;
+};
+
+_Static_assert ((LIBC_THREAD_POOL_DEQUE_SIZE & (LIBC_THREAD_POOL_DEQUE_SIZE - 1)) == 0, "LIBC_THREAD_POOL_DEQUE_SIZE is not a power of two");
+
+/* top and bottom are kept on different cache lines, since thieves only write top */
+struct thread_pool_deque {
+  int64_t top;
+  char top_pad[LIBC_CACHE_LINE_LEN - sizeof (int64_t)];
+  int64_t bottom;
+  char bottom_pad[LIBC_CACHE_LINE_LEN - sizeof (int64_t)];
+  struct thread_pool_task * tasks[LIBC_THREAD_POOL_DEQUE_SIZE];
+};
+
+struct thread_pool_worker {
+  struct thread_pool_deque deque;
+  struct thread_pool_t * pool;
+  struct thread_t * thread;
+  uint64_t rng_state;
+};
+
+struct thread_pool_t {
+  uint32_t worker_num;
+  uint32_t stop;
+  uint32_t idle_seq;
+  uint32_t idle_num;
+  struct mutex_t inject_lock;
+  struct thread_pool_task * inject_head;
+  struct thread_pool_task * inject_tail;
+  struct thread_pool_worker * workers;
+};
+
+#define DEQUE_MASK (LIBC_THREAD_POOL_DEQUE_SIZE - 1)
+
+/* deque_push
+   Push task to the bottom of the deque of the calling worker. Returns 0 if the deque is full.
+ */
+static uint32_t deque_push (struct thread_pool_deque * deque, struct thread_pool_task * task) {
+  int64_t bottom = __atomic_load_n (&deque->bottom, __ATOMIC_RELAXED);
+  int64_t top = __atomic_load_n (&deque->top, __ATOMIC_ACQUIRE);
+  if (bottom - top >= LIBC_THREAD_POOL_DEQUE_SIZE) return 0;
+
+  __atomic_store_n (&deque->tasks[bottom & DEQUE_MASK], task, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+  __atomic_store_n (&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+  return 1;
+}
+
+/* deque_take
+   Take the task at the bottom of the deque of the calling worker. Returns NULL if the deque is empty.
+ */
+static struct thread_pool_task * deque_take (struct thread_pool_deque * deque) {
+  int64_t bottom = __atomic_load_n (&deque->bottom, __ATOMIC_RELAXED) - 1;
+  __atomic_store_n (&deque->bottom, bottom, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+  int64_t top = __atomic_load_n (&deque->top, __ATOMIC_RELAXED);
+
+  if (top > bottom) {
+    __atomic_store_n (&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+
+  struct thread_pool_task * task = __atomic_load_n (&deque->tasks[bottom & DEQUE_MASK], __ATOMIC_RELAXED);
+  if (top == bottom) {
+    /* The last task may be stolen at the same time */
+    if (!__atomic_compare_exchange_n (&deque->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) task = NULL;
+    __atomic_store_n (&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+  }
+  return task;
+}
+
+/* deque_steal
+   Take the task at the top of the deque of another worker. Returns NULL if the deque is empty, or if another thread took the task first.
+ */
+static struct thread_pool_task * deque_steal (struct thread_pool_deque * deque) {
+  int64_t top = __atomic_load_n (&deque->top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+  int64_t bottom = __atomic_load_n (&deque->bottom, __ATOMIC_ACQUIRE);
+  if (top >= bottom) return NULL;
+
+  struct thread_pool_task * task = __atomic_load_n (&deque->tasks[top & DEQUE_MASK], __ATOMIC_RELAXED);
+  if (!__atomic_compare_exchange_n (&deque->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) return NULL;
+  return task;
+}
+
+static void inject_push (struct thread_pool_t * pool, struct thread_pool_task * task) {
+  task->next = NULL;
+  mutex_lock (&pool->inject_lock);
+  if (pool->inject_tail == NULL) __atomic_store_n (&pool->inject_head, task, __ATOMIC_RELEASE);
+  else pool->inject_tail->next = task;
+  pool->inject_tail = task;
+  mutex_unlock (&pool->inject_lock);
+}
+
+static struct thread_pool_task * inject_pop (struct thread_pool_t * pool) {
+  /* Avoid taking the lock when the queue is empty, which is the common case */
+  if (__atomic_load_n (&pool->inject_head, __ATOMIC_ACQUIRE) == NULL) return NULL;
+
+  mutex_lock (&pool->inject_lock);
+  struct thread_pool_task * task = pool->inject_head;
+  if (task != NULL) {
+    __atomic_store_n (&pool->inject_head, task->next, __ATOMIC_RELAXED);
+    if (task->next == NULL) pool->inject_tail = NULL;
+  }
+  mutex_unlock (&pool->inject_lock);
+  return task;
+}
+
+/* current_worker
+   Returns the worker of pool run by the calling thread, or NULL if the calling thread is not a worker of pool.
+ */
+static inline struct thread_pool_worker * current_worker (struct thread_pool_t * pool) {
+  struct thread_pool_worker * worker = ((struct tls_struct *) get_thread_pointer ()) -> thread_pool_worker;
+  if (worker == NULL || worker->pool != pool) return NULL;
+  return worker;
+}
+
+/* find_task
+   Look for a task to run on behalf of worker.
+ */
+static struct thread_pool_task * find_task (struct thread_pool_t * pool, struct thread_pool_worker * worker) {
+  struct thread_pool_task * task = deque_take (&worker->deque);
+  if (task != NULL) return task;
+
+  task = inject_pop (pool);
+  if (task != NULL) return task;
+
+  /* xorshift64 */
+  uint64_t x = worker->rng_state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  worker->rng_state = x;
+
+  uint32_t n = pool->worker_num;
+  uint32_t start = x % n;
+  for (uint32_t i = 0; i < n; ++i) {
+    struct thread_pool_worker * victim = &pool->workers[(start + i) % n];
+    if (victim == worker) continue;
+    task = deque_steal (&victim->deque);
+    if (task != NULL) return task;
+  }
+
+  return NULL;
+}
+
+/* notify_workers
+   Wake up an idle worker, if any, after a task has been published.
+ */
+static void notify_workers (struct thread_pool_t * pool) {
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+  if (__atomic_load_n (&pool->idle_num, __ATOMIC_SEQ_CST) == 0) return;
+  __atomic_add_fetch (&pool->idle_seq, 1, __ATOMIC_SEQ_CST);
+  futex_wake (&pool->idle_seq, 1);
+}
+
+/* submit_task
+   Hand task to pool: to the deque of the calling worker, or to the injection queue for threads outside the pool.
+ */
+static void submit_task (struct thread_pool_t * pool, struct thread_pool_task * task) {
+  struct thread_pool_worker * worker = current_worker (pool);
+  if (worker != NULL) {
+    if (!deque_push (&worker->deque, task)) {
+      task->run (task);
+      return;
+    }
+  } else {
+    inject_push (pool, task);
+  }
+  notify_workers (pool);
+}
+
+/* Completion words
+
+   A completion word is DONE_PENDING until the task (or parallel loop) completes, and DONE_COMPLETED afterwards.
+   A thread outside the pool waiting for it sets it to DONE_SLEEPING and sleeps on the word itself.
+   A worker waiting for it sets it to DONE_PARKED and parks on idle_seq like an idle worker,
+   so that notify_workers can wake it up to run new tasks in the meantime.
+ */
+
+#define DONE_PENDING 0
+#define DONE_COMPLETED 1
+#define DONE_SLEEPING 2
+#define DONE_PARKED 3
+
+/* set_done
+   Mark a completion word as done, and wake up the thread waiting for it.
+ */
+static void set_done (struct thread_pool_t * pool, uint32_t * done) {
+  uint32_t state = __atomic_exchange_n (done, DONE_COMPLETED, __ATOMIC_SEQ_CST);
+  if (state == DONE_SLEEPING) {
+    futex_wake (done, 0x7fffffff);
+  } else if (state == DONE_PARKED) {
+    /* We cannot tell the waiting worker apart from the other parked workers, so wake up all of them */
+    __atomic_add_fetch (&pool->idle_seq, 1, __ATOMIC_SEQ_CST);
+    futex_wake (&pool->idle_seq, 0x7fffffff);
+  }
+}
+
+/* wait_done
+   Wait for a completion word to be done. Workers of pool run other tasks in the meantime.
+ */
+static void wait_done (struct thread_pool_t * pool, uint32_t * done) {
+  struct thread_pool_worker * worker = current_worker (pool);
+
+  while (true) {
+    uint32_t state = __atomic_load_n (done, __ATOMIC_ACQUIRE);
+    if (state == DONE_COMPLETED) return;
+
+    if (worker == NULL) {
+      if (state == DONE_PENDING && !__atomic_compare_exchange_n (done, &state, DONE_SLEEPING, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) continue;
+      futex_wait (done, DONE_SLEEPING);
+      continue;
+    }
+
+    struct thread_pool_task * task = find_task (pool, worker);
+    if (task == NULL) {
+      /* Park as in worker_main, after announcing that we wait, so that neither a new task nor the completion is missed */
+      uint32_t seq = __atomic_load_n (&pool->idle_seq, __ATOMIC_SEQ_CST);
+      __atomic_add_fetch (&pool->idle_num, 1, __ATOMIC_SEQ_CST);
+      if (state == DONE_PENDING) __atomic_compare_exchange_n (done, &state, DONE_PARKED, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+      task = find_task (pool, worker);
+      if (task == NULL && __atomic_load_n (done, __ATOMIC_SEQ_CST) == DONE_PARKED) futex_wait (&pool->idle_seq, seq);
+      __atomic_sub_fetch (&pool->idle_num, 1, __ATOMIC_SEQ_CST);
+    }
+
+    if (task != NULL) task->run (task);
+  }
+}
+
+static void run_user_task (struct thread_pool_task * task) {
+  task->func (task->arg);
+  set_done (task->pool, &task->done);
+}
+
+struct thread_pool_task * thread_pool_submit (struct thread_pool_t * pool, void (* func) (void *), void * arg) {
+  struct thread_pool_task * task = malloc (sizeof (struct thread_pool_task));
+  if (task == NULL) return NULL;
+
+  task->run = run_user_task;
+  task->pool = pool;
+  task->done = DONE_PENDING;
+  task->func = func;
+  task->arg = arg;
+  submit_task (pool, task);
+  return task;
+}
+
+void thread_pool_join (struct thread_pool_t * pool, struct thread_pool_task * task) {
+  wait_done (pool, &task->done);
+  free (task);
+}
+
+/* parallel_for_run
+   Run the iterations [begin, end) of a parallel loop.
+   The upper half of the range is split off into a new task until at most grain iterations are left.
+ */
+static void parallel_for_run (struct thread_pool_t * pool, struct parallel_for_state * state, uint64_t begin, uint64_t end);
+
+static void run_parallel_for_task (struct thread_pool_task * task) {
+  struct parallel_for_task * range = (struct parallel_for_task *) task;
+  struct thread_pool_t * pool = range->task.pool;
+  struct parallel_for_state * state = range->state;
+  uint64_t begin = range->begin, end = range->end;
+  free (range);
+  parallel_for_run (pool, state, begin, end);
+}
+
+static void parallel_for_run (struct thread_pool_t * pool, struct parallel_for_state * state, uint64_t begin, uint64_t end) {
+  while (end - begin > state->grain) {
+    uint64_t mid = begin + (end - begin) / 2;
+    struct parallel_for_task * range = malloc (sizeof (struct parallel_for_task));
+    if (range == NULL) break;
+
+    range->task.run = run_parallel_for_task;
+    range->task.pool = pool;
+    range->state = state;
+    range->begin = mid;
+    range->end = end;
+    submit_task (pool, &range->task);
+    end = mid;
+  }
+
+  for (uint64_t i = begin; i < end; i += state->grain) state->func (state->ctx, i, end - i > state->grain ? i + state->grain : end);
+
+  /* The ranges split off are accounted for by the tasks running them */
+  if (__atomic_sub_fetch (&state->remaining, end - begin, __ATOMIC_ACQ_REL) == 0) set_done (pool, &state->done);
+}
+
+void thread_pool_parallel_for (struct thread_pool_t * pool, uint64_t begin, uint64_t end, uint64_t grain, void (* func) (void *, uint64_t, uint64_t), void * ctx) {
+  if (begin >= end) return;
+
+  struct parallel_for_state state;
+  state.func = func;
+  state.ctx = ctx;
+  state.grain = grain ? grain : 1;
+  state.remaining = end - begin;
+  state.done = DONE_PENDING;
+
+  parallel_for_run (pool, &state, begin, end);
+  wait_done (pool, &state.done);
+}
+
+static void * worker_main (void * arg) {
+  struct thread_pool_worker * worker = (struct thread_pool_worker *) arg;
+  struct thread_pool_t * pool = worker->pool;
+  ((struct tls_struct *) get_thread_pointer ()) -> thread_pool_worker = worker;
+
+  while (true) {
+    struct thread_pool_task * task = find_task (pool, worker);
+
+    if (task == NULL) {
+      /* Announce that we are idle, then look once more, so that a task published in the meantime is not missed */
+      uint32_t seq = __atomic_load_n (&pool->idle_seq, __ATOMIC_SEQ_CST);
+      __atomic_add_fetch (&pool->idle_num, 1, __ATOMIC_SEQ_CST);
+      task = find_task (pool, worker);
+      if (task == NULL && !__atomic_load_n (&pool->stop, __ATOMIC_SEQ_CST)) futex_wait (&pool->idle_seq, seq);
+      __atomic_sub_fetch (&pool->idle_num, 1, __ATOMIC_SEQ_CST);
+    }
+
+    if (task != NULL) task->run (task);
+    else if (__atomic_load_n (&pool->stop, __ATOMIC_SEQ_CST)) break;
+  }
+
+  ((struct tls_struct *) get_thread_pointer ()) -> thread_pool_worker = NULL;
+  return NULL;
+}
+
+/* stop_workers
+   Let the first n workers of pool finish all tasks and exit, and wait for them.
+ */
+static void stop_workers (struct thread_pool_t * pool, uint32_t n) {
+  __atomic_store_n (&pool->stop, 1, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch (&pool->idle_seq, 1, __ATOMIC_SEQ_CST);
+  futex_wake (&pool->idle_seq, 0x7fffffff);
+  for (uint32_t i = 0; i < n; ++i) thread_join (pool->workers[i].thread);
+}
+
+struct thread_pool_t * thread_pool_create (uint32_t worker_num) {
+  if (worker_num == 0) worker_num = thread_cpu_count ();
+
+  struct thread_pool_t * pool = malloc (sizeof (struct thread_pool_t));
+  if (pool == NULL) return NULL;
+  pool->workers = malloc (worker_num * sizeof (struct thread_pool_worker));
+  if (pool->workers == NULL) {
+    free (pool);
+    return NULL;
+  }
+
+  pool->worker_num = worker_num;
+  pool->stop = 0;
+  pool->idle_seq = 0;
+  pool->idle_num = 0;
+  pool->inject_lock.state = 0;
+  pool->inject_head = NULL;
+  pool->inject_tail = NULL;
+
+  for (uint32_t i = 0; i < worker_num; ++i) {
+    struct thread_pool_worker * worker = &pool->workers[i];
+    worker->deque.top = 0;
+    worker->deque.bottom = 0;
+    worker->pool = pool;
+    worker->rng_state = (((uintptr_t) worker) * 0x9e3779b97f4a7c15ull) | 1;
+  }
+
+  for (uint32_t i = 0; i < worker_num; ++i) {
+    pool->workers[i].thread = thread_create (worker_main, &pool->workers[i]);
+    if (pool->workers[i].thread == NULL) {
+      /* The workers started so far may steal from the deques of workers that never started, which are all empty */
+      stop_workers (pool, i);
+      free (pool->workers);
+      free (pool);
+      return NULL;
+    }
+  }
+
+  return pool;
+}
+
+void thread_pool_destroy (struct thread_pool_t * pool) {
+  stop_workers (pool, pool->worker_num);
+  free (pool->workers);
+  free (pool);
+}
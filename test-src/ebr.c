@@ -0,0 +1,141 @@
+#include <stdint.h>
+#include <memory.h>
+#include <thread.h>
+#include <ebr.h>
+#include <exit.h>
+
+#define MAGIC 0x5a5a5a5a5a5a5a5aull
+#define PROBE_NUM 64
+#define READER_NUM 3
+#define WRITER_NUM 2
+#define WRITES 50000
+
+struct node {
+  uint64_t magic;
+  uint64_t a, b;
+};
+
+/* Returns 1 if ptr is handed out again by malloc within PROBE_NUM allocations of its size */
+static uint32_t reused (void * ptr) {
+  void * probes[PROBE_NUM];
+  uint32_t found = 0;
+  for (uint32_t i = 0; i < PROBE_NUM; ++i) {
+    probes[i] = malloc (sizeof (struct node));
+    if (probes[i] == NULL) exit (1);
+    if (probes[i] == ptr) found = 1;
+  }
+  for (uint32_t i = 0; i < PROBE_NUM; ++i) free (probes[i]);
+  return found;
+}
+
+/* A reader holding a critical section open, until told to leave */
+
+static uint32_t holding, release_reader;
+
+static void * hold_section (void * arg) {
+  (void) arg;
+  ebr_enter ();
+  __atomic_store_n (&holding, 1, __ATOMIC_SEQ_CST);
+  while (!__atomic_load_n (&release_reader, __ATOMIC_SEQ_CST));
+  ebr_exit ();
+  return NULL;
+}
+
+static void test_grace_period (void) {
+  struct thread_t * reader = thread_create (hold_section, NULL);
+  if (reader == NULL) exit (1);
+  while (!__atomic_load_n (&holding, __ATOMIC_SEQ_CST));
+
+  /* The object must not be freed while the reader may still see it */
+  void * ptr = malloc (sizeof (struct node));
+  if (ptr == NULL) exit (1);
+  if (!ebr_retire (ptr)) exit (1);
+  for (uint32_t i = 0; i < 10; ++i) ebr_reclaim ();
+  if (reused (ptr)) exit (1);
+
+  __atomic_store_n (&release_reader, 1, __ATOMIC_SEQ_CST);
+  thread_join (reader);
+
+  /* Once the reader has left, the epoch advances and the object is freed */
+  for (uint32_t i = 0; i < 10; ++i) ebr_reclaim ();
+  if (!reused (ptr)) exit (1);
+}
+
+/* Nested critical sections of the calling thread do not hold back its own reclamation once they have ended */
+static void test_nesting (void) {
+  ebr_enter ();
+  ebr_enter ();
+  ebr_exit ();
+  ebr_exit ();
+
+  void * ptr = malloc (sizeof (struct node));
+  if (ptr == NULL) exit (1);
+  if (!ebr_retire (ptr)) exit (1);
+  for (uint32_t i = 0; i < 10; ++i) ebr_reclaim ();
+  if (!reused (ptr)) exit (1);
+}
+
+/* Readers check every node they reach, while writers replace the shared node and retire the old one */
+
+static struct node * shared;
+static uint32_t stop;
+
+static void * read_nodes (void * arg) {
+  (void) arg;
+  while (!__atomic_load_n (&stop, __ATOMIC_RELAXED)) {
+    ebr_enter ();
+    struct node * node = __atomic_load_n (&shared, __ATOMIC_ACQUIRE);
+    for (uint32_t i = 0; i < 20; ++i) {
+      if (node->magic != MAGIC || node->b != ~ node->a) exit (1);
+    }
+    ebr_exit ();
+  }
+  return NULL;
+}
+
+static void * write_nodes (void * arg) {
+  uint64_t k = (uintptr_t) arg;
+  for (uint64_t i = 0; i < WRITES; ++i) {
+    struct node * node = malloc (sizeof (struct node));
+    if (node == NULL) exit (1);
+    node->magic = MAGIC;
+    node->a = i * WRITER_NUM + k;
+    node->b = ~ node->a;
+    struct node * old = __atomic_exchange_n (&shared, node, __ATOMIC_ACQ_REL);
+    if (!ebr_retire (old)) exit (1);
+  }
+  return NULL;
+}
+
+static void test_concurrent (void) {
+  shared = malloc (sizeof (struct node));
+  if (shared == NULL) exit (1);
+  shared->magic = MAGIC;
+  shared->a = 0;
+  shared->b = ~ 0ull;
+
+  struct thread_t * readers[READER_NUM], * writers[WRITER_NUM];
+  for (uint32_t i = 0; i < READER_NUM; ++i) {
+    readers[i] = thread_create (read_nodes, NULL);
+    if (readers[i] == NULL) exit (1);
+  }
+  for (uintptr_t i = 0; i < WRITER_NUM; ++i) {
+    writers[i] = thread_create (write_nodes, (void *) i);
+    if (writers[i] == NULL) exit (1);
+  }
+
+  for (uint32_t i = 0; i < WRITER_NUM; ++i) thread_join (writers[i]);
+  __atomic_store_n (&stop, 1, __ATOMIC_RELAXED);
+  for (uint32_t i = 0; i < READER_NUM; ++i) thread_join (readers[i]);
+  free (shared);
+}
+
+void main (__attribute__((unused)) void * sp) {
+  if (thread_register () == NULL) exit (1);
+
+  test_grace_period ();
+  test_nesting ();
+  test_concurrent ();
+
+  exit (0);
+}
@@ -0,0 +1,49 @@
+#include <stdint.h>
+#include <memory.h>
+#include <thread.h>
+#include <exit.h>
+
+#define N 300
+
+static void * ptrs[N];
+
+void main (__attribute__((unused)) void * sp) {
+  if (thread_register () == NULL) exit (1);
+
+  static const size_t sizes[] = { 24, 512, 2000, 10000, 300000 };
+
+  for (uint32_t s = 0; s < sizeof (sizes) / sizeof (sizes[0]); ++s) {
+    size_t size = sizes[s];
+    size_t n = size > 100000 ? 8 : N;
+
+    if (malloc_bulk (size, n, ptrs) != n) exit (1);
+
+    /* Every region is usable, and distinct from the others */
+    for (size_t i = 0; i < n; ++i) {
+      uint8_t * p = ptrs[i];
+      if (p == NULL) exit (1);
+      p[0] = (uint8_t) i;
+      p[size - 1] = (uint8_t) i;
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+      uint8_t * p = ptrs[i];
+      if (p[0] != (uint8_t) i || p[size - 1] != (uint8_t) i) exit (1);
+    }
+
+    /* NULL entries are skipped */
+    ptrs[n / 2] = NULL;
+    free_bulk (ptrs, n);
+  }
+
+  /* Slots of different classes, and regions of different layers, may be mixed */
+  for (size_t i = 0; i < N; ++i) {
+    ptrs[i] = malloc (i % 3 == 0 ? 32 : (i % 3 == 1 ? 700 : 9000));
+    if (ptrs[i] == NULL) exit (1);
+  }
+  free_bulk (ptrs, N);
+
+  if (malloc_bulk (0, N, ptrs) != 0) exit (1);
+
+  exit (0);
+}
@@ -0,0 +1,45 @@
+#include <stdint.h>
+#include <memory.h>
+#include <thread.h>
+#include <exit.h>
+
+static const size_t sizes[] = { 1, 31, 32, 100, 2048, 2049, 5000, 65536, 200000, 300000, 1 << 20 };
+
+#define NUM_SIZES (sizeof (sizes) / sizeof (sizes[0]))
+
+void main (__attribute__((unused)) void * sp) {
+  if (thread_register () == NULL) exit (1);
+
+  /* Memory recycled from each layer must be cleared again */
+  for (uint32_t round = 0; round < 3; ++round) {
+    for (uint32_t i = 0; i < NUM_SIZES; ++i) {
+      uint8_t * p = calloc (1, sizes[i]);
+      if (p == NULL) exit (1);
+
+      for (size_t j = 0; j < sizes[i]; ++j) {
+	if (p[j] != 0) exit (1);
+      }
+
+      for (size_t j = 0; j < sizes[i]; ++j) p[j] = 0xa5;
+      free (p);
+
+      p = malloc (sizes[i]);
+      if (p == NULL) exit (1);
+      for (size_t j = 0; j < sizes[i]; ++j) p[j] = 0x5a;
+      free (p);
+    }
+  }
+
+  /* nmemb * size must not overflow */
+  if (calloc (1ull << 32, 1ull << 32) != NULL) exit (1);
+  if (calloc (0, 16) != NULL) exit (1);
+
+  uint32_t * a = calloc (1000, sizeof (uint32_t));
+  if (a == NULL) exit (1);
+  for (uint32_t i = 0; i < 1000; ++i) {
+    if (a[i] != 0) exit (1);
+  }
+  free (a);
+
+  exit (0);
+}
@@ -0,0 +1,89 @@
+#include <stdint.h>
+#include <memory.h>
+#include <thread.h>
+#include <tls.h>
+#include <rseq.h>
+#include <exit.h>
+
+#define THREAD_NUM 4
+#define ITERATIONS 100000
+#define KEEP_NUM 64
+
+/* Allocate and free small slots of all classes at random, from several threads at once.
+   With LIBC_MALLOC_PERCPU_CACHE, the slots freed by one thread are handed out to the others running on the same CPU.
+   Each slot holds its own address, which must not be overwritten while it is live.
+ */
+static void * churn (void * arg) {
+  uint64_t x = ((uintptr_t) arg) * 7919 + 1;
+  uint64_t * keep[KEEP_NUM] = { NULL };
+
+  for (uint32_t i = 0; i < ITERATIONS; ++i) {
+    /* xorshift64 */
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+
+    uint32_t k = x % KEEP_NUM;
+    if (keep[k] != NULL) {
+      if (keep[k][1] != (uintptr_t) keep[k]) exit (1);
+      free (keep[k]);
+    }
+    keep[k] = malloc (16 + (x >> 8) % 2000);
+    if (keep[k] == NULL) exit (1);
+    keep[k][1] = (uintptr_t) keep[k];
+  }
+
+  for (uint32_t k = 0; k < KEEP_NUM; ++k) free (keep[k]);
+  return NULL;
+}
+
+static void * allocate (void * arg) {
+  (void) arg;
+  return malloc (200);
+}
+
+static void * release (void * ptr) {
+  free (ptr);
+  return NULL;
+}
+
+void main (__attribute__((unused)) void * sp) {
+  struct tls_struct * tls = thread_register ();
+  if (tls == NULL) exit (1);
+  uint32_t registered = tls->rseq.cpu_id != RSEQ_CPU_ID_UNINITIALIZED;
+
+  /* A slot freed by a thread is handed back to its next allocation of the same class,
+     unless the thread moved to another CPU in between
+   */
+  uint32_t reused = 0;
+  for (uint32_t i = 0; i < 100 && !reused; ++i) {
+    void * a = malloc (100);
+    if (a == NULL) exit (1);
+    free (a);
+    void * b = malloc (100);
+    if (b == NULL) exit (1);
+    reused = a == b;
+    free (b);
+  }
+  if (!reused) exit (1);
+
+  /* A slot allocated by one thread may be freed by another, after the first has exited */
+  void * ptr = thread_join (thread_create (allocate, NULL));
+  if (ptr == NULL) exit (1);
+  thread_join (thread_create (release, ptr));
+
+  struct thread_t * threads[THREAD_NUM];
+  for (uint32_t round = 0; round < 3; ++round) {
+    for (uintptr_t i = 0; i < THREAD_NUM; ++i) {
+      threads[i] = thread_create (churn, (void *) i);
+      if (threads[i] == NULL) exit (1);
+    }
+    for (uint32_t i = 0; i < THREAD_NUM; ++i) thread_join (threads[i]);
+  }
+
+  /* The kernel stops updating the rseq area once the thread unregisters */
+  thread_unregister ();
+  if (registered && tls->rseq.cpu_id != RSEQ_CPU_ID_UNINITIALIZED) exit (1);
+
+  exit (0);
+}
@@ -0,0 +1,50 @@
+#include <stdint.h>
+#include <memory.h>
+#include <thread.h>
+#include <exit.h>
+
+#define N 2000
+
+static void * objs[N];
+
+static void test_pool (size_t obj_size, size_t align) {
+  struct pool_t * pool = pool_create (obj_size, align);
+  if (pool == NULL) exit (1);
+
+  for (uint32_t round = 0; round < 2; ++round) {
+    for (uint32_t i = 0; i < N; ++i) {
+      uint8_t * p = pool_alloc (pool);
+      if (p == NULL) exit (1);
+      if (((uintptr_t) p) & (align - 1)) exit (1);
+      for (size_t j = 0; j < obj_size; ++j) p[j] = (uint8_t) i;
+      objs[i] = p;
+    }
+
+    /* Objects do not overlap */
+    for (uint32_t i = 0; i < N; ++i) {
+      uint8_t * p = objs[i];
+      if (p[0] != (uint8_t) i || p[obj_size - 1] != (uint8_t) i) exit (1);
+    }
+
+    for (uint32_t i = 0; i < N; ++i) pool_free (pool, objs[i]);
+  }
+
+  pool_destroy (pool);
+}
+
+void main (__attribute__((unused)) void * sp) {
+  if (thread_register () == NULL) exit (1);
+
+  test_pool (32, 8);
+  test_pool (40, 8);
+  test_pool (100, 64);
+  test_pool (3000, 16);
+  test_pool (8192, 4096);
+
+  /* Invalid layouts are rejected */
+  if (pool_create (64, 24) != NULL) exit (1);
+  if (pool_create (64, 8192) != NULL) exit (1);
+  if (pool_create (10000, 8) != NULL) exit (1);
+
+  exit (0);
+}
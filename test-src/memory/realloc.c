@@ -0,0 +1,71 @@
+#include <stdint.h>
+#include <memory.h>
+#include <thread.h>
+#include <exit.h>
+
+static void fill (uint8_t * p, size_t n, uint8_t seed) {
+  for (size_t i = 0; i < n; ++i) p[i] = (uint8_t) (i * 13 + seed);
+}
+
+static uint32_t check (const uint8_t * p, size_t n, uint8_t seed) {
+  for (size_t i = 0; i < n; ++i) {
+    if (p[i] != (uint8_t) (i * 13 + seed)) return 0;
+  }
+  return 1;
+}
+
+void main (__attribute__((unused)) void * sp) {
+  if (thread_register () == NULL) exit (1);
+
+  /* A small-class slot is kept while the new size fits in its class */
+  uint8_t * p = malloc (40);
+  if (p == NULL) exit (1);
+  fill (p, 40, 1);
+  if (realloc (p, 64) != p) exit (1);
+  if (realloc (p, 50) != p) exit (1);
+  if (!check (p, 40, 1)) exit (1);
+
+  /* but not if it is more than twice as large as needed */
+  uint8_t * q = realloc (p, 20);
+  if (q == NULL || q == p) exit (1);
+  if (!check (q, 20, 1)) exit (1);
+  free (q);
+
+  /* A run of buddy pages is shrunk in place, then grown back into the pages it has just returned */
+  p = malloc (16000);
+  if (p == NULL) exit (1);
+  fill (p, 16000, 2);
+  if (realloc (p, 8000) != p) exit (1);
+  if (!check (p, 8000, 2)) exit (1);
+  if (realloc (p, 16000) != p) exit (1);
+  if (!check (p, 8000, 2)) exit (1);
+  fill (p, 16000, 3);
+
+  /* Moving from buddy-alloc to mmap-alloc copies the contents */
+  q = realloc (p, 1 << 20);
+  if (q == NULL) exit (1);
+  if (!check (q, 16000, 3)) exit (1);
+  fill (q, 1 << 20, 4);
+
+  /* An mmap region is resized with mremap, in both directions */
+  p = realloc (q, 4 << 20);
+  if (p == NULL) exit (1);
+  if (!check (p, 1 << 20, 4)) exit (1);
+  fill (p, 4 << 20, 5);
+  q = realloc (p, 3 << 20);
+  if (q == NULL) exit (1);
+  if (!check (q, 3 << 20, 5)) exit (1);
+
+  /* Moving back down to a small-class slot copies the beginning */
+  p = realloc (q, 100);
+  if (p == NULL) exit (1);
+  if (!check (p, 100, 5)) exit (1);
+
+  /* realloc (NULL, n) allocates, and realloc (p, 0) frees */
+  if (realloc (p, 0) != NULL) exit (1);
+  p = realloc (NULL, 5000);
+  if (p == NULL) exit (1);
+  free (p);
+
+  exit (0);
+}
@@ -0,0 +1,47 @@
+#include <stdint.h>
+#include <memory.h>
+#include <thread.h>
+#include <exit.h>
+
+void main (__attribute__((unused)) void * sp) {
+  if (thread_register () == NULL) exit (1);
+
+  struct region_t region;
+  region_init (&region);
+
+  uint8_t * a = region_alloc (&region, 100, 1);
+  if (a == NULL || (((uintptr_t) a) & 15)) exit (1);
+  for (uint32_t i = 0; i < 100; ++i) a[i] = 1;
+
+  uint8_t * b = region_alloc (&region, 10, 4096);
+  if (b == NULL || (((uintptr_t) b) & 4095)) exit (1);
+
+  /* Invalid alignments are rejected */
+  if (region_alloc (&region, 10, 24) != NULL) exit (1);
+  if (region_alloc (&region, 10, 8192) != NULL) exit (1);
+
+  struct region_mark mark = region_mark (&region);
+  uint8_t * c = region_alloc (&region, 1000, 16);
+  if (c == NULL) exit (1);
+
+  /* Fill several chunks, including one of its own from mmap-alloc */
+  for (uint32_t i = 0; i < 100; ++i) {
+    uint8_t * p = region_alloc (&region, 10000, 64);
+    if (p == NULL || (((uintptr_t) p) & 63)) exit (1);
+    for (uint32_t j = 0; j < 10000; ++j) p[j] = 2;
+  }
+  uint8_t * big = region_alloc (&region, 1 << 20, 16);
+  if (big == NULL) exit (1);
+  big[(1 << 20) - 1] = 3;
+
+  /* Resetting to the mark hands out the same memory again, and keeps what was allocated before it */
+  region_reset_to_mark (&region, mark);
+  if (region_alloc (&region, 1000, 16) != c) exit (1);
+  for (uint32_t i = 0; i < 100; ++i) {
+    if (a[i] != 1) exit (1);
+  }
+
+  region_destroy (&region);
+
+  exit (0);
+}
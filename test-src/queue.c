@@ -0,0 +1,142 @@
+#include <stdint.h>
+#include <queue.h>
+#include <exit.h>
+
+#define CAPACITY 8
+#define LAPS 5
+
+static void * spsc_slots[CAPACITY];
+static struct mpmc_cell mpmc_cells[CAPACITY];
+
+struct item {
+  struct mpsc_node node;
+  uint64_t value;
+};
+
+static struct item items[16];
+
+static void test_spsc (void) {
+  struct spsc_ring_t ring;
+
+  /* The capacity must be a power of two */
+  if (spsc_ring_init (&ring, spsc_slots, 0)) exit (1);
+  if (spsc_ring_init (&ring, spsc_slots, 6)) exit (1);
+  if (!spsc_ring_init (&ring, spsc_slots, CAPACITY)) exit (1);
+
+  void * out;
+  if (spsc_ring_pop (&ring, &out)) exit (1);
+
+  /* Fill and drain the ring several times, so that the indices wrap around */
+  uintptr_t next_push = 1, next_pop = 1;
+  for (uint32_t lap = 0; lap < LAPS; ++lap) {
+    for (uint32_t i = 0; i < CAPACITY; ++i) {
+      if (!spsc_ring_push (&ring, (void *) next_push++)) exit (1);
+    }
+    if (spsc_ring_push (&ring, (void *) next_push)) exit (1);
+
+    for (uint32_t i = 0; i < CAPACITY; ++i) {
+      if (!spsc_ring_pop (&ring, &out)) exit (1);
+      if ((uintptr_t) out != next_pop++) exit (1);
+    }
+    if (spsc_ring_pop (&ring, &out)) exit (1);
+  }
+
+  /* Interleave pushes and pops, keeping the ring partly filled */
+  for (uint32_t i = 0; i < LAPS * CAPACITY; ++i) {
+    if (!spsc_ring_push (&ring, (void *) next_push++)) exit (1);
+    if (!spsc_ring_push (&ring, (void *) next_push++)) exit (1);
+    if (!spsc_ring_pop (&ring, &out)) exit (1);
+    if ((uintptr_t) out != next_pop++) exit (1);
+    while (next_push - next_pop >= CAPACITY - 1) {
+      if (!spsc_ring_pop (&ring, &out)) exit (1);
+      if ((uintptr_t) out != next_pop++) exit (1);
+    }
+  }
+}
+
+static void test_mpmc (void) {
+  struct mpmc_ring_t ring;
+
+  /* The capacity must be a power of two */
+  if (mpmc_ring_init (&ring, mpmc_cells, 0)) exit (1);
+  if (mpmc_ring_init (&ring, mpmc_cells, 12)) exit (1);
+  if (!mpmc_ring_init (&ring, mpmc_cells, CAPACITY)) exit (1);
+
+  void * out;
+  if (mpmc_ring_pop (&ring, &out)) exit (1);
+
+  /* Fill and drain the ring several times, so that the sequence numbers of each cell go through several laps */
+  uintptr_t next_push = 1, next_pop = 1;
+  for (uint32_t lap = 0; lap < LAPS; ++lap) {
+    for (uint32_t i = 0; i < CAPACITY; ++i) {
+      if (!mpmc_ring_push (&ring, (void *) next_push++)) exit (1);
+    }
+    if (mpmc_ring_push (&ring, (void *) next_push)) exit (1);
+
+    for (uint32_t i = 0; i < CAPACITY; ++i) {
+      if (!mpmc_ring_pop (&ring, &out)) exit (1);
+      if ((uintptr_t) out != next_pop++) exit (1);
+    }
+    if (mpmc_ring_pop (&ring, &out)) exit (1);
+  }
+
+  /* Interleave pushes and pops, keeping the ring partly filled */
+  for (uint32_t i = 0; i < LAPS * CAPACITY; ++i) {
+    if (!mpmc_ring_push (&ring, (void *) next_push++)) exit (1);
+    if (!mpmc_ring_push (&ring, (void *) next_push++)) exit (1);
+    if (!mpmc_ring_pop (&ring, &out)) exit (1);
+    if ((uintptr_t) out != next_pop++) exit (1);
+    while (next_push - next_pop >= CAPACITY - 1) {
+      if (!mpmc_ring_pop (&ring, &out)) exit (1);
+      if ((uintptr_t) out != next_pop++) exit (1);
+    }
+  }
+}
+
+static void test_mpsc (void) {
+  struct mpsc_queue_t queue;
+  mpsc_queue_init (&queue);
+
+  if (mpsc_queue_pop (&queue) != NULL) exit (1);
+
+  /* Taking out the last element pushes the placeholder behind it, and the next pop skips the placeholder.
+     Repeat this, so that the placeholder is taken out and pushed again many times.
+   */
+  for (uint64_t i = 0; i < 16; ++i) {
+    items[i].value = i;
+    mpsc_queue_push (&queue, &items[i].node);
+    struct item * item = (struct item *) mpsc_queue_pop (&queue);
+    if (item != &items[i]) exit (1);
+    if (mpsc_queue_pop (&queue) != NULL) exit (1);
+  }
+
+  /* Elements come out in the order they were pushed, including those pushed while the placeholder is queued */
+  for (uint64_t i = 0; i < 16; ++i) mpsc_queue_push (&queue, &items[i].node);
+  for (uint64_t i = 0; i < 8; ++i) {
+    struct item * item = (struct item *) mpsc_queue_pop (&queue);
+    if (item == NULL || item->value != i) exit (1);
+  }
+  for (uint64_t i = 8; i < 16; ++i) {
+    struct item * item = (struct item *) mpsc_queue_pop (&queue);
+    if (item == NULL || item->value != i) exit (1);
+    /* Push the last element again, once it has been taken out */
+    if (i == 15) mpsc_queue_push (&queue, &item->node);
+  }
+  if (mpsc_queue_pop (&queue) != &items[15].node) exit (1);
+  if (mpsc_queue_pop (&queue) != NULL) exit (1);
+
+  /* A pre-linked list is appended as a whole */
+  for (uint64_t i = 0; i < 15; ++i) items[i].node.next = &items[i + 1].node;
+  mpsc_queue_push_list (&queue, &items[0].node, &items[15].node);
+  for (uint64_t i = 0; i < 16; ++i) {
+    if (mpsc_queue_pop (&queue) != &items[i].node) exit (1);
+  }
+  if (mpsc_queue_pop (&queue) != NULL) exit (1);
+}
+
+void main (__attribute__((unused)) void * sp) {
+  test_spsc ();
+  test_mpmc ();
+  test_mpsc ();
+  exit (0);
+}
@@ -12,7 +12,7 @@ void main (__attribute__((unused)) void * sp) {
 
   for (uint32_t i = 128; i < 256; ++i) {
     for (uint32_t j = i - 32; j < i + 32; ++j) {
-      for (uint32_t k = 0; k < 32; ++k) {
+      for (uint32_t k = 0; k < 256; ++k) {
 	char x = src[j + k];
 
 	memmove (src + j, src + i, k);
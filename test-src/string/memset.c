@@ -4,10 +4,10 @@
 #include <exit.h>
 
 void main (__attribute__((unused)) void * sp) {
-  char str[1024];
+  char str[4096];
   uint32_t ctr = 0;
 
-  getrandom (str, 1024, 0);
+  getrandom (str, 4096, 0);
 
   for (uint32_t i = 32; i < 64; ++i) {
     for (uint32_t j = 0; j < 256; ++j) {
@@ -29,5 +29,26 @@ void main (__attribute__((unused)) void * sp) {
     }
   }
 
+  /* Large zero fills, which may clear whole blocks with dc zva */
+  for (uint32_t i = 0; i < 64; ++i) {
+    for (uint32_t j = 0; j < 4000; j += 37) {
+      char x = str[i + j];
+
+      for (uint32_t k = 0; k < j; ++k) str[i + k] = 0xa5;
+
+      memset (str + i, 0, j);
+
+      for (uint32_t k = 0; k < j; ++k) {
+	if (str[i + k] != 0) {
+	  exit (1);
+	}
+      }
+
+      if (str[i + j] != x) {
+	exit (1);
+      }
+    }
+  }
+
   exit (0);
 }
@@ -0,0 +1,157 @@
+#include <stdint.h>
+#include <memory.h>
+#include <thread.h>
+#include <sync.h>
+#include <exit.h>
+
+#define THREAD_NUM 4
+#define ITERATIONS 100000
+
+static struct mutex_t mutex = MUTEX_INIT;
+static struct cond_t cond = COND_INIT;
+static struct rwlock_t rwlock = RWLOCK_INIT;
+
+static uint64_t counter;
+static uint32_t ready, go;
+static uint64_t a, b;
+
+static void spin (void) {
+  for (volatile uint32_t i = 0; i < 10000000; ++i);
+}
+
+/* Mutex and condition variable: every thread increments the counter under the mutex,
+   then waits on a barrier made of the condition variable, then mixes readers and writers on the rwlock
+ */
+static void * contend (void * arg) {
+  (void) arg;
+  for (uint32_t i = 0; i < ITERATIONS; ++i) {
+    mutex_lock (&mutex);
+    counter++;
+    mutex_unlock (&mutex);
+  }
+
+  mutex_lock (&mutex);
+  ready++;
+  cond_broadcast (&cond, &mutex);
+  while (!go) cond_wait (&cond, &mutex);
+  mutex_unlock (&mutex);
+
+  for (uint32_t i = 0; i < ITERATIONS; ++i) {
+    if (i % 10 == 0) {
+      rwlock_write_lock (&rwlock);
+      a++;
+      b++;
+      rwlock_write_unlock (&rwlock);
+    } else {
+      rwlock_read_lock (&rwlock);
+      if (a != b) exit (1);
+      rwlock_read_unlock (&rwlock);
+    }
+  }
+  return NULL;
+}
+
+static void test_contention (void) {
+  struct thread_t * threads[THREAD_NUM];
+  for (uint32_t i = 0; i < THREAD_NUM; ++i) {
+    threads[i] = thread_create (contend, NULL);
+    if (threads[i] == NULL) exit (1);
+  }
+
+  mutex_lock (&mutex);
+  while (ready < THREAD_NUM) cond_wait (&cond, &mutex);
+  go = 1;
+  cond_broadcast (&cond, &mutex);
+  mutex_unlock (&mutex);
+
+  for (uint32_t i = 0; i < THREAD_NUM; ++i) thread_join (threads[i]);
+  if (counter != THREAD_NUM * ITERATIONS) exit (1);
+  if (a != THREAD_NUM * (ITERATIONS / 10) || a != b) exit (1);
+  if (mutex.state != 0 || rwlock.state != 0) exit (1);
+}
+
+/* cond_signal wakes up one waiter at a time */
+
+static uint32_t tokens, consumed;
+
+static void * consume (void * arg) {
+  (void) arg;
+  mutex_lock (&mutex);
+  while (tokens == 0) cond_wait (&cond, &mutex);
+  tokens--;
+  consumed++;
+  mutex_unlock (&mutex);
+  return NULL;
+}
+
+static void test_signal (void) {
+  struct thread_t * threads[THREAD_NUM];
+  for (uint32_t i = 0; i < THREAD_NUM; ++i) {
+    threads[i] = thread_create (consume, NULL);
+    if (threads[i] == NULL) exit (1);
+  }
+
+  for (uint32_t i = 0; i < THREAD_NUM; ++i) {
+    mutex_lock (&mutex);
+    tokens++;
+    cond_signal (&cond);
+    mutex_unlock (&mutex);
+  }
+
+  for (uint32_t i = 0; i < THREAD_NUM; ++i) thread_join (threads[i]);
+  if (consumed != THREAD_NUM || tokens != 0) exit (1);
+}
+
+/* The rwlock prefers writers: once a writer waits, a new reader waits until the writer has had the lock */
+
+static uint32_t order[2], order_num, writer_started;
+
+static void * write_once (void * arg) {
+  (void) arg;
+  __atomic_store_n (&writer_started, 1, __ATOMIC_SEQ_CST);
+  rwlock_write_lock (&rwlock);
+  order[__atomic_fetch_add (&order_num, 1, __ATOMIC_SEQ_CST)] = 1;
+  rwlock_write_unlock (&rwlock);
+  return NULL;
+}
+
+static void * read_once (void * arg) {
+  (void) arg;
+  rwlock_read_lock (&rwlock);
+  order[__atomic_fetch_add (&order_num, 1, __ATOMIC_SEQ_CST)] = 2;
+  rwlock_read_unlock (&rwlock);
+  return NULL;
+}
+
+static void test_writer_preference (void) {
+  rwlock_read_lock (&rwlock);
+  struct thread_t * writer = thread_create (write_once, NULL);
+  if (writer == NULL) exit (1);
+  /* Give the writer time to start waiting */
+  while (!__atomic_load_n (&writer_started, __ATOMIC_SEQ_CST));
+  spin ();
+  struct thread_t * reader = thread_create (read_once, NULL);
+  if (reader == NULL) exit (1);
+  spin ();
+  if (__atomic_load_n (&order_num, __ATOMIC_SEQ_CST) != 0) exit (1);
+  rwlock_read_unlock (&rwlock);
+
+  thread_join (writer);
+  thread_join (reader);
+  if (order_num != 2 || order[0] != 1 || order[1] != 2) exit (1);
+  if (rwlock.state != 0) exit (1);
+}
+
+void main (__attribute__((unused)) void * sp) {
+  if (thread_register () == NULL) exit (1);
+
+  if (mutex_trylock (&mutex) != 1) exit (1);
+  if (mutex_trylock (&mutex) != 0) exit (1);
+  mutex_unlock (&mutex);
+
+  test_contention ();
+  test_signal ();
+  test_writer_preference ();
+
+  exit (0);
+}
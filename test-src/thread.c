@@ -0,0 +1,81 @@
+#include <stdint.h>
+#include <memory.h>
+#include <thread.h>
+#include <tls.h>
+#include <config.h>
+#include <exit.h>
+
+#define THREAD_NUM 16
+#define ROUNDS 4
+
+struct work {
+  uint64_t index;
+  uint16_t thread_id;
+  uint64_t sum;
+};
+
+/* Use a large part of the stack, and the allocator of the new thread */
+static void * run_work (void * arg) {
+  struct work * work = (struct work *) arg;
+  work->thread_id = get_thread_id ();
+
+  volatile uint8_t buf[LIBC_THREAD_STACK_SIZE / 2];
+  for (uint64_t i = 0; i < sizeof (buf); i += 4096) buf[i] = (uint8_t) (i >> 12);
+  uint64_t sum = 0;
+  for (uint64_t i = 0; i < sizeof (buf); i += 4096) sum += buf[i];
+
+  uint64_t * p = malloc (1000 * sizeof (uint64_t));
+  if (p == NULL) return NULL;
+  for (uint64_t i = 0; i < 1000; ++i) p[i] = work->index + i;
+  for (uint64_t i = 0; i < 1000; ++i) sum += p[i];
+  free (p);
+
+  work->sum = sum;
+  return work;
+}
+
+static uint64_t expected_sum (uint64_t index) {
+  uint64_t sum = 0;
+  for (uint64_t i = 0; i < LIBC_THREAD_STACK_SIZE / 2; i += 4096) sum += (uint8_t) (i >> 12);
+  for (uint64_t i = 0; i < 1000; ++i) sum += index + i;
+  return sum;
+}
+
+/* A thread may be joined by a thread other than the one that created it */
+static void * join_other (void * arg) {
+  return thread_join ((struct thread_t *) arg);
+}
+
+void main (__attribute__((unused)) void * sp) {
+  if (thread_register () == NULL) exit (1);
+
+  static struct work works[THREAD_NUM];
+  struct thread_t * threads[THREAD_NUM];
+
+  for (uint32_t round = 0; round < ROUNDS; ++round) {
+    for (uint32_t i = 0; i < THREAD_NUM; ++i) {
+      works[i].index = i;
+      works[i].sum = 0;
+      threads[i] = thread_create (run_work, &works[i]);
+      if (threads[i] == NULL) exit (1);
+    }
+
+    for (uint32_t i = 0; i < THREAD_NUM; ++i) {
+      if (thread_join (threads[i]) != &works[i]) exit (1);
+      if (works[i].sum != expected_sum (i)) exit (1);
+      if (works[i].thread_id == get_thread_id ()) exit (1);
+      /* Exited threads are adopted, so IDs stay below the number of threads that ever ran at the same time */
+      if (works[i].thread_id > THREAD_NUM) exit (1);
+    }
+  }
+
+  struct work work = { THREAD_NUM, 0, 0 };
+  struct thread_t * target = thread_create (run_work, &work);
+  if (target == NULL) exit (1);
+  struct thread_t * joiner = thread_create (join_other, target);
+  if (joiner == NULL) exit (1);
+  if (thread_join (joiner) != &work) exit (1);
+  if (work.sum != expected_sum (THREAD_NUM)) exit (1);
+
+  exit (0);
+}
@@ -0,0 +1,162 @@
+#include <stdint.h>
+#include <memory.h>
+#include <thread.h>
+#include <thread_pool.h>
+#include <config.h>
+#include <exit.h>
+
+#define RANGE_LEN 5000
+#define OVERFLOW_NUM (LIBC_THREAD_POOL_DEQUE_SIZE + 100)
+#define IN_FLIGHT_NUM 200
+
+static struct thread_pool_t * pool;
+
+/* Nested submit and join: every call above the cutoff submits one half and computes the other */
+
+struct fib_arg {
+  uint64_t n;
+  uint64_t result;
+};
+
+static void fib (void * arg_vp) {
+  struct fib_arg * arg = (struct fib_arg *) arg_vp;
+  if (arg->n < 10) {
+    uint64_t x = 0, y = 1;
+    for (uint64_t i = 0; i < arg->n; ++i) {
+      uint64_t t = x + y;
+      x = y;
+      y = t;
+    }
+    arg->result = x;
+    return;
+  }
+
+  struct fib_arg left = { arg->n - 1, 0 }, right = { arg->n - 2, 0 };
+  struct thread_pool_task * task = thread_pool_submit (pool, fib, &left);
+  if (task == NULL) exit (1);
+  fib (&right);
+  thread_pool_join (pool, task);
+  arg->result = left.result + right.result;
+}
+
+/* Parallel loops: each index must be visited exactly once, in ranges of at most grain iterations */
+
+static uint32_t hits[RANGE_LEN];
+static uint64_t max_range_len;
+
+static void visit_range (void * ctx, uint64_t begin, uint64_t end) {
+  (void) ctx;
+  for (uint64_t i = begin; i < end; ++i) __atomic_add_fetch (&hits[i], 1, __ATOMIC_RELAXED);
+
+  uint64_t len = end - begin;
+  uint64_t old = __atomic_load_n (&max_range_len, __ATOMIC_RELAXED);
+  while (len > old && !__atomic_compare_exchange_n (&max_range_len, &old, len, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void test_parallel_for (uint64_t grain) {
+  for (uint32_t i = 0; i < RANGE_LEN; ++i) hits[i] = 0;
+  max_range_len = 0;
+
+  thread_pool_parallel_for (pool, 0, RANGE_LEN, grain, visit_range, NULL);
+
+  for (uint32_t i = 0; i < RANGE_LEN; ++i) {
+    if (hits[i] != 1) exit (1);
+  }
+  if (max_range_len > grain) exit (1);
+}
+
+/* Nested parallel loops, called from tasks of an outer parallel loop */
+
+static uint64_t nested_sum;
+
+static void add_range (void * ctx, uint64_t begin, uint64_t end) {
+  (void) ctx;
+  uint64_t sum = 0;
+  for (uint64_t i = begin; i < end; ++i) sum += i;
+  __atomic_add_fetch (&nested_sum, sum, __ATOMIC_RELAXED);
+}
+
+static void run_inner_loops (void * ctx, uint64_t begin, uint64_t end) {
+  (void) ctx;
+  for (uint64_t i = begin; i < end; ++i) thread_pool_parallel_for (pool, 0, 1000, 7, add_range, NULL);
+}
+
+/* Deque overflow: with a single worker, nothing steals from its deque,
+   so the tasks it submits beyond the capacity of the deque are run right away
+ */
+
+static uint32_t overflow_done[OVERFLOW_NUM];
+
+static void mark_done (void * arg) {
+  __atomic_store_n ((uint32_t *) arg, 1, __ATOMIC_RELEASE);
+}
+
+static void submit_overflow (void * arg) {
+  (void) arg;
+  struct thread_pool_task ** tasks = malloc (OVERFLOW_NUM * sizeof (struct thread_pool_task *));
+  if (tasks == NULL) exit (1);
+
+  for (uint32_t i = 0; i < OVERFLOW_NUM; ++i) {
+    tasks[i] = thread_pool_submit (pool, mark_done, &overflow_done[i]);
+    if (tasks[i] == NULL) exit (1);
+    uint32_t done = __atomic_load_n (&overflow_done[i], __ATOMIC_ACQUIRE);
+    if (done != (i >= LIBC_THREAD_POOL_DEQUE_SIZE)) exit (1);
+  }
+
+  for (uint32_t i = 0; i < OVERFLOW_NUM; ++i) thread_pool_join (pool, tasks[i]);
+  for (uint32_t i = 0; i < OVERFLOW_NUM; ++i) {
+    if (!overflow_done[i]) exit (1);
+  }
+  free (tasks);
+}
+
+/* Destroying a pool waits for the tasks still in flight */
+
+static uint64_t in_flight_count;
+
+static void slow_task (void * arg) {
+  (void) arg;
+  for (volatile uint32_t i = 0; i < 10000; ++i);
+  __atomic_add_fetch (&in_flight_count, 1, __ATOMIC_RELAXED);
+}
+
+void main (__attribute__((unused)) void * sp) {
+  if (thread_register () == NULL) exit (1);
+
+  pool = thread_pool_create (4);
+  if (pool == NULL) exit (1);
+
+  struct fib_arg arg = { 25, 0 };
+  fib (&arg);
+  if (arg.result != 75025) exit (1);
+
+  test_parallel_for (1);
+  test_parallel_for (100);
+  test_parallel_for (1ull << 20);
+
+  thread_pool_parallel_for (pool, 0, 50, 1, run_inner_loops, NULL);
+  if (nested_sum != 50ull * 999 * 1000 / 2) exit (1);
+
+  thread_pool_destroy (pool);
+
+  pool = thread_pool_create (1);
+  if (pool == NULL) exit (1);
+  struct thread_pool_task * task = thread_pool_submit (pool, submit_overflow, NULL);
+  if (task == NULL) exit (1);
+  thread_pool_join (pool, task);
+  thread_pool_destroy (pool);
+
+  pool = thread_pool_create (2);
+  if (pool == NULL) exit (1);
+  struct thread_pool_task * tasks[IN_FLIGHT_NUM];
+  for (uint32_t i = 0; i < IN_FLIGHT_NUM; ++i) {
+    tasks[i] = thread_pool_submit (pool, slow_task, NULL);
+    if (tasks[i] == NULL) exit (1);
+  }
+  thread_pool_destroy (pool);
+  if (__atomic_load_n (&in_flight_count, __ATOMIC_RELAXED) != IN_FLIGHT_NUM) exit (1);
+  /* The handles stay valid after the pool is destroyed */
+  for (uint32_t i = 0; i < IN_FLIGHT_NUM; ++i) thread_pool_join (pool, tasks[i]);
+
+  exit (0);
+}
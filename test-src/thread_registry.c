@@ -0,0 +1,84 @@
+#include <stdint.h>
+#include <memory.h>
+#include <thread.h>
+#include <tls.h>
+#include <exit.h>
+
+#define N 1000
+
+struct registration {
+  struct tls_struct * tls;
+  uint16_t thread_id;
+  struct malloc_arena_t * arena;
+};
+
+static void * objs[N];
+
+static void record (struct registration * reg) {
+  reg->tls = (struct tls_struct *) get_thread_pointer ();
+  reg->thread_id = get_thread_id ();
+  reg->arena = reg->tls->malloc_arena;
+}
+
+/* Leave N allocations live in the arena of the thread, to be freed by the main thread once it is an orphan */
+static void * allocate_and_exit (void * arg) {
+  record ((struct registration *) arg);
+  for (uint32_t i = 0; i < N; ++i) {
+    objs[i] = malloc (16 + (i % 8) * 200);
+    if (objs[i] == NULL) return NULL;
+  }
+  return arg;
+}
+
+static void * adopt (void * arg) {
+  record ((struct registration *) arg);
+  /* The allocator of the adopted arena still works */
+  void * p = malloc (100);
+  if (p == NULL) return NULL;
+  free (p);
+  return arg;
+}
+
+static uint32_t count_threads (void) {
+  uint32_t num = 0;
+  for (struct tls_struct * tls = thread_iterate (NULL); tls != NULL; tls = thread_iterate (tls)) num++;
+  return num;
+}
+
+void main (__attribute__((unused)) void * sp) {
+  struct tls_struct * main_tls = thread_register ();
+  if (main_tls == NULL) exit (1);
+  if ((struct tls_struct *) get_thread_pointer () != main_tls) exit (1);
+  if (count_threads () != 1) exit (1);
+  if (thread_cpu_count () == 0) exit (1);
+
+  /* No orphan yet */
+  if (thread_drain_orphans () != 0) exit (1);
+
+  struct registration first, second;
+  struct thread_t * thread = thread_create (allocate_and_exit, &first);
+  if (thread == NULL) exit (1);
+  if (thread_join (thread) != &first) exit (1);
+  if (first.tls == main_tls || first.thread_id == main_tls->thread_id) exit (1);
+  if (count_threads () != 2) exit (1);
+
+  /* Free the allocations of the orphan; they are handed to its free set, and completed by thread_drain_orphans */
+  for (uint32_t i = 0; i < N; ++i) free (objs[i]);
+  clear_free_set ();
+  if (thread_drain_orphans () != 1) exit (1);
+
+  /* The next thread adopts the orphan, with its thread ID and its arena */
+  thread = thread_create (adopt, &second);
+  if (thread == NULL) exit (1);
+  if (thread_join (thread) != &second) exit (1);
+  if (second.tls != first.tls || second.thread_id != first.thread_id || second.arena != first.arena) exit (1);
+  if (count_threads () != 2) exit (1);
+
+  /* A thread unregistering and registering again adopts its own slot */
+  thread_unregister ();
+  if (thread_register () == NULL) exit (1);
+  if ((struct tls_struct *) get_thread_pointer () != main_tls && (struct tls_struct *) get_thread_pointer () != first.tls) exit (1);
+  if (count_threads () != 2) exit (1);
+
+  exit (0);
+}